@@ -1,8 +1,17 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <memory>
 #include <sstream>
+#include <limits>
+#include <exception>
+#include <vector>
+#include <cstdint>
+#include <chrono>
+#include <cctype>
+#include <iterator>
+#include <optional>
 #include <sqlite3/sqlite3.h>
 
 /**
@@ -40,6 +49,62 @@ namespace sqlitexx {
         }
     };
 
+    //! Receives every execution of statements prepared by a traced DB (see DB::trace()).
+    //! One tracer may be shared by several connections, so it must be thread safe.
+    class Tracer {
+    public:
+        struct Param {
+            int type = SQLITE_NULL;
+            int64_t i = 0;
+            double d = 0;
+            std::string s;
+        };
+
+        virtual ~Tracer() = default;
+
+        //! called before the first step of every execution with the parameters bound so far
+        virtual void statement(sqlite3_stmt* stmt, const std::vector<Param>& params) = 0;
+    };
+
+    //! Result column of a statement with the declared type and the table column it comes from.
+    //! The origin needs SQLite built with SQLITE_ENABLE_COLUMN_METADATA (the usual distribution
+    //! builds are); define SQLITEXX_NO_COLUMN_METADATA for libraries without it.
+    struct ColumnDesc {
+        //! type affinity of the declared type (https://sqlite.org/datatype3.html#type_affinity)
+        enum Affinity { BLOB, TEXT, NUMERIC, INTEGER, REAL };
+
+        std::string name;
+        std::string declared_type;          //!< empty for expressions
+        std::string database;               //!< database, table and column of the value,
+        std::string table;                  //!< empty for expressions
+        std::string origin;
+        bool nullable = true;               //!< false for NOT NULL origins (an outer join may still give NULL)
+        Affinity affinity = BLOB;
+
+        static Affinity affinity_of(std::string_view type) {
+            std::string t(type);
+            for (auto& c : t) {
+                c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+            }
+            auto has = [&t](const char* s) {
+                return t.find(s) != std::string::npos;
+            };
+            if (has("INT")) {
+                return INTEGER;
+            }
+            if (has("CHAR") || has("CLOB") || has("TEXT")) {
+                return TEXT;
+            }
+            if (t.empty() || has("BLOB")) {
+                return BLOB;
+            }
+            if (has("REAL") || has("FLOA") || has("DOUB")) {
+                return REAL;
+            }
+            return NUMERIC;
+        }
+    };
+
     class Statement {
         struct STMTFinalizer {
             void operator () (sqlite3_stmt* stmt) {
@@ -47,21 +112,107 @@ namespace sqlitexx {
             }
         };
 
+        struct Trace {
+            Tracer* tracer;
+            std::vector<Tracer::Param> params;
+        };
+
         std::unique_ptr<sqlite3_stmt, STMTFinalizer> stmt_;
+        // only traced statements pay for keeping copies of the parameters
+        std::unique_ptr<Trace> trace_;
+        std::unique_ptr<std::vector<ColumnDesc>> columns_;
+        int columns_prepare_ = 0;      // SQLITE_STMTSTATUS_REPREPARE when columns_ was made
+
+        Tracer::Param& traced_param(unsigned pos) {
+            if (trace_->params.size() < pos) {
+                trace_->params.resize(pos);
+            }
+            return trace_->params[pos - 1];
+        }
+
+        void trace_int(unsigned pos, int64_t x) {
+            if (trace_ && pos > 0) {
+                Tracer::Param& p = traced_param(pos);
+                p.type = SQLITE_INTEGER;
+                p.i = x;
+            }
+        }
+
+        void trace_execution() {
+            // a statement which is not busy starts a new execution on this step
+            if (trace_ && !sqlite3_stmt_busy(stmt_.get())) {
+                trace_->tracer->statement(stmt_.get(), trace_->params);
+            }
+        }
+
     public:
         Statement(sqlite3_stmt* stmt) : stmt_(stmt) {
         }
 
+        Statement(sqlite3_stmt* stmt, Tracer* tracer) : stmt_(stmt) {
+            if (tracer) {
+                trace_.reset(new Trace{tracer, {}});
+            }
+        }
+
         Statement(const Statement& st) = delete;
         Statement(Statement&& st) = default;
         Statement& operator = (const Statement& st) = delete;
         Statement& operator = (Statement&& st) = default;
 
+        sqlite3_stmt* get() {
+            return stmt_.get();
+        }
+
         void bind(unsigned pos, const std::string& value) {
             int res;
             if ((res = sqlite3_bind_text(stmt_.get(), pos, value.c_str(), value.size(), SQLITE_TRANSIENT)) != SQLITE_OK) {
                 throw Error(res, "bind failed");
             }
+            if (trace_) {
+                Tracer::Param& p = traced_param(pos);
+                p.type = SQLITE_TEXT;
+                p.s = value;
+            }
+        }
+
+        void bind_blob(unsigned pos, std::string_view value) {
+            int res;
+            if ((res = sqlite3_bind_blob(stmt_.get(), pos, value.data(), value.size(), SQLITE_TRANSIENT)) != SQLITE_OK) {
+                throw Error(res, "bind failed");
+            }
+            if (trace_) {
+                Tracer::Param& p = traced_param(pos);
+                p.type = SQLITE_BLOB;
+                p.s = value;
+            }
+        }
+
+        //! Text bound without a copy: value must stay unchanged until the statement is stepped for
+        //! the last time with it (or bound again). For buffers reused across many executions.
+        void bind_static(unsigned pos, std::string_view value) {
+            int res;
+            if ((res = sqlite3_bind_text(stmt_.get(), pos, value.data(), value.size(), SQLITE_STATIC)) != SQLITE_OK) {
+                throw Error(res, "bind failed");
+            }
+            if (trace_) {
+                Tracer::Param& p = traced_param(pos);
+                p.type = SQLITE_TEXT;
+                p.s = value;
+            }
+        }
+
+        //! blob bound without a copy, see bind_static()
+        void bind_blob_static(unsigned pos, std::string_view value) {
+            int res;
+            if ((res = sqlite3_bind_blob(stmt_.get(), pos, value.data(), value.size(), SQLITE_STATIC)) != SQLITE_OK) {
+                throw Error(res, "bind failed");
+            }
+            if (trace_) {
+                Tracer::Param& p = traced_param(pos);
+                p.type = SQLITE_BLOB;
+                p.s = value;
+            }
         }
 
         void bind(unsigned pos, bool x) {
@@ -69,6 +220,7 @@ namespace sqlitexx {
             if ((res = sqlite3_bind_int(stmt_.get(), pos, x)) != SQLITE_OK) {
                 throw Error(res, "bind failed");
             }
+            trace_int(pos, x);
         }
 
         void bind(unsigned pos, int32_t x) {
@@ -76,6 +228,7 @@ namespace sqlitexx {
             if ((res = sqlite3_bind_int(stmt_.get(), pos, x)) != SQLITE_OK) {
                 throw Error(res, "bind failed");
             }
+            trace_int(pos, x);
         }
 
         void bind(unsigned pos, int64_t x) {
@@ -83,6 +236,7 @@ namespace sqlitexx {
             if ((res = sqlite3_bind_int64(stmt_.get(), pos, x)) != SQLITE_OK) {
                 throw Error(res, "bind failed");
             }
+            trace_int(pos, x);
         }
 
         void bind(unsigned pos, std::nullptr_t) {
@@ -90,6 +244,9 @@ namespace sqlitexx {
             if ((res = sqlite3_bind_null(stmt_.get(), pos)) != SQLITE_OK) {
                 throw Error(res, "bind failed: ");
             }
+            if (trace_) {
+                traced_param(pos) = Tracer::Param{};
+            }
         }
 
         void bind(unsigned pos, double x) {
@@ -97,6 +254,11 @@ namespace sqlitexx {
             if ((res = sqlite3_bind_double(stmt_.get(), pos, x)) != SQLITE_OK) {
                 throw Error(res, "bind failed");
             }
+            if (trace_) {
+                Tracer::Param& p = traced_param(pos);
+                p.type = SQLITE_FLOAT;
+                p.d = x;
+            }
         }
 
         template <typename T>
@@ -109,25 +271,44 @@ namespace sqlitexx {
             bind(static_cast<unsigned>(n), std::forward<T>(x));
         }
 
-        //! execute query and return single result (for select) or empty string (for other queries)
+        //! Reset to the start so the statement can run again, bindings are kept. It ends the read
+        //! transaction of an unfinished query, so checkpoints are not blocked by it.
+        void reset() {
+            // the result is the error of the last step, it was reported there already
+            sqlite3_reset(stmt_.get());
+        }
+
+        //! set all parameters to NULL
+        void clear_bindings() {
+            sqlite3_clear_bindings(stmt_.get());
+            if (trace_) {
+                trace_->params.clear();
+            }
+        }
+
+        //! Execute query and return single result (for select) or empty string (for other queries).
+        //! The statement is reset afterwards, ready to run again.
         std::string exec() {
+            trace_execution();
             int res = sqlite3_step(stmt_.get());
 
             if (res == SQLITE_DONE) {
+                reset();
                 return "";
             } else if (res == SQLITE_ROW) {
+                std::string result;
                 // Here we should take only one value from row:
                 if (sqlite3_column_count(stmt_.get())) {
                     const char* data = (const char*)sqlite3_column_text(stmt_.get(), 0);
-                    if (!data) {
-                        return "";
+                    if (data) {
+                        result = data;
                     }
-
-                    return std::string{data};
                 }
 
-                return "";
+                reset();
+                return result;
             } else {
+                reset();
                 throw Error(res, "execution failed");
             }
         }
@@ -174,16 +355,31 @@ namespace sqlitexx {
             }
 
             std::string as_text() {
+                // sqlite3_column_type() is undefined after a conversion, so only the converted bytes are used here
                 const char* data = reinterpret_cast<const char*>(sqlite3_column_text(stmt_, index_));
                 if (!data)
                     return "";
 
-                if (is_text() || is_blob()) {
-                    size_t len = sqlite3_column_bytes(stmt_, index_);
-                    return std::string{data, len};
-                } else {
-                    return std::string{data};
-                }
+                size_t len = sqlite3_column_bytes(stmt_, index_);
+                return std::string{data, len};
+            }
+
+            //! text without a copy, valid until the next step, reset or conversion of this column
+            std::string_view as_text_view() {
+                const char* data = reinterpret_cast<const char*>(sqlite3_column_text(stmt_, index_));
+                if (!data)
+                    return std::string_view{};
+
+                return std::string_view{data, static_cast<size_t>(sqlite3_column_bytes(stmt_, index_))};
+            }
+
+            //! text converted to UTF-16 by SQLite (see sqlitexx_utf.h for the checked conversion)
+            std::u16string as_text16() {
+                const char16_t* data = reinterpret_cast<const char16_t*>(sqlite3_column_text16(stmt_, index_));
+                if (!data)
+                    return std::u16string{};
+
+                return std::u16string{data, static_cast<size_t>(sqlite3_column_bytes16(stmt_, index_)) / 2};
             }
 
             bool is_blob() {
@@ -200,6 +396,15 @@ namespace sqlitexx {
                 return std::string{data, len};
             }
 
+            //! blob without a copy, valid until the next step, reset or conversion of this column
+            std::string_view as_blob_view() {
+                const char* data = reinterpret_cast<const char*>(sqlite3_column_blob(stmt_, index_));
+                if (!data)
+                    return std::string_view{};
+
+                return std::string_view{data, static_cast<size_t>(sqlite3_column_bytes(stmt_, index_))};
+            }
+
             operator double () {
                 return as_double();
             }
@@ -209,7 +414,11 @@ namespace sqlitexx {
             }
 
             operator int () {
-                return as_int();
+                int64_t x = as_int();
+                if (x < std::numeric_limits<int>::min() || x > std::numeric_limits<int>::max()) {
+                    throw Error(SQLITE_RANGE, "value ", x, " is out of int range");
+                }
+                return static_cast<int>(x);
             }
 
             operator long() {
@@ -229,62 +438,243 @@ namespace sqlitexx {
             return sqlite3_column_count(stmt_.get());
         }
 
+        //! Descriptors of the result columns, computed on the first call and kept with the statement
+        //! until a schema change makes SQLite prepare it again (references to the old ones dangle then).
+        const std::vector<ColumnDesc>& columns() {
+            int prepared = sqlite3_stmt_status(stmt_.get(), SQLITE_STMTSTATUS_REPREPARE, 0);
+            if (columns_ && prepared == columns_prepare_) {
+                return *columns_;
+            }
+
+            auto text = [](const char* s) {
+                return std::string(s ? s : "");
+            };
+            sqlite3_stmt* st = stmt_.get();
+            std::unique_ptr<std::vector<ColumnDesc>> res(new std::vector<ColumnDesc>(sqlite3_column_count(st)));
+            for (int i = 0; i < static_cast<int>(res->size()); ++i) {
+                ColumnDesc& c = (*res)[i];
+                c.name = text(sqlite3_column_name(st, i));
+                c.declared_type = text(sqlite3_column_decltype(st, i));
+                c.affinity = ColumnDesc::affinity_of(c.declared_type);
+#ifndef SQLITEXX_NO_COLUMN_METADATA
+                c.database = text(sqlite3_column_database_name(st, i));
+                c.table = text(sqlite3_column_table_name(st, i));
+                c.origin = text(sqlite3_column_origin_name(st, i));
+                if (!c.table.empty()) {
+                    int not_null = 0;
+                    if (sqlite3_table_column_metadata(sqlite3_db_handle(st), c.database.c_str(), c.table.c_str(), c.origin.c_str(),
+                            nullptr, nullptr, &not_null, nullptr, nullptr) == SQLITE_OK) {
+                        c.nullable = !not_null;
+                    }
+                }
+#endif
+            }
+            columns_ = std::move(res);
+            columns_prepare_ = prepared;
+            return *columns_;
+        }
+
+        //! counters of sqlite3_stmt_status()
+        struct Stats {
+            int fullscan_steps = 0;     //!< forward steps of full table scans
+            int sorts = 0;              //!< sort operations (ORDER BY, GROUP BY, DISTINCT without an index)
+            int autoindex = 0;          //!< rows inserted into automatic indexes
+            int vm_steps = 0;           //!< virtual machine operations
+            int reprepares = 0;         //!< never reset, columns() depends on it
+            int runs = 0;
+            int memory = 0;             //!< bytes used by the statement
+        };
+
+        Stats stats(bool reset = false) {
+            sqlite3_stmt* st = stmt_.get();
+            Stats res;
+            res.fullscan_steps = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_FULLSCAN_STEP, reset);
+            res.sorts = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_SORT, reset);
+            res.autoindex = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_AUTOINDEX, reset);
+            res.vm_steps = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_VM_STEP, reset);
+            res.reprepares = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_REPREPARE, false);
+            res.runs = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_RUN, reset);
+            res.memory = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_MEMUSED, false);
+            return res;
+        }
+
+        //! Next row; false when the query is done. Finished and failed statements are reset, so
+        //! the next step() runs the statement again.
         bool step() {
+            trace_execution();
             int res = sqlite3_step(stmt_.get());
             if (res == SQLITE_ROW) {
                 return true;
             }
 
+            reset();
             if (res == SQLITE_DONE)
                 return false;
 
             throw Error(res, "execution failed");
         }
 
-        struct iterator {
-            Statement& stmt;
-            bool the_end = false;
+        //! Resumable execution: step at most max_rows rows (0 is no limit) or until max_time passed
+        //! (0 is no limit), calling on_row(*this) for each. Returns true when the statement is done and
+        //! false if the budget ran out; the next call continues from the same row.
+        //! The time is checked after each row, so every call makes progress by at least one row and
+        //! may overrun by one step: a step can't be cut short without aborting the statement, and
+        //! the first step of a sort or an aggregate does most of the work.
+        template <typename F>
+        bool step_n(size_t max_rows, std::chrono::nanoseconds max_time, F&& on_row) {
+            auto deadline = std::chrono::steady_clock::now() + max_time;
+            for (size_t n = 0; !max_rows || n < max_rows; ) {
+                if (!step()) {
+                    return true;
+                }
+                on_row(*this);
+                ++n;
+                if (max_time.count() && std::chrono::steady_clock::now() >= deadline) {
+                    break;
+                }
+            }
+            return false;
+        }
 
-            iterator(Statement& st, bool end) : stmt(st), the_end(end) {
+        //! Run to completion in step_n() slices and call yield() between them, so a cooperative
+        //! scheduler can run other tasks (on this thread or this connection) while a long query runs.
+        template <typename F, typename Y>
+        void run_cooperative(size_t max_rows, std::chrono::nanoseconds max_time, F&& on_row, Y&& yield) {
+            while (!step_n(max_rows, max_time, on_row)) {
+                yield();
             }
+        }
+
+        //! end of the rows, compares equal to an iterator after the last row
+        struct sentinel {
+        };
 
-            Statement& operator * () {
-                return stmt;
+        //! Single-pass input iterator over the rows, all iterators refer to the statement itself.
+        //! Increment steps the statement; it throws only if the step fails, reaching the end is
+        //! a plain comparison with the sentinel.
+        class iterator {
+            Statement* stmt_ = nullptr;     // nullptr after the last row
+
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using iterator_concept = std::input_iterator_tag;
+            using value_type = Statement;
+            using difference_type = std::ptrdiff_t;
+            using reference = Statement&;
+            using pointer = Statement*;
+
+            iterator() = default;
+
+            explicit iterator(Statement* st) : stmt_(st) {
             }
 
-            Statement* operator -> () {
-                return &stmt;
+            Statement& operator * () const {
+                return *stmt_;
+            }
+
+            Statement* operator -> () const {
+                return stmt_;
             }
 
             iterator& operator ++ () {
-                if (!stmt.step())
-                    the_end = true;
+                if (!stmt_->step()) {
+                    stmt_ = nullptr;
+                }
                 return *this;
             }
 
-            bool operator == (const iterator& it) const {
-                return (it.the_end && the_end);
+            void operator ++ (int) {
+                ++*this;
+            }
+
+            friend bool operator == (const iterator& a, const iterator& b) {
+                return a.stmt_ == b.stmt_;
+            }
+
+            friend bool operator != (const iterator& a, const iterator& b) {
+                return a.stmt_ != b.stmt_;
+            }
+
+            friend bool operator == (const iterator& it, sentinel) {
+                return !it.stmt_;
+            }
+
+            friend bool operator != (const iterator& it, sentinel) {
+                return it.stmt_ != nullptr;
             }
 
-            bool operator != (const iterator& it) const {
-                return !operator==(it);
+            friend bool operator == (sentinel, const iterator& it) {
+                return !it.stmt_;
+            }
+
+            friend bool operator != (sentinel, const iterator& it) {
+                return it.stmt_ != nullptr;
             }
         };
 
+        //! Run the query from the first row (an unfinished run is reset) and point to that row.
         iterator begin() {
-            return iterator{*this, false};
+            if (sqlite3_stmt_busy(stmt_.get())) {
+                reset();
+            }
+            return step() ? iterator(this) : iterator();
+        }
+
+        sentinel end() {
+            return sentinel{};
+        }
+
+        //! rows of the statement as a range, an unfinished iteration is reset with the range
+        class Rows {
+            Statement& stmt_;
+
+        public:
+            explicit Rows(Statement& st) : stmt_(st) {
+            }
+
+            Rows(const Rows&) = delete;
+            Rows& operator = (const Rows&) = delete;
+
+            ~Rows() {
+                stmt_.reset();
+            }
+
+            iterator begin() {
+                return stmt_.begin();
+            }
+
+            sentinel end() {
+                return sentinel{};
+            }
+        };
+
+        Rows rows() {
+            return Rows(*this);
         }
+    };
 
-        iterator end() {
-            return iterator{*this, true};
+    //! resets the statement when the scope ends, whatever way it ends
+    class ResetGuard {
+        Statement& stmt_;
+
+    public:
+        explicit ResetGuard(Statement& st) : stmt_(st) {
         }
 
+        ResetGuard(const ResetGuard&) = delete;
+        ResetGuard& operator = (const ResetGuard&) = delete;
+
+        ~ResetGuard() {
+            stmt_.reset();
+        }
     };
 
     //! Transaction which commits automatically
     class Transaction {
         sqlite3* db_ = nullptr;
+        Tracer* tracer_ = nullptr;
         bool done_ = false;
+        int uncaught_ = 0;
 
         int exec(const char* sql) {
             sqlite3_stmt* stmt = nullptr;
@@ -293,6 +683,9 @@ namespace sqlitexx {
             if (res != SQLITE_OK) {
                 return res;
             }
+            if (tracer_) {
+                tracer_->statement(stmt, std::vector<Tracer::Param>{});
+            }
             res = sqlite3_step(stmt);
             sqlite3_finalize(stmt);
 
@@ -304,37 +697,27 @@ namespace sqlitexx {
         }
 
         // TODO: use SAVEPOINTS so nested transactions would work
+        // BUSY is returned after the busy handler of the connection gave up (set a busy timeout to
+        // wait for readers), the transaction stays open then
         bool try_commit(bool exc) {
-            for (;;) {
-                int res = exec("COMMIT;");
-                if (res == SQLITE_OK) {
-                    done_ = true;
-                    return true;
-                }
-
-                if (res != SQLITE_BUSY) {
-                    if (exc) {
-                        throw Error(res, "commit failed");
-                    } else {
-                        return false;
-                    }
-                }
+            int res = exec("COMMIT;");
+            if (res == SQLITE_OK) {
+                done_ = true;
+                return true;
             }
+            if (exc) {
+                throw Error(res, "commit failed");
+            }
+            return false;
         }
 
     public:
         Transaction(const Transaction& t) = delete;
         Transaction& operator = (const Transaction& t) = delete;
 
-        Transaction(Transaction&& t) {
-            if (db_ && !done_) {
-                commit();
-            }
-
-            db_ = t.db_;
-            done_ = t.done_;
-
+        Transaction(Transaction&& t) : db_(t.db_), tracer_(t.tracer_), done_(t.done_), uncaught_(t.uncaught_) {
             t.db_ = nullptr;
+            t.done_ = true;
         }
 
         Transaction& operator = (Transaction&& t) {
@@ -343,24 +726,36 @@ namespace sqlitexx {
             }
 
             db_ = t.db_;
+            tracer_ = t.tracer_;
             done_ = t.done_;
+            uncaught_ = t.uncaught_;
 
             t.db_ = nullptr;
+            t.done_ = true;
 
             return *this;
         }
 
-        Transaction(sqlite3* db) : db_(db) {
+        Transaction(sqlite3* db, Tracer* tracer = nullptr) : db_(db), tracer_(tracer), uncaught_(std::uncaught_exceptions()) {
             int res;
             if ((res = exec("BEGIN TRANSACTION;")) != SQLITE_OK)
                 throw Error(res, "can't begin transaction");
             done_ = false;
         }
 
+        //! commits unless destroyed by an exception; a failed commit is rolled back
         ~Transaction() {
-            try_commit(false);
+            if (!db_ || done_) {
+                return;
+            }
+
+            if (std::uncaught_exceptions() > uncaught_ || !try_commit(false)) {
+                exec("ROLLBACK;");
+            }
         }
 
+        //! throws SQLITE_BUSY if readers keep the database locked past the busy timeout; the
+        //! transaction stays open, commit() may be called again
         void commit() {
             try_commit(true);
         }
@@ -374,6 +769,101 @@ namespace sqlitexx {
         }
     };
 
+    //! Connection settings for DB::configure(), negative values keep the current setting.
+    struct DBOptions {
+        int temp_store = -1;            //!< 0 default, 1 file, 2 memory (PRAGMA temp_store)
+        int cache_spill = -1;           //!< 0 keeps dirty pages in memory, >0 spills above so many pages
+        int cache_size = 0;             //!< pages if positive, KiB if negative, 0 keeps (PRAGMA cache_size)
+        //! Helper threads for sorting (SQLITE_LIMIT_WORKER_THREADS), capped by SQLITE_MAX_WORKER_THREADS.
+        //! They are used only by sorts too large for the cache, which are merged from temp files.
+        int worker_threads = -1;
+    };
+
+    //! identifier quoted for SQL text: "name" with the quotes in it doubled
+    inline std::string quote_identifier(std::string_view name) {
+        std::string res = "\"";
+        for (char c : name) {
+            res += c;
+            if (c == '"') {
+                res += c;
+            }
+        }
+        return res + "\"";
+    }
+
+    //! SQL identifiers compare case-insensitively (ASCII only)
+    inline bool same_identifier(std::string_view a, std::string_view b) {
+        return a.size() == b.size() && sqlite3_strnicmp(a.data(), b.data(), static_cast<int>(a.size())) == 0;
+    }
+
+    //! column of a table (PRAGMA table_xinfo)
+    struct ColumnInfo {
+        std::string name;
+        std::string type;                           //!< declared type, empty if none
+        bool not_null = false;
+        std::optional<std::string> default_value;   //!< SQL text of the default
+        int pk = 0;                                 //!< position in the primary key from 1, 0 if not in it
+        bool hidden = false;                        //!< generated or hidden column
+    };
+
+    //! index of a table (PRAGMA index_list and index_info)
+    struct IndexInfo {
+        std::string name;
+        bool unique = false;
+        std::string origin;                         //!< "c" CREATE INDEX, "u" UNIQUE constraint, "pk" PRIMARY KEY
+        bool partial = false;
+        std::vector<std::string> columns;           //!< key columns in order, empty names for expressions
+    };
+
+    //! foreign key (PRAGMA foreign_key_list)
+    struct ForeignKey {
+        std::string table;                          //!< parent table
+        std::vector<std::string> from;
+        std::vector<std::string> to;                //!< empty names refer to the primary key of the parent
+        std::string on_update;
+        std::string on_delete;
+    };
+
+    struct TableInfo {
+        std::string name;
+        std::vector<ColumnInfo> columns;
+        std::vector<IndexInfo> indexes;
+        std::vector<ForeignKey> foreign_keys;
+
+        const ColumnInfo* column(std::string_view name) const {
+            for (const auto& c : columns) {
+                if (same_identifier(c.name, name)) {
+                    return &c;
+                }
+            }
+            return nullptr;
+        }
+
+        const IndexInfo* index(std::string_view name) const {
+            for (const auto& i : indexes) {
+                if (same_identifier(i.name, name)) {
+                    return &i;
+                }
+            }
+            return nullptr;
+        }
+    };
+
+    //! tables of the main database at one schema version, see DB::schema()
+    struct Schema {
+        int version = 0;                            //!< PRAGMA schema_version
+        std::vector<TableInfo> tables;              //!< ordered by name, internal sqlite_ tables excluded
+
+        const TableInfo* table(std::string_view name) const {
+            for (const auto& t : tables) {
+                if (same_identifier(t.name, name)) {
+                    return &t;
+                }
+            }
+            return nullptr;
+        }
+    };
+
     class DB {
         struct DBCloser {
             void operator () (sqlite3* db) const {
@@ -382,6 +872,10 @@ namespace sqlitexx {
         };
 
         std::unique_ptr<sqlite3, DBCloser> db_;
+        Tracer* tracer_ = nullptr;
+        // declared after db_: statements have to be finalized before the connection is closed
+        std::unique_ptr<Statement> schema_version_;
+        std::shared_ptr<const Schema> schema_;
 
         void bind_all(Statement&, unsigned) const {
         }
@@ -392,6 +886,67 @@ namespace sqlitexx {
             bind_all(stmt, idx + 1, std::forward<A>(args)...);
         }
 
+        std::shared_ptr<Schema> read_schema() {
+            auto res = std::make_shared<Schema>();
+            auto tables = prepare("SELECT name FROM sqlite_master WHERE type = 'table' AND name NOT LIKE 'sqlite\\_%' ESCAPE '\\' ORDER BY name;");
+            auto columns = prepare("SELECT name, type, \"notnull\", dflt_value, pk, hidden FROM pragma_table_xinfo(?) ORDER BY cid;");
+            auto indexes = prepare("SELECT name, \"unique\", origin, partial FROM pragma_index_list(?) ORDER BY seq;");
+            auto index_columns = prepare("SELECT name FROM pragma_index_info(?) ORDER BY seqno;");
+            auto keys = prepare("SELECT id, \"table\", \"from\", \"to\", on_update, on_delete FROM pragma_foreign_key_list(?) ORDER BY id, seq;");
+
+            for (auto& t : tables) {
+                TableInfo table;
+                table.name = t[0].as_text();
+
+                columns.bind(1, table.name);
+                for (auto& c : columns) {
+                    ColumnInfo col;
+                    col.name = c[0].as_text();
+                    col.type = c[1].as_text();
+                    col.not_null = c[2].as_int() != 0;
+                    if (c[3].type() != SQLITE_NULL) {
+                        col.default_value = c[3].as_text();
+                    }
+                    col.pk = static_cast<int>(c[4].as_int());
+                    col.hidden = c[5].as_int() != 0;
+                    table.columns.push_back(std::move(col));
+                }
+
+                indexes.bind(1, table.name);
+                for (auto& i : indexes) {
+                    IndexInfo index;
+                    index.name = i[0].as_text();
+                    index.unique = i[1].as_int() != 0;
+                    index.origin = i[2].as_text();
+                    index.partial = i[3].as_int() != 0;
+                    table.indexes.push_back(std::move(index));
+                }
+                for (auto& index : table.indexes) {
+                    index_columns.bind(1, index.name);
+                    for (auto& c : index_columns) {
+                        index.columns.push_back(c[0].as_text());
+                    }
+                }
+
+                keys.bind(1, table.name);
+                int64_t id = -1;
+                for (auto& k : keys) {
+                    if (k[0].as_int() != id) {
+                        id = k[0].as_int();
+                        table.foreign_keys.emplace_back();
+                        table.foreign_keys.back().table = k[1].as_text();
+                        table.foreign_keys.back().on_update = k[4].as_text();
+                        table.foreign_keys.back().on_delete = k[5].as_text();
+                    }
+                    table.foreign_keys.back().from.push_back(k[2].as_text());
+                    table.foreign_keys.back().to.push_back(k[3].as_text());
+                }
+
+                res->tables.push_back(std::move(table));
+            }
+            return res;
+        }
+
     public:
         //! open memory database.
         DB() {
@@ -403,6 +958,11 @@ namespace sqlitexx {
             open(name);
         }
 
+        //! open database with sqlite3_open_v2() flags and optional VFS name.
+        DB(const std::string& name, int flags, const char* vfs = nullptr) {
+            open(name, flags, vfs);
+        }
+
         //! create wrapper for opened database.
         DB(sqlite3* db) : db_(db) {
         }
@@ -415,11 +975,19 @@ namespace sqlitexx {
 
         //! open database:
         void open(const std::string& name) {
+            open(name, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        }
+
+        void open(const std::string& name, int flags, const char* vfs = nullptr) {
             sqlite3* db = nullptr;
             int res;
-            if ((res = sqlite3_open(name.c_str(), &db)) != SQLITE_OK) {
-                throw Error(res, "sqlite3 error");
+            if ((res = sqlite3_open_v2(name.c_str(), &db, flags, vfs)) != SQLITE_OK) {
+                // handle is allocated even if open failed
+                sqlite3_close(db);
+                throw Error(res, "can't open database '", name, "'");
             }
+            schema_version_.reset();
+            schema_.reset();
             db_.reset(db);
         }
 
@@ -437,7 +1005,7 @@ namespace sqlitexx {
                 throw Error(res, "prepare failed");
             }
 
-            return Statement(st);
+            return Statement(st, tracer_);
         }
 
         template <typename...A>
@@ -450,7 +1018,62 @@ namespace sqlitexx {
         }
 
         Transaction transaction() {
-            return Transaction(db_.get());
+            return Transaction(db_.get(), tracer_);
+        }
+
+        //! Report executions of statements prepared from now on to tracer (nullptr stops tracing).
+        //! The tracer must outlive these statements.
+        void trace(Tracer* tracer) {
+            tracer_ = tracer;
+        }
+
+        void configure(const DBOptions& opts) {
+            if (opts.temp_store >= 0) {
+                prepare("PRAGMA temp_store=" + std::to_string(opts.temp_store) + ";").exec();
+            }
+            if (opts.cache_spill >= 0) {
+                prepare("PRAGMA cache_spill=" + std::to_string(opts.cache_spill) + ";").exec();
+            }
+            if (opts.cache_size) {
+                prepare("PRAGMA cache_size=" + std::to_string(opts.cache_size) + ";").exec();
+            }
+            if (opts.worker_threads >= 0) {
+                sqlite3_limit(db_.get(), SQLITE_LIMIT_WORKER_THREADS, opts.worker_threads);
+            }
+        }
+
+        //! sorter helper threads actually allowed
+        int worker_threads() {
+            return sqlite3_limit(db_.get(), SQLITE_LIMIT_WORKER_THREADS, -1);
+        }
+
+        //! Tables of the main database with their columns, indexes and foreign keys. The snapshot is
+        //! cached and read again only when PRAGMA schema_version changes, so a call costs one cookie
+        //! read by a prepared statement. Returned snapshots stay valid after the schema changes.
+        std::shared_ptr<const Schema> schema() {
+            if (!schema_version_) {
+                schema_version_.reset(new Statement(prepare("PRAGMA schema_version;")));
+            }
+            for (;;) {
+                int version = std::stoi(schema_version_->exec());
+                if (schema_ && schema_->version == version) {
+                    return schema_;
+                }
+                auto res = read_schema();
+                res->version = version;
+                // another connection may have changed the schema while it was read
+                if (std::stoi(schema_version_->exec()) == version) {
+                    schema_ = std::move(res);
+                    return schema_;
+                }
+            }
+        }
+
+        //! Directory for temp files of all connections of the process (sqlite3_temp_directory), empty
+        //! restores the default. Not thread safe: call it before opening connections.
+        static void set_temp_directory(const std::string& dir) {
+            sqlite3_free(sqlite3_temp_directory);
+            sqlite3_temp_directory = dir.empty() ? nullptr : sqlite3_mprintf("%s", dir.c_str());
         }
     };
 
@@ -0,0 +1,750 @@
+#pragma once
+
+#include "sqlitexx.h"
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef SQLITEXX_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef SQLITEXX_WITH_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#ifdef SQLITEXX_WITH_LZ4
+#include <lz4.h>
+#endif
+
+/**
+ * Compressed columns.
+ *
+ * Compression registers sqlitexx_compress(value [, table]) and sqlitexx_decompress(value) on a
+ * connection, so large TEXT and BLOB columns can be stored compressed and read back in SQL (for
+ * example through a view), and offers the same conversions for binds and reads in C++ with
+ * reused buffers. Compressed values are BLOBs starting with a magic marker and a small header
+ * naming the codec and the dictionary; NULLs and numbers pass through both functions, and so do
+ * text and blobs without the marker on decompression, which lets a column be converted gradually.
+ *
+ * Dictionaries are trained per table from sample values and kept in the sqlitexx_dictionaries
+ * table; they help most with many small similar values (JSON documents, log lines). Old values
+ * keep the dictionary they were written with; dictionaries trained by other connections are
+ * loaded when a value needs them.
+ *
+ * The codecs are opt-in: zlib, zstd and lz4 are used when SQLITEXX_WITH_ZLIB (link with -lz),
+ * SQLITEXX_WITH_ZSTD (-lzstd) and SQLITEXX_WITH_LZ4 (-llz4) are defined. Without any of them
+ * the default codec is "raw", which stores values uncompressed (with the header, so they can be
+ * recompressed once a codec is built in).
+ */
+
+namespace sqlitexx {
+
+    //! dictionary of a codec, id 0 is no dictionary
+    struct Dictionary {
+        uint32_t id = 0;
+        std::string data;
+    };
+
+    class Codec {
+    public:
+        enum Id { RAW = 0, ZLIB = 1, ZSTD = 2, LZ4 = 3 };
+
+        virtual ~Codec() = default;
+
+        virtual Id id() const = 0;
+
+        virtual const char* name() const = 0;
+
+        //! append compressed in to out
+        virtual void compress(std::string_view in, const Dictionary& dict, std::string& out) = 0;
+
+        //! decompress in into exactly size bytes at out
+        virtual void decompress(std::string_view in, const Dictionary& dict, char* out, size_t size) = 0;
+
+        //! largest useful dictionary
+        virtual size_t max_dictionary() const = 0;
+
+        virtual std::string train(const std::vector<std::string>& samples, size_t size);
+    };
+
+    namespace compress_detail {
+
+        inline void put_varint(std::string& out, uint64_t x) {
+            while (x >= 0x80) {
+                out += static_cast<char>(x | 0x80);
+                x >>= 7;
+            }
+            out += static_cast<char>(x);
+        }
+
+        inline bool get_varint(std::string_view in, size_t& pos, uint64_t& x) {
+            x = 0;
+            for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+                unsigned char c = in[pos++];
+                x |= static_cast<uint64_t>(c & 0x7f) << shift;
+                if (!(c & 0x80)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        //! Generic trainer: the sample segments richest in k-grams shared by many samples, the most
+        //! valuable last (the end of the dictionary is the nearest history for LZ77 codecs).
+        inline std::string train(const std::vector<std::string>& samples, size_t size) {
+            enum { k = 8, segment = 64 };
+            auto gram = [](const char* p) {
+                uint64_t h;
+                std::memcpy(&h, p, k);
+                return h;
+            };
+
+            std::unordered_map<uint64_t, uint32_t> docs;
+            for (const auto& s : samples) {
+                std::unordered_set<uint64_t> seen;
+                for (size_t i = 0; i + k <= s.size(); ++i) {
+                    uint64_t h = gram(s.data() + i);
+                    if (seen.insert(h).second) {
+                        ++docs[h];
+                    }
+                }
+            }
+
+            struct Segment {
+                uint64_t score;
+                const std::string* sample;
+                size_t pos;
+                size_t len;
+            };
+            auto score = [&](const std::string& s, size_t pos, size_t len) {
+                uint64_t res = 0;
+                for (size_t i = pos; i + k <= pos + len; ++i) {
+                    auto it = docs.find(gram(s.data() + i));
+                    if (it != docs.end() && it->second > 1) {
+                        res += it->second;
+                    }
+                }
+                return res;
+            };
+
+            std::vector<Segment> segments;
+            for (const auto& s : samples) {
+                for (size_t pos = 0; pos + k <= s.size(); pos += segment) {
+                    size_t len = std::min<size_t>(segment, s.size() - pos);
+                    uint64_t sc = score(s, pos, len);
+                    if (sc) {
+                        segments.push_back(Segment{sc, &s, pos, len});
+                    }
+                }
+            }
+            std::sort(segments.begin(), segments.end(), [](const Segment& a, const Segment& b) { return a.score > b.score; });
+
+            std::vector<const Segment*> picked;
+            size_t total = 0;
+            for (const auto& seg : segments) {
+                if (total >= size) {
+                    break;
+                }
+                // k-grams already in the dictionary do not count again
+                if (score(*seg.sample, seg.pos, seg.len) * 2 < seg.score) {
+                    continue;
+                }
+                for (size_t i = seg.pos; i + k <= seg.pos + seg.len; ++i) {
+                    docs.erase(gram(seg.sample->data() + i));
+                }
+                picked.push_back(&seg);
+                total += seg.len;
+            }
+
+            std::string dict;
+            for (auto it = picked.rbegin(); it != picked.rend(); ++it) {
+                dict.append(*(*it)->sample, (*it)->pos, (*it)->len);
+            }
+            if (dict.size() > size) {
+                dict.erase(0, dict.size() - size);
+            }
+            return dict;
+        }
+
+    } // namespace compress_detail
+
+    inline std::string Codec::train(const std::vector<std::string>& samples, size_t size) {
+        return compress_detail::train(samples, std::min(size, max_dictionary()));
+    }
+
+#ifdef SQLITEXX_WITH_ZLIB
+    //! raw deflate, the streams are kept and reset between values
+    class ZlibCodec : public Codec {
+        z_stream def_{};
+        z_stream inf_{};
+        bool def_init_ = false;
+        bool inf_init_ = false;
+        int level_;
+
+    public:
+        explicit ZlibCodec(int level = -1) : level_(level < 0 ? Z_DEFAULT_COMPRESSION : level) {
+        }
+
+        ~ZlibCodec() override {
+            if (def_init_) {
+                deflateEnd(&def_);
+            }
+            if (inf_init_) {
+                inflateEnd(&inf_);
+            }
+        }
+
+        Id id() const override {
+            return ZLIB;
+        }
+
+        const char* name() const override {
+            return "zlib";
+        }
+
+        size_t max_dictionary() const override {
+            return 32768;
+        }
+
+        void compress(std::string_view in, const Dictionary& dict, std::string& out) override {
+            int res = def_init_ ? deflateReset(&def_) : deflateInit2(&def_, level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+            def_init_ = def_init_ || res == Z_OK;
+            if (res == Z_OK && !dict.data.empty()) {
+                res = deflateSetDictionary(&def_, reinterpret_cast<const Bytef*>(dict.data.data()), dict.data.size());
+            }
+            if (res != Z_OK) {
+                throw Error(SQLITE_ERROR, "zlib: can't start compression (", res, ")");
+            }
+
+            size_t start = out.size();
+            out.resize(start + deflateBound(&def_, in.size()));
+            def_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+            def_.avail_in = in.size();
+            def_.next_out = reinterpret_cast<Bytef*>(&out[start]);
+            def_.avail_out = out.size() - start;
+            res = deflate(&def_, Z_FINISH);
+            if (res != Z_STREAM_END) {
+                throw Error(SQLITE_ERROR, "zlib: compression failed (", res, ")");
+            }
+            out.resize(out.size() - def_.avail_out);
+        }
+
+        void decompress(std::string_view in, const Dictionary& dict, char* out, size_t size) override {
+            int res = inf_init_ ? inflateReset(&inf_) : inflateInit2(&inf_, -15);
+            inf_init_ = inf_init_ || res == Z_OK;
+            if (res == Z_OK && !dict.data.empty()) {
+                res = inflateSetDictionary(&inf_, reinterpret_cast<const Bytef*>(dict.data.data()), dict.data.size());
+            }
+            if (res != Z_OK) {
+                throw Error(SQLITE_ERROR, "zlib: can't start decompression (", res, ")");
+            }
+
+            inf_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+            inf_.avail_in = in.size();
+            inf_.next_out = reinterpret_cast<Bytef*>(out);
+            inf_.avail_out = size;
+            res = inflate(&inf_, Z_FINISH);
+            if (res != Z_STREAM_END || inf_.avail_out) {
+                throw Error(SQLITE_CORRUPT, "zlib: corrupt compressed value (", res, ")");
+            }
+        }
+    };
+#endif
+
+#ifdef SQLITEXX_WITH_ZSTD
+    //! zstd with digested dictionaries cached by id, dictionaries are trained by ZDICT
+    class ZstdCodec : public Codec {
+        struct Free {
+            void operator () (ZSTD_CCtx* c) const {
+                ZSTD_freeCCtx(c);
+            }
+            void operator () (ZSTD_DCtx* d) const {
+                ZSTD_freeDCtx(d);
+            }
+            void operator () (ZSTD_CDict* c) const {
+                ZSTD_freeCDict(c);
+            }
+            void operator () (ZSTD_DDict* d) const {
+                ZSTD_freeDDict(d);
+            }
+        };
+
+        std::unique_ptr<ZSTD_CCtx, Free> cctx_{ZSTD_createCCtx()};
+        std::unique_ptr<ZSTD_DCtx, Free> dctx_{ZSTD_createDCtx()};
+        std::map<uint32_t, std::unique_ptr<ZSTD_CDict, Free>> cdicts_;
+        std::map<uint32_t, std::unique_ptr<ZSTD_DDict, Free>> ddicts_;
+        int level_;
+
+    public:
+        explicit ZstdCodec(int level = -1) : level_(level < 0 ? ZSTD_CLEVEL_DEFAULT : level) {
+        }
+
+        Id id() const override {
+            return ZSTD;
+        }
+
+        const char* name() const override {
+            return "zstd";
+        }
+
+        size_t max_dictionary() const override {
+            return 1 << 20;
+        }
+
+        void compress(std::string_view in, const Dictionary& dict, std::string& out) override {
+            size_t start = out.size();
+            out.resize(start + ZSTD_compressBound(in.size()));
+            size_t res;
+            if (dict.id) {
+                auto& cd = cdicts_[dict.id];
+                if (!cd) {
+                    cd.reset(ZSTD_createCDict(dict.data.data(), dict.data.size(), level_));
+                }
+                res = ZSTD_compress_usingCDict(cctx_.get(), &out[start], out.size() - start, in.data(), in.size(), cd.get());
+            } else {
+                res = ZSTD_compressCCtx(cctx_.get(), &out[start], out.size() - start, in.data(), in.size(), level_);
+            }
+            if (ZSTD_isError(res)) {
+                throw Error(SQLITE_ERROR, "zstd: ", ZSTD_getErrorName(res));
+            }
+            out.resize(start + res);
+        }
+
+        void decompress(std::string_view in, const Dictionary& dict, char* out, size_t size) override {
+            size_t res;
+            if (dict.id) {
+                auto& dd = ddicts_[dict.id];
+                if (!dd) {
+                    dd.reset(ZSTD_createDDict(dict.data.data(), dict.data.size()));
+                }
+                res = ZSTD_decompress_usingDDict(dctx_.get(), out, size, in.data(), in.size(), dd.get());
+            } else {
+                res = ZSTD_decompressDCtx(dctx_.get(), out, size, in.data(), in.size());
+            }
+            if (ZSTD_isError(res) || res != size) {
+                throw Error(SQLITE_CORRUPT, "zstd: corrupt compressed value");
+            }
+        }
+
+        std::string train(const std::vector<std::string>& samples, size_t size) override {
+            std::string all;
+            std::vector<size_t> sizes;
+            for (const auto& s : samples) {
+                all += s;
+                sizes.push_back(s.size());
+            }
+            std::string dict(std::min(size, max_dictionary()), '\0');
+            size_t res = ZDICT_trainFromBuffer(&dict[0], dict.size(), all.data(), sizes.data(), static_cast<unsigned>(sizes.size()));
+            if (ZDICT_isError(res)) {
+                // too few samples for ZDICT
+                return Codec::train(samples, size);
+            }
+            dict.resize(res);
+            return dict;
+        }
+    };
+#endif
+
+#ifdef SQLITEXX_WITH_LZ4
+    //! LZ4 block format, level is the acceleration
+    class Lz4Codec : public Codec {
+        struct Free {
+            void operator () (LZ4_stream_t* s) const {
+                LZ4_freeStream(s);
+            }
+        };
+
+        std::unique_ptr<LZ4_stream_t, Free> stream_{LZ4_createStream()};
+        int acceleration_;
+
+    public:
+        explicit Lz4Codec(int level = -1) : acceleration_(level < 1 ? 1 : level) {
+        }
+
+        Id id() const override {
+            return LZ4;
+        }
+
+        const char* name() const override {
+            return "lz4";
+        }
+
+        size_t max_dictionary() const override {
+            return 65536;
+        }
+
+        void compress(std::string_view in, const Dictionary& dict, std::string& out) override {
+            size_t start = out.size();
+            out.resize(start + LZ4_compressBound(static_cast<int>(in.size())));
+            LZ4_resetStream_fast(stream_.get());
+            LZ4_loadDict(stream_.get(), dict.data.data(), static_cast<int>(dict.data.size()));
+            int res = LZ4_compress_fast_continue(stream_.get(), in.data(), &out[start], static_cast<int>(in.size()),
+                static_cast<int>(out.size() - start), acceleration_);
+            if (res <= 0) {
+                throw Error(SQLITE_ERROR, "lz4: compression failed");
+            }
+            out.resize(start + res);
+        }
+
+        void decompress(std::string_view in, const Dictionary& dict, char* out, size_t size) override {
+            int res = LZ4_decompress_safe_usingDict(in.data(), out, static_cast<int>(in.size()), static_cast<int>(size),
+                dict.data.data(), static_cast<int>(dict.data.size()));
+            if (res < 0 || static_cast<size_t>(res) != size) {
+                throw Error(SQLITE_CORRUPT, "lz4: corrupt compressed value");
+            }
+        }
+    };
+#endif
+
+    //! stores values as they are, the codec when no compression library is built in
+    class RawCodec : public Codec {
+    public:
+        Id id() const override {
+            return RAW;
+        }
+
+        const char* name() const override {
+            return "raw";
+        }
+
+        size_t max_dictionary() const override {
+            return 0;
+        }
+
+        std::string train(const std::vector<std::string>&, size_t) override {
+            return std::string();
+        }
+
+        void compress(std::string_view in, const Dictionary&, std::string& out) override {
+            out.append(in.data(), in.size());
+        }
+
+        void decompress(std::string_view in, const Dictionary&, char* out, size_t size) override {
+            if (in.size() != size) {
+                throw Error(SQLITE_CORRUPT, "corrupt uncompressed value");
+            }
+            std::memcpy(out, in.data(), size);
+        }
+    };
+
+    //! codec by name ("raw", "zlib", "zstd", "lz4"), nullptr if it is not built in
+    inline std::unique_ptr<Codec> make_codec(const std::string& name, int level = -1) {
+        if (name == "raw") {
+            return std::unique_ptr<Codec>(new RawCodec());
+        }
+#ifdef SQLITEXX_WITH_ZLIB
+        if (name == "zlib") {
+            return std::unique_ptr<Codec>(new ZlibCodec(level));
+        }
+#endif
+#ifdef SQLITEXX_WITH_ZSTD
+        if (name == "zstd") {
+            return std::unique_ptr<Codec>(new ZstdCodec(level));
+        }
+#endif
+#ifdef SQLITEXX_WITH_LZ4
+        if (name == "lz4") {
+            return std::unique_ptr<Codec>(new Lz4Codec(level));
+        }
+#endif
+        (void)level;
+        return nullptr;
+    }
+
+    //! the best codec built in: zstd, then zlib, then lz4, raw without any
+    inline const char* default_codec() {
+#if defined(SQLITEXX_WITH_ZSTD)
+        return "zstd";
+#elif defined(SQLITEXX_WITH_ZLIB)
+        return "zlib";
+#elif defined(SQLITEXX_WITH_LZ4)
+        return "lz4";
+#else
+        return "raw";
+#endif
+    }
+
+    struct CompressionOptions {
+        std::string codec = default_codec();
+        int level = -1;                     //!< codec default if negative, the acceleration for lz4
+        size_t min_size = 64;               //!< shorter values are stored uncompressed (with the header)
+    };
+
+    class Compression {
+        // magic, codec id | 0x80 for blobs, dictionary id (LE 32 bits), varint size
+        static constexpr std::string_view magic{"\xc5SQZ", 4};
+        enum { header_size = 9 };
+
+        DB& db_;
+        CompressionOptions opts_;
+        std::unique_ptr<Codec> codec_;
+        std::unique_ptr<Codec> others_[4];  // codecs of values written with another codec
+        std::map<uint32_t, Dictionary> dicts_;
+        std::map<std::string, uint32_t> table_dicts_;
+        Dictionary none_;
+        std::string buffer_;
+        std::string decoded_;
+
+        static std::string lower(std::string s) {
+            for (auto& c : s) {
+                c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            }
+            return s;
+        }
+
+        const Dictionary& dictionary(uint32_t id) {
+            if (!id) {
+                return none_;
+            }
+            auto it = dicts_.find(id);
+            if (it != dicts_.end()) {
+                return it->second;
+            }
+            // trained by another connection after this one loaded the dictionaries
+            if (has_table("sqlitexx_dictionaries")) {
+                auto q = db_.prepare("SELECT data FROM sqlitexx_dictionaries WHERE id = ?;", static_cast<int64_t>(id));
+                for (auto& row : q) {
+                    Dictionary& d = dicts_[id];
+                    d.id = id;
+                    d.data = row[0].as_blob();
+                    return d;
+                }
+            }
+            throw Error(SQLITE_CORRUPT, "unknown compression dictionary ", id);
+        }
+
+        Codec& codec(unsigned id) {
+            if (id == static_cast<unsigned>(codec_->id())) {
+                return *codec_;
+            }
+            static const char* names[] = { "", "zlib", "zstd", "lz4" };
+            if (id >= 4 || !id) {
+                throw Error(SQLITE_CORRUPT, "unknown compression codec ", id);
+            }
+            if (!others_[id]) {
+                others_[id] = make_codec(names[id]);
+                if (!others_[id]) {
+                    throw Error(SQLITE_ERROR, "value is compressed by ", names[id], " which is not built in");
+                }
+            }
+            return *others_[id];
+        }
+
+        bool has_table(const char* name) {
+            return db_.prepare("SELECT count(*) FROM sqlite_master WHERE type = 'table' AND name = ?;", std::string(name)).exec() != "0";
+        }
+
+        void load_dictionaries() {
+            if (!has_table("sqlitexx_dictionaries")) {
+                return;
+            }
+            auto q = db_.prepare("SELECT id, table_name, codec, data FROM sqlitexx_dictionaries ORDER BY id;");
+            for (auto& row : q) {
+                Dictionary d;
+                d.id = static_cast<uint32_t>(row[0].as_int());
+                d.data = row[3].as_blob();
+                if (row[2].as_text() == codec_->name()) {
+                    table_dicts_[lower(row[1].as_text())] = d.id;
+                }
+                dicts_[d.id] = std::move(d);
+            }
+        }
+
+        static void sql_compress(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+            auto* self = static_cast<Compression*>(sqlite3_user_data(ctx));
+            int type = sqlite3_value_type(argv[0]);
+            if (type != SQLITE_TEXT && type != SQLITE_BLOB) {
+                sqlite3_result_value(ctx, argv[0]);
+                return;
+            }
+            try {
+                const char* data = type == SQLITE_TEXT ? reinterpret_cast<const char*>(sqlite3_value_text(argv[0]))
+                    : static_cast<const char*>(sqlite3_value_blob(argv[0]));
+                std::string_view value(data ? data : "", sqlite3_value_bytes(argv[0]));
+                const char* table = argc > 1 ? reinterpret_cast<const char*>(sqlite3_value_text(argv[1])) : nullptr;
+                self->encode(value, type == SQLITE_BLOB, table ? table : "", self->buffer_);
+                sqlite3_result_blob(ctx, self->buffer_.data(), self->buffer_.size(), SQLITE_TRANSIENT);
+            } catch (const Error& e) {
+                sqlite3_result_error(ctx, e.what(), -1);
+                sqlite3_result_error_code(ctx, e.code());
+            }
+        }
+
+        static void sql_decompress(sqlite3_context* ctx, int, sqlite3_value** argv) {
+            auto* self = static_cast<Compression*>(sqlite3_user_data(ctx));
+            const char* data = sqlite3_value_type(argv[0]) == SQLITE_BLOB ? static_cast<const char*>(sqlite3_value_blob(argv[0])) : nullptr;
+            std::string_view stored(data ? data : "", data ? sqlite3_value_bytes(argv[0]) : 0);
+            if (!compressed(stored)) {
+                sqlite3_result_value(ctx, argv[0]);
+                return;
+            }
+            try {
+                bool blob = self->decode(stored, self->decoded_);
+                if (blob) {
+                    sqlite3_result_blob(ctx, self->decoded_.data(), self->decoded_.size(), SQLITE_TRANSIENT);
+                } else {
+                    sqlite3_result_text(ctx, self->decoded_.data(), self->decoded_.size(), SQLITE_TRANSIENT);
+                }
+            } catch (const Error& e) {
+                sqlite3_result_error(ctx, e.what(), -1);
+                sqlite3_result_error_code(ctx, e.code());
+            }
+        }
+
+        void register_functions(bool remove) {
+            // the result of compression depends on the dictionaries, which change with train()
+            auto set = [&](const char* name, int args, void (*f)(sqlite3_context*, int, sqlite3_value**)) {
+                int flags = SQLITE_UTF8 | SQLITE_INNOCUOUS | (f == sql_decompress ? SQLITE_DETERMINISTIC : 0);
+                int res = sqlite3_create_function_v2(db_.get(), name, args, flags, this, remove ? nullptr : f, nullptr, nullptr, nullptr);
+                if (res != SQLITE_OK && !remove) {
+                    throw Error(res, "can't register ", name);
+                }
+            };
+            set("sqlitexx_compress", 1, sql_compress);
+            set("sqlitexx_compress", 2, sql_compress);
+            set("sqlitexx_decompress", 1, sql_decompress);
+        }
+
+    public:
+        //! Registers the SQL functions on db, they are removed with the Compression (so there should
+        //! be one Compression per connection).
+        explicit Compression(DB& db, const CompressionOptions& opts = CompressionOptions{}) : db_(db), opts_(opts) {
+            codec_ = make_codec(opts.codec, opts.level);
+            if (!codec_) {
+                throw Error(SQLITE_ERROR, "codec '", opts.codec, "' is not built in");
+            }
+            load_dictionaries();
+            register_functions(false);
+        }
+
+        Compression(const Compression&) = delete;
+        Compression& operator = (const Compression&) = delete;
+
+        ~Compression() {
+            register_functions(true);
+        }
+
+        const char* codec_name() const {
+            return codec_->name();
+        }
+
+        //! dictionary used for new values of table, 0 if none
+        uint32_t dictionary_of(const std::string& table) const {
+            auto it = table_dicts_.find(lower(table));
+            return it == table_dicts_.end() ? 0 : it->second;
+        }
+
+        //! Train a dictionary for table from the values of the first column of sample_sql (already
+        //! compressed values are decompressed first) and use it for new values. Returns its id.
+        uint32_t train(const std::string& table, const std::string& sample_sql, size_t max_size = 16384) {
+            std::vector<std::string> samples;
+            auto q = db_.prepare(sample_sql);
+            for (auto& row : q) {
+                if (row[0].type() == SQLITE_BLOB) {
+                    std::string value;
+                    decode(row[0].as_blob(), value);
+                    samples.push_back(std::move(value));
+                } else if (row[0].type() == SQLITE_TEXT) {
+                    samples.push_back(row[0].as_text());
+                }
+            }
+            std::string data = codec_->train(samples, max_size);
+            if (data.empty()) {
+                return 0;
+            }
+
+            db_.prepare("CREATE TABLE IF NOT EXISTS sqlitexx_dictionaries (id INTEGER PRIMARY KEY, table_name TEXT NOT NULL, "
+                "codec TEXT NOT NULL, data BLOB NOT NULL);").exec();
+            auto ins = db_.prepare("INSERT INTO sqlitexx_dictionaries (table_name, codec, data) VALUES (?, ?, ?);");
+            ins.bind(1, table);
+            ins.bind(2, std::string(codec_->name()));
+            ins.bind_blob(3, data);
+            ins.exec();
+
+            Dictionary d;
+            d.id = static_cast<uint32_t>(sqlite3_last_insert_rowid(db_.get()));
+            d.data = std::move(data);
+            table_dicts_[lower(table)] = d.id;
+            uint32_t id = d.id;
+            dicts_[id] = std::move(d);
+            return id;
+        }
+
+        //! stored form of value (with the dictionary of table, if any) into out
+        void encode(std::string_view value, bool blob, const std::string& table, std::string& out) {
+            uint32_t dict = value.size() < opts_.min_size ? 0 : dictionary_of(table);
+            unsigned id = value.size() < opts_.min_size ? Codec::RAW : codec_->id();
+            out.assign(magic.data(), magic.size());
+            out += static_cast<char>(id | (blob ? 0x80 : 0));
+            for (int i = 0; i < 4; ++i) {
+                out += static_cast<char>(dict >> (8 * i));
+            }
+            compress_detail::put_varint(out, value.size());
+            if (id == Codec::RAW) {
+                out.append(value.data(), value.size());
+            } else {
+                codec_->compress(value, dictionary(dict), out);
+            }
+        }
+
+        //! whether a blob was written by encode()
+        static bool compressed(std::string_view stored) {
+            return stored.substr(0, magic.size()) == magic;
+        }
+
+        //! original value of a stored one into out; true if it was a BLOB (blobs without the
+        //! marker are copied as they are)
+        bool decode(std::string_view stored, std::string& out) {
+            if (!compressed(stored)) {
+                out.assign(stored.data(), stored.size());
+                return true;
+            }
+            uint64_t size = 0;
+            size_t pos = header_size;
+            uint64_t limit = sqlite3_limit(db_.get(), SQLITE_LIMIT_LENGTH, -1);
+            if (stored.size() < header_size || !compress_detail::get_varint(stored, pos, size) || size > limit) {
+                throw Error(SQLITE_CORRUPT, "corrupt compressed value header");
+            }
+            unsigned id = static_cast<unsigned char>(stored[magic.size()]) & 0x7f;
+            uint32_t dict = 0;
+            for (int i = 0; i < 4; ++i) {
+                dict |= static_cast<uint32_t>(static_cast<unsigned char>(stored[magic.size() + 1 + i])) << (8 * i);
+            }
+
+            std::string_view payload = stored.substr(pos);
+            if (id == Codec::RAW) {
+                if (payload.size() != size) {
+                    throw Error(SQLITE_CORRUPT, "corrupt uncompressed value");
+                }
+                out.assign(payload.data(), payload.size());
+            } else {
+                out.resize(size);
+                codec(id).decompress(payload, dictionary(dict), &out[0], size);
+            }
+            return (stored[magic.size()] & 0x80) != 0;
+        }
+
+        //! bind value compressed for table
+        void bind(Statement& st, unsigned pos, std::string_view value, const std::string& table = "", bool blob = false) {
+            encode(value, blob, table, buffer_);
+            st.bind_blob(pos, buffer_);
+        }
+
+        //! Original text or blob of a column, valid until the next read or step. NULLs are empty,
+        //! other uncompressed values are returned as text, blobs without the marker as they are.
+        std::string_view read(Statement::Value v) {
+            if (v.type() != SQLITE_BLOB) {
+                return v.as_text_view();
+            }
+            std::string_view stored = v.as_blob_view();
+            if (!compressed(stored)) {
+                return stored;
+            }
+            decode(stored, decoded_);
+            return decoded_;
+        }
+    };
+
+} // namespace sqlitexx
@@ -0,0 +1,256 @@
+#pragma once
+
+#include "sqlitexx.h"
+#include <array>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <optional>
+#include <tuple>
+
+/**
+ * Row decoding planned from the declared column types.
+ *
+ * RowDecoder<T...> reads the rows of a statement into std::tuple<T...> of int64_t, double,
+ * std::string, std::string_view or std::optional of these. The plan is made once from
+ * Statement::columns() and made again when a schema change prepares the statement again. A
+ * column whose declared affinity matches its C++ type (INTEGER for int64_t, REAL for double, TEXT
+ * for strings) is read by one typed fetch, trusting the declared type: a cell stored in another
+ * class (flexible typing allows any class in any column) gets the conversion of
+ * sqlite3_column_int64() and friends. The storage class is checked only for NULL, and only when
+ * the column may be NULL or the C++ type is std::optional. Other columns take the general
+ * conversion, which is the same for every column: integers become doubles, integral doubles and
+ * numeric text become integers, numbers become text, NULL is accepted only by std::optional.
+ * Anything else throws SQLITE_MISMATCH.
+ *
+ * An outer join can give NULL for a NOT NULL column; decode such columns into std::optional.
+ */
+
+namespace sqlitexx {
+
+    template <typename...T>
+    class RowDecoder {
+        template <typename V>
+        struct tag {
+        };
+
+        // how a column is read: the general conversion, a typed fetch, a typed fetch unless NULL
+        enum Plan : unsigned char { GENERAL, FETCH, FETCH_NOT_NULL };
+
+        Statement& st_;
+        std::array<Plan, sizeof...(T)> plan_{};
+        int prepared_ = -1;             // SQLITE_STMTSTATUS_REPREPARE when plan_ was made
+        size_t converted_ = 0;
+
+        static bool matches(ColumnDesc::Affinity a, tag<int64_t>) {
+            return a == ColumnDesc::INTEGER;
+        }
+
+        static bool matches(ColumnDesc::Affinity a, tag<double>) {
+            return a == ColumnDesc::REAL;
+        }
+
+        static bool matches(ColumnDesc::Affinity a, tag<std::string>) {
+            return a == ColumnDesc::TEXT;
+        }
+
+        static bool matches(ColumnDesc::Affinity a, tag<std::string_view>) {
+            return a == ColumnDesc::TEXT;
+        }
+
+        template <typename V>
+        static bool matches(ColumnDesc::Affinity a, tag<std::optional<V>>) {
+            return matches(a, tag<V>{});
+        }
+
+        static int storage(tag<int64_t>) {
+            return SQLITE_INTEGER;
+        }
+
+        static int storage(tag<double>) {
+            return SQLITE_FLOAT;
+        }
+
+        static int storage(tag<std::string>) {
+            return SQLITE_TEXT;
+        }
+
+        static int storage(tag<std::string_view>) {
+            return SQLITE_TEXT;
+        }
+
+        static void fetch(sqlite3_stmt* st, int i, int64_t& out) {
+            out = sqlite3_column_int64(st, i);
+        }
+
+        static void fetch(sqlite3_stmt* st, int i, double& out) {
+            out = sqlite3_column_double(st, i);
+        }
+
+        static void fetch(sqlite3_stmt* st, int i, std::string& out) {
+            const char* data = reinterpret_cast<const char*>(sqlite3_column_text(st, i));
+            out.assign(data ? data : "", sqlite3_column_bytes(st, i));
+        }
+
+        static void fetch(sqlite3_stmt* st, int i, std::string_view& out) {
+            const char* data = reinterpret_cast<const char*>(sqlite3_column_text(st, i));
+            out = data ? std::string_view(data, sqlite3_column_bytes(st, i)) : std::string_view();
+        }
+
+        [[noreturn]] void mismatch(int i, int type, const char* target) {
+            static const char* names[] = { "?", "INTEGER", "REAL", "TEXT", "BLOB", "NULL" };
+            throw Error(SQLITE_MISMATCH, "column ", st_.columns()[i].name, ": can't decode ", names[type < 6 ? type : 0], " as ", target);
+        }
+
+        // the general conversions, for cells not read by the fast path
+        void convert(int i, int type, int64_t& out) {
+            sqlite3_stmt* st = st_.get();
+            if (type == SQLITE_INTEGER) {
+                fetch(st, i, out);
+                return;
+            }
+            if (type == SQLITE_FLOAT) {
+                double d = sqlite3_column_double(st, i);
+                if (std::floor(d) == d && d >= -9223372036854775808.0 && d < 9223372036854775808.0) {
+                    out = static_cast<int64_t>(d);
+                    return;
+                }
+            } else if (type == SQLITE_TEXT) {
+                const char* s = reinterpret_cast<const char*>(sqlite3_column_text(st, i));
+                char* end = nullptr;
+                errno = 0;
+                long long x = std::strtoll(s, &end, 10);
+                if (end != s && !*end && !errno) {
+                    out = x;
+                    return;
+                }
+            }
+            mismatch(i, type, "integer");
+        }
+
+        void convert(int i, int type, double& out) {
+            sqlite3_stmt* st = st_.get();
+            if (type == SQLITE_INTEGER || type == SQLITE_FLOAT) {
+                fetch(st, i, out);
+                return;
+            }
+            if (type == SQLITE_TEXT) {
+                const char* s = reinterpret_cast<const char*>(sqlite3_column_text(st, i));
+                char* end = nullptr;
+                double x = std::strtod(s, &end);
+                if (end != s && !*end) {
+                    out = x;
+                    return;
+                }
+            }
+            mismatch(i, type, "real");
+        }
+
+        template <typename S>
+        void convert(int i, int type, S& out) {
+            if (type == SQLITE_NULL) {
+                mismatch(i, type, "text");
+            }
+            // numbers are formatted by SQLite, blobs are taken as bytes
+            fetch(st_.get(), i, out);
+        }
+
+        template <typename V>
+        void general(int i, int type, V& out) {
+            if (type != storage(tag<V>{})) {
+                ++converted_;
+            }
+            convert(i, type, out);
+        }
+
+        template <typename V>
+        void cell(int i, V& out) {
+            sqlite3_stmt* st = st_.get();
+            if (plan_[i] == FETCH) {
+                fetch(st, i, out);
+                return;
+            }
+            int type = sqlite3_column_type(st, i);
+            if (plan_[i] == FETCH_NOT_NULL && type != SQLITE_NULL) {
+                fetch(st, i, out);
+                return;
+            }
+            general(i, type, out);
+        }
+
+        template <typename V>
+        void cell(int i, std::optional<V>& out) {
+            sqlite3_stmt* st = st_.get();
+            int type = sqlite3_column_type(st, i);
+            if (type == SQLITE_NULL) {
+                out.reset();
+                return;
+            }
+            if (!out) {
+                out.emplace();
+            }
+            if (plan_[i] != GENERAL) {
+                fetch(st, i, *out);
+                return;
+            }
+            general(i, type, *out);
+        }
+
+        template <size_t...I>
+        void decode(std::tuple<T...>& row, std::index_sequence<I...>) {
+            bool dummy[] = { true, (cell(static_cast<int>(I), std::get<I>(row)), true)... };
+            (void)dummy;
+        }
+
+        template <typename V>
+        static Plan plan_of(const ColumnDesc& c, tag<V>) {
+            if (!matches(c.affinity, tag<V>{})) {
+                return GENERAL;
+            }
+            return c.nullable ? FETCH_NOT_NULL : FETCH;
+        }
+
+        template <size_t...I>
+        void plan(std::index_sequence<I...>) {
+            const auto& cols = st_.columns();
+            if (cols.size() != sizeof...(T)) {
+                throw Error(SQLITE_RANGE, "statement has ", cols.size(), " columns, decoder expects ", sizeof...(T));
+            }
+            bool dummy[] = { true, (plan_[I] = plan_of(cols[I], tag<T>{}), true)... };
+            (void)dummy;
+            prepared_ = sqlite3_stmt_status(st_.get(), SQLITE_STMTSTATUS_REPREPARE, 0);
+        }
+
+    public:
+        //! the statement must have a result column for every element of the tuple
+        explicit RowDecoder(Statement& st) : st_(st) {
+            plan(std::index_sequence_for<T...>{});
+        }
+
+        //! decode the current row into row, reusing its strings
+        void decode(std::tuple<T...>& row) {
+            if (sqlite3_stmt_status(st_.get(), SQLITE_STMTSTATUS_REPREPARE, 0) != prepared_) {
+                plan(std::index_sequence_for<T...>{});
+            }
+            decode(row, std::index_sequence_for<T...>{});
+        }
+
+        std::tuple<T...> decode() {
+            std::tuple<T...> row;
+            decode(row);
+            return row;
+        }
+
+        //! whether column i is read by a typed fetch
+        bool fast(size_t i) const {
+            return plan_[i] != GENERAL;
+        }
+
+        //! cells taking the general conversion so far which were stored in another class than
+        //! their C++ type
+        size_t converted() const {
+            return converted_;
+        }
+    };
+
+} // namespace sqlitexx
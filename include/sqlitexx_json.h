@@ -0,0 +1,222 @@
+#pragma once
+
+#include "sqlitexx.h"
+#include <fstream>
+#include <istream>
+#include <optional>
+#include <vector>
+
+/**
+ * Helpers for the SQLite JSON functions.
+ *
+ * JSON stays inside SQLite: JsonReader extracts typed values with json_tree(), which parses the
+ * document once for the type and the value, and binds both the document and the path as
+ * parameters, load_ndjson() turns a batch of NDJSON lines into rows
+ * with one INSERT ... SELECT FROM json_each(?) statement. Documents are stored as JSONB when the
+ * library supports it (SQLite 3.45+) and as minified JSON text otherwise.
+ */
+
+namespace sqlitexx {
+
+    inline bool sql_function_works(DB& db, const char* sql) {
+        sqlite3_stmt* st = nullptr;
+        if (sqlite3_prepare_v2(db.get(), sql, -1, &st, nullptr) != SQLITE_OK) {
+            return false;
+        }
+        int res = sqlite3_step(st);
+        sqlite3_finalize(st);
+        return res == SQLITE_ROW;
+    }
+
+    inline bool json_available(DB& db) {
+        return sql_function_works(db, "SELECT json('{}');");
+    }
+
+    inline bool jsonb_available(DB& db) {
+        return sql_function_works(db, "SELECT jsonb('{}');");
+    }
+
+    //! SQL function converting JSON text into the storage format: "jsonb" or "json"
+    inline const char* json_storage_function(DB& db) {
+        return jsonb_available(db) ? "jsonb" : "json";
+    }
+
+    //! Typed values from JSON documents, the statement is prepared once and reused.
+    class JsonReader {
+        Statement st_;
+
+        template <typename T>
+        struct tag {
+        };
+
+        static bool accepts(const std::string& type, tag<int64_t>) {
+            return type == "integer";
+        }
+
+        static bool accepts(const std::string& type, tag<double>) {
+            return type == "integer" || type == "real";
+        }
+
+        static bool accepts(const std::string& type, tag<bool>) {
+            return type == "true" || type == "false";
+        }
+
+        static bool accepts(const std::string& type, tag<std::string>) {
+            return type == "text" || type == "object" || type == "array";
+        }
+
+        static int64_t read(Statement::Value v, tag<int64_t>) {
+            return v.as_int();
+        }
+
+        static double read(Statement::Value v, tag<double>) {
+            return v.as_double();
+        }
+
+        static bool read(Statement::Value v, tag<bool>) {
+            return v.as_int() != 0;
+        }
+
+        static std::string read(Statement::Value v, tag<std::string>) {
+            return v.as_text();
+        }
+
+    public:
+        // the first row of json_tree() is the element at the path itself, no row if it is missing
+        explicit JsonReader(DB& db) : st_(db.prepare("SELECT type, value FROM json_tree(?1, ?2) LIMIT 1;")) {
+        }
+
+        //! Value at path (e.g. "$.user.id"). Missing values and JSON null are std::nullopt, values
+        //! of another type throw SQLITE_MISMATCH. Objects and arrays are returned as JSON text.
+        template <typename T>
+        std::optional<T> get(const std::string& json, const std::string& path) {
+            ResetGuard guard(st_);
+            st_.bind(1, json);
+            st_.bind(2, path);
+            if (!st_.step()) {
+                return std::nullopt;
+            }
+
+            std::string type = st_[0].as_text();
+            if (type == "null") {
+                return std::nullopt;
+            }
+            if (!accepts(type, tag<T>{})) {
+                throw Error(SQLITE_MISMATCH, "JSON value at ", path, " is ", type);
+            }
+            return read(st_[1], tag<T>{});
+        }
+    };
+
+    //! Column filled from every NDJSON document: json_extract() at path, the whole document for "$".
+    struct JsonColumn {
+        std::string name;
+        std::string path;
+    };
+
+    namespace json_detail {
+
+        //! append s as a JSON string
+        inline void put_string(std::string& out, std::string_view s) {
+            static const char digits[] = "0123456789abcdef";
+            out += '"';
+            for (char c : s) {
+                unsigned char u = static_cast<unsigned char>(c);
+                if (c == '"' || c == '\\') {
+                    out += '\\';
+                    out += c;
+                } else if (u < 0x20) {
+                    out += "\\u00";
+                    out += digits[u >> 4];
+                    out += digits[u & 15];
+                } else {
+                    out += c;
+                }
+            }
+            out += '"';
+        }
+
+    } // namespace json_detail
+
+    //! Insert one row per NDJSON line of in into table (which must exist), batch_lines documents per
+    //! statement, all in one transaction. Returns the number of rows. Every line must hold one JSON
+    //! object, otherwise SQLITE_MISMATCH is thrown with the line number and nothing is inserted.
+    inline size_t load_ndjson(DB& db, const std::string& table, std::istream& in, const std::vector<JsonColumn>& columns, size_t batch_lines = 1000) {
+        const char* storage = json_storage_function(db);
+        std::string names;
+        std::string values;
+        for (size_t i = 0; i < columns.size(); ++i) {
+            names += (i ? ", " : "") + quote_identifier(columns[i].name);
+            values += i ? ", " : "";
+            if (columns[i].path == "$") {
+                values += std::string(storage) + "(value)";
+            } else {
+                // json_extract() of an object is JSON text: keep it in the storage format
+                std::string p = "?" + std::to_string(i + 2);
+                values += "CASE json_type(value, " + p + ") WHEN 'object' THEN " + storage + "(json_extract(value, " + p +
+                    ")) WHEN 'array' THEN " + storage + "(json_extract(value, " + p + ")) ELSE json_extract(value, " + p + ") END";
+            }
+        }
+
+        // The batch is an array of the lines as JSON strings, so a line can't add or merge
+        // elements: every element is one line and its value is the text of the line.
+        auto t = db.transaction();
+        Statement st = db.prepare("INSERT INTO " + quote_identifier(table) + " (" + names + ") SELECT " + values +
+            " FROM json_each(?1) WHERE json_valid(value) AND json_type(value) = 'object';");
+        for (size_t i = 0; i < columns.size(); ++i) {
+            if (columns[i].path != "$") {
+                st.bind(i + 2, columns[i].path);
+            }
+        }
+
+        size_t rows = 0;
+        std::string batch;
+        std::string line;
+        std::vector<size_t> numbers;        // line numbers of the batch, blank lines are skipped
+        size_t number = 0;
+        auto flush = [&] {
+            if (numbers.empty()) {
+                return;
+            }
+            batch += ']';
+            // bound in place: the batch buffer is reused and outlives the step
+            st.bind_static(1, batch);
+            st.exec();
+            size_t inserted = sqlite3_changes(db.get());
+            if (inserted != numbers.size()) {
+                auto bad = db.prepare("SELECT key FROM json_each(?1) WHERE NOT json_valid(value) OR json_type(value) <> 'object' LIMIT 1;");
+                bad.bind_static(1, batch);
+                std::string key = bad.exec();
+                throw Error(SQLITE_MISMATCH, "NDJSON line ", numbers.at(key.empty() ? 0 : std::stoul(key)), " is not a JSON object");
+            }
+            rows += inserted;
+            batch.clear();
+            numbers.clear();
+        };
+
+        while (std::getline(in, line)) {
+            ++number;
+            if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            batch += numbers.empty() ? '[' : ',';
+            json_detail::put_string(batch, line);
+            numbers.push_back(number);
+            if (numbers.size() == batch_lines) {
+                flush();
+            }
+        }
+        flush();
+        t.commit();
+        return rows;
+    }
+
+    inline size_t load_ndjson(DB& db, const std::string& table, const std::string& path, const std::vector<JsonColumn>& columns, size_t batch_lines = 1000) {
+        std::ifstream in(path);
+        if (!in) {
+            throw Error(SQLITE_CANTOPEN, "can't open '", path, "'");
+        }
+        return load_ndjson(db, table, in, columns, batch_lines);
+    }
+
+} // namespace sqlitexx
@@ -0,0 +1,202 @@
+#pragma once
+
+#include "sqlitexx.h"
+#include <functional>
+#include <iostream>
+#include <vector>
+
+/**
+ * Schema migrations with index verification.
+ *
+ * Migrations is an ordered list of steps numbered from 1; apply() runs the steps newer than
+ * PRAGMA user_version, each one in its own transaction together with the version update. Besides
+ * plain SQL there are steps for expression and partial indexes and generated columns, the usual
+ * way to make filters on JSON fields fast. Hot queries are declared together with the index they
+ * should use and verify() checks them with EXPLAIN QUERY PLAN, so a migration which makes the
+ * planner fall back to a full scan is reported at startup instead of in production latency.
+ */
+
+namespace sqlitexx {
+
+    //! CREATE INDEX on columns or expressions, partial if where is set
+    struct IndexSpec {
+        std::string name;
+        std::string table;
+        std::vector<std::string> terms;     //!< columns or expressions such as json_extract(data, '$.user')
+        std::string where;
+        bool unique = false;
+
+        IndexSpec(std::string n, std::string t, std::vector<std::string> cols, std::string w = "", bool u = false)
+            : name(std::move(n)), table(std::move(t)), terms(std::move(cols)), where(std::move(w)), unique(u) {
+        }
+
+        std::string sql() const {
+            std::string res = std::string("CREATE ") + (unique ? "UNIQUE " : "") + "INDEX IF NOT EXISTS " + quote_identifier(name) + " ON " +
+                quote_identifier(table) + " (";
+            for (size_t i = 0; i < terms.size(); ++i) {
+                res += (i ? ", " : "") + terms[i];
+            }
+            res += ")";
+            if (!where.empty()) {
+                res += " WHERE " + where;
+            }
+            return res + ";";
+        }
+    };
+
+    //! Column computed from an expression. ALTER TABLE can add only VIRTUAL columns, STORED ones
+    //! have to be declared in CREATE TABLE.
+    struct GeneratedColumn {
+        std::string table;
+        std::string name;
+        std::string type;
+        std::string expr;
+
+        std::string sql() const {
+            return "ALTER TABLE " + quote_identifier(table) + " ADD COLUMN " + quote_identifier(name) + (type.empty() ? "" : " " + type) +
+                " GENERATED ALWAYS AS (" + expr + ") VIRTUAL;";
+        }
+    };
+
+    //! rows of EXPLAIN QUERY PLAN
+    struct QueryPlan {
+        std::vector<std::string> details;
+
+        //! Any scan (SCAN t, also through an index or of a subquery): only index searches and
+        //! constant rows read part of the data. An index which only provides the order is
+        //! still read whole.
+        bool full_scan() const {
+            for (const auto& d : details) {
+                if (d.compare(0, 5, "SCAN ") == 0 && d != "SCAN CONSTANT ROW") {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool uses_index(const std::string& index) const {
+            for (const auto& d : details) {
+                auto pos = d.find("INDEX " + index);
+                if (pos != std::string::npos) {
+                    size_t end = pos + 6 + index.size();
+                    if (end == d.size() || d[end] == ' ') {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        std::string str() const {
+            std::string res;
+            for (const auto& d : details) {
+                res += (res.empty() ? "" : "; ") + d;
+            }
+            return res;
+        }
+    };
+
+    inline QueryPlan explain(DB& db, const std::string& sql) {
+        QueryPlan plan;
+        auto st = db.prepare("EXPLAIN QUERY PLAN " + sql);
+        while (st.step()) {
+            plan.details.push_back(st[3].as_text());
+        }
+        return plan;
+    }
+
+    //! run a script of several statements
+    inline void exec_script(DB& db, const std::string& sql) {
+        char* err = nullptr;
+        int res = sqlite3_exec(db.get(), sql.c_str(), nullptr, nullptr, &err);
+        if (res != SQLITE_OK) {
+            std::string msg = err ? err : sqlite3_errstr(res);
+            sqlite3_free(err);
+            throw Error(res, "can't execute '", sql, "': ", msg);
+        }
+    }
+
+    class Migrations {
+        struct HotQuery {
+            std::string sql;
+            std::string index;
+        };
+
+        std::vector<std::function<void(DB&)>> steps_;
+        std::vector<HotQuery> hot_;
+
+    public:
+        //! next step as a SQL script
+        Migrations& step(const std::string& sql) {
+            steps_.push_back([sql](DB& db) { exec_script(db, sql); });
+            return *this;
+        }
+
+        //! next step as code
+        Migrations& step(std::function<void(DB&)> f) {
+            steps_.push_back(std::move(f));
+            return *this;
+        }
+
+        Migrations& index(const IndexSpec& spec) {
+            return step(spec.sql());
+        }
+
+        Migrations& generated_column(const GeneratedColumn& col) {
+            return step(col.sql());
+        }
+
+        //! query which must not scan a table, and must use index if it is not empty
+        Migrations& hot_query(const std::string& sql, const std::string& index = "") {
+            hot_.push_back(HotQuery{sql, index});
+            return *this;
+        }
+
+        //! version after all steps
+        int version() const {
+            return static_cast<int>(steps_.size());
+        }
+
+        static int current_version(DB& db) {
+            return std::stoi(db.prepare("PRAGMA user_version;").exec());
+        }
+
+        //! run pending steps, returns the number of steps run
+        int apply(DB& db) {
+            int from = current_version(db);
+            if (from > version()) {
+                throw Error(SQLITE_SCHEMA, "database schema version ", from, " is newer than the known ", version());
+            }
+
+            for (int v = from; v < version(); ++v) {
+                auto t = db.transaction();
+                steps_[v](db);
+                db.prepare("PRAGMA user_version=" + std::to_string(v + 1) + ";").exec();
+                t.commit();
+            }
+            return version() - from;
+        }
+
+        //! Check plans of the hot queries. Returns the problems found, each also written to warn.
+        std::vector<std::string> verify(DB& db, std::ostream* warn = &std::cerr) const {
+            std::vector<std::string> problems;
+            for (const auto& q : hot_) {
+                QueryPlan plan = explain(db, q.sql);
+                std::string problem;
+                if (!q.index.empty() && !plan.uses_index(q.index)) {
+                    problem = "does not use index " + q.index;
+                } else if (plan.full_scan()) {
+                    problem = "scans a whole table";
+                }
+                if (!problem.empty()) {
+                    problems.push_back("hot query '" + q.sql + "' " + problem + " (" + plan.str() + ")");
+                    if (warn) {
+                        *warn << "sqlitexx: warning: " << problems.back() << std::endl;
+                    }
+                }
+            }
+            return problems;
+        }
+    };
+
+} // namespace sqlitexx
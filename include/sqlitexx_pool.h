@@ -0,0 +1,355 @@
+#pragma once
+
+#include "sqlitexx.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+
+/**
+ * Connection pool and a priority scheduler in front of it.
+ *
+ * Scheduler runs jobs (functions of DB&) on pooled connections. Jobs are submitted to priority
+ * classes, class 0 is the most important one. Every class has a concurrency limit and a queue limit
+ * (admission control: submit() throws when the queue is full). Jobs of classes with INTERRUPT
+ * preemption give way to more important ones: their statement fails with SQLITE_INTERRUPT (through
+ * the sqlite progress handler) and the job is queued again, so such jobs must be safe to restart
+ * (use a Transaction, it rolls back on the exception). That happens when an important job waits
+ * for a connection, and when it waits for a database lock (through the busy handler): the
+ * interrupted job rolls back and releases its locks. Jobs of NONE classes are never interrupted
+ * and may keep important jobs waiting for their locks.
+ *
+ * The busy handler waits as long as the busy timeout the connection had when the scheduler took it.
+ */
+
+namespace sqlitexx {
+
+    class Pool {
+        std::mutex mutex_;
+        std::condition_variable released_;
+        std::vector<std::unique_ptr<DB>> all_;
+        std::vector<DB*> free_;
+
+        void release(DB* db) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                free_.push_back(db);
+            }
+            released_.notify_one();
+        }
+
+    public:
+        //! connection borrowed from the pool, returned on destruction
+        class Lease {
+            Pool* pool_ = nullptr;
+            DB* db_ = nullptr;
+
+        public:
+            Lease() = default;
+
+            Lease(Pool* pool, DB* db) : pool_(pool), db_(db) {
+            }
+
+            Lease(Lease&& l) : pool_(l.pool_), db_(l.db_) {
+                l.db_ = nullptr;
+            }
+
+            Lease& operator = (Lease&& l) {
+                std::swap(pool_, l.pool_);
+                std::swap(db_, l.db_);
+                return *this;
+            }
+
+            ~Lease() {
+                if (db_) {
+                    pool_->release(db_);
+                }
+            }
+
+            explicit operator bool () const {
+                return db_ != nullptr;
+            }
+
+            DB& operator * () const {
+                return *db_;
+            }
+
+            DB* operator -> () const {
+                return db_;
+            }
+        };
+
+        //! open size connections with open()
+        Pool(size_t size, const std::function<std::unique_ptr<DB>()>& open) {
+            for (size_t i = 0; i < size; ++i) {
+                all_.push_back(open());
+                free_.push_back(all_.back().get());
+            }
+        }
+
+        Pool(const Pool&) = delete;
+        Pool& operator = (const Pool&) = delete;
+
+        size_t size() const {
+            return all_.size();
+        }
+
+        //! wait for a free connection
+        Lease acquire() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            released_.wait(lock, [this] { return !free_.empty(); });
+            DB* db = free_.back();
+            free_.pop_back();
+            return Lease(this, db);
+        }
+
+        //! free connection or an empty lease
+        Lease try_acquire() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (free_.empty()) {
+                return Lease();
+            }
+            DB* db = free_.back();
+            free_.pop_back();
+            return Lease(this, db);
+        }
+    };
+
+    class Scheduler {
+    public:
+        enum Preemption { NONE, INTERRUPT };
+
+        struct Class {
+            unsigned max_running = 1;           //!< jobs of the class running at once
+            size_t max_queued = 1000;           //!< waiting jobs, submit() fails beyond this
+            Preemption preemption = NONE;       //!< what happens when more important jobs wait
+        };
+
+        struct Stats {
+            uint64_t completed = 0;
+            uint64_t failed = 0;                //!< the job threw
+            uint64_t rejected = 0;
+            uint64_t preempted = 0;             //!< interrupted and queued again
+        };
+
+        using Job = std::function<void(DB&)>;
+
+    private:
+        struct Task {
+            Job job;
+            std::promise<void> done;
+        };
+
+        struct Worker {
+            Scheduler* self;
+            std::atomic<int> cls{-1};
+            std::atomic<bool> interrupt{false};
+            int busy_timeout = 0;               //!< ms
+            bool blocked = false;               //!< the job waited for a lock, guarded by mutex_
+            std::thread thread;
+        };
+
+        enum { progress_ops = 1000 };
+
+        Pool& pool_;
+        std::vector<Class> classes_;
+        std::vector<std::deque<Task>> queues_;
+        std::vector<unsigned> running_;
+        std::vector<unsigned> blocked_;         //!< jobs which waited for a lock, per class
+        std::vector<Stats> stats_;
+        std::vector<std::unique_ptr<Worker>> workers_;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        bool stop_ = false;
+
+        static int progress(void* arg) {
+            Worker* w = static_cast<Worker*>(arg);
+            return w->cls.load(std::memory_order_relaxed) >= 0 && w->interrupt.load(std::memory_order_relaxed);
+        }
+
+        //! a job waits for a lock: the less important interruptible jobs may hold it, they give way
+        //! and don't start again until the job is done
+        static int busy(void* arg, int count) {
+            Worker* w = static_cast<Worker*>(arg);
+            int cls = w->cls.load(std::memory_order_relaxed);
+            if (count == 0 && cls >= 0) {
+                Scheduler* self = w->self;
+                std::lock_guard<std::mutex> lock(self->mutex_);
+                if (!w->blocked) {
+                    w->blocked = true;
+                    ++self->blocked_[cls];
+                }
+                for (auto& other : self->workers_) {
+                    int c = other->cls;
+                    if (c > cls && self->classes_[c].preemption == INTERRUPT) {
+                        other->interrupt = true;
+                    }
+                }
+            }
+            if (count >= w->busy_timeout) {
+                return 0;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            return 1;
+        }
+
+        //! most important class with a waiting job and a free slot, -1 if none
+        int next_class() const {
+            bool blocked = false;
+            for (size_t c = 0; c < classes_.size(); ++c) {
+                if (blocked && classes_[c].preemption == INTERRUPT) {
+                    continue;
+                }
+                if (!queues_[c].empty() && running_[c] < classes_[c].max_running) {
+                    return static_cast<int>(c);
+                }
+                blocked = blocked || blocked_[c];
+            }
+            return -1;
+        }
+
+        //! interrupt the least important preemptible job if cls can't start otherwise
+        void preempt_for(int cls) {
+            for (auto& w : workers_) {
+                if (w->cls < 0) {
+                    return;     // an idle worker will take the job
+                }
+            }
+            Worker* victim = nullptr;
+            for (auto& w : workers_) {
+                int c = w->cls;
+                if (c > cls && classes_[c].preemption == INTERRUPT && !w->interrupt && (!victim || c > victim->cls)) {
+                    victim = w.get();
+                }
+            }
+            if (victim) {
+                victim->interrupt = true;
+            }
+        }
+
+        void work(Worker& w) {
+            Pool::Lease db = pool_.acquire();
+            w.busy_timeout = std::stoi(db->prepare("PRAGMA busy_timeout;").exec());
+            sqlite3_progress_handler(db->get(), progress_ops, &progress, &w);
+            sqlite3_busy_handler(db->get(), &busy, &w);
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            for (;;) {
+                int cls = -1;
+                wake_.wait(lock, [&] { return stop_ || (cls = next_class()) >= 0; });
+                if (stop_) {
+                    break;
+                }
+
+                Task task = std::move(queues_[cls].front());
+                queues_[cls].pop_front();
+                ++running_[cls];
+                w.interrupt = false;
+                w.cls = cls;
+                lock.unlock();
+
+                bool retry = false;
+                std::exception_ptr error;
+                try {
+                    task.job(*db);
+                } catch (const Error& e) {
+                    if (e.code() == SQLITE_INTERRUPT && w.interrupt) {
+                        retry = true;
+                    } else {
+                        error = std::current_exception();
+                    }
+                } catch (...) {
+                    error = std::current_exception();
+                }
+
+                lock.lock();
+                w.cls = -1;
+                w.interrupt = false;
+                --running_[cls];
+                if (w.blocked) {
+                    w.blocked = false;
+                    --blocked_[cls];
+                }
+                if (retry) {
+                    // ahead of the jobs submitted after it
+                    ++stats_[cls].preempted;
+                    queues_[cls].push_front(std::move(task));
+                } else if (error) {
+                    ++stats_[cls].failed;
+                    task.done.set_exception(error);
+                } else {
+                    ++stats_[cls].completed;
+                    task.done.set_value();
+                }
+                wake_.notify_all();
+            }
+            lock.unlock();
+
+            sqlite3_progress_handler(db->get(), 0, nullptr, nullptr);
+            sqlite3_busy_timeout(db->get(), w.busy_timeout);
+        }
+
+    public:
+        //! One worker per pooled connection, the workers lease all connections of the pool.
+        //! Classes are ordered from the most important one.
+        Scheduler(Pool& pool, std::vector<Class> classes)
+            : pool_(pool), classes_(std::move(classes)), queues_(classes_.size()), running_(classes_.size()), blocked_(classes_.size()), stats_(classes_.size()) {
+            if (classes_.empty() || classes_.size() > 32) {
+                throw Error(SQLITE_MISUSE, "scheduler needs 1 to 32 priority classes");
+            }
+            for (size_t i = 0; i < pool_.size(); ++i) {
+                workers_.emplace_back(new Worker);
+                workers_.back()->self = this;
+            }
+            for (auto& w : workers_) {
+                Worker* p = w.get();
+                p->thread = std::thread([this, p] { work(*p); });
+            }
+        }
+
+        Scheduler(const Scheduler&) = delete;
+        Scheduler& operator = (const Scheduler&) = delete;
+
+        //! finishes running jobs, waiting ones are dropped (their futures report broken_promise)
+        ~Scheduler() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            wake_.notify_all();
+            for (auto& w : workers_) {
+                w->thread.join();
+            }
+        }
+
+        //! queue job in class cls; throws SQLITE_BUSY if the class queue is full
+        std::future<void> submit(unsigned cls, Job job) {
+            if (cls >= classes_.size()) {
+                throw Error(SQLITE_RANGE, "unknown priority class ", cls);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queues_[cls].size() >= classes_[cls].max_queued) {
+                ++stats_[cls].rejected;
+                throw Error(SQLITE_BUSY, "queue of priority class ", cls, " is full");
+            }
+
+            queues_[cls].push_back(Task{std::move(job), {}});
+            std::future<void> res = queues_[cls].back().done.get_future();
+            if (running_[cls] < classes_[cls].max_running) {
+                preempt_for(static_cast<int>(cls));
+            }
+            wake_.notify_all();
+            return res;
+        }
+
+        Stats stats(unsigned cls) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return stats_.at(cls);
+        }
+    };
+
+} // namespace sqlitexx
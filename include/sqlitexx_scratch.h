@@ -0,0 +1,250 @@
+#pragma once
+
+#include "sqlitexx.h"
+#include <iterator>
+#include <map>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Scratch tables: TEMP tables in memory filled from C++ ranges, so multi-step processing can join
+ * intermediate results inside SQLite instead of carrying them in vectors between queries.
+ *
+ * Scratch switches the connection to temp_store=MEMORY and leases tables by name. A lease creates
+ * the table on first use, later leases of the same name and columns reuse it; when a lease ends
+ * the table is emptied, when the Scratch is destroyed its tables are dropped.
+ *
+ * Rows are std::tuple (or std::pair) of int, int64_t, double, std::string, std::string_view and
+ * std::nullptr_t, or bare values for single-column tables. They are inserted by a reused multi-row
+ * INSERT without copies of the strings, so the rows must be elements of a container (forward
+ * iterators returning references), not values computed by the iterator.
+ */
+
+namespace sqlitexx {
+
+    namespace scratch_detail {
+
+        // numbers and NULLs through the usual binds, strings without a copy
+        template <typename T>
+        void bind(Statement& st, unsigned pos, const T& x) {
+            st.bind(pos, x);
+        }
+
+        inline void bind(Statement& st, unsigned pos, std::string_view x) {
+            st.bind_static(pos, x);
+        }
+
+        inline void bind(Statement& st, unsigned pos, const std::string& x) {
+            st.bind_static(pos, x);
+        }
+
+        template <typename...T, size_t...I>
+        void bind_row(Statement& st, unsigned pos, const std::tuple<T...>& row, std::index_sequence<I...>) {
+            bool dummy[] = { true, (bind(st, pos + static_cast<unsigned>(I), std::get<I>(row)), true)... };
+            (void)dummy;
+        }
+
+        template <typename...T>
+        void bind_row(Statement& st, unsigned pos, const std::tuple<T...>& row) {
+            bind_row(st, pos, row, std::index_sequence_for<T...>{});
+        }
+
+        template <typename A, typename B>
+        void bind_row(Statement& st, unsigned pos, const std::pair<A, B>& row) {
+            bind(st, pos, row.first);
+            bind(st, pos + 1, row.second);
+        }
+
+        template <typename T>
+        void bind_row(Statement& st, unsigned pos, const T& value) {
+            bind(st, pos, value);
+        }
+
+        //! values in a row
+        template <typename T>
+        struct width : std::integral_constant<size_t, 1> {
+        };
+
+        template <typename...T>
+        struct width<std::tuple<T...>> : std::integral_constant<size_t, sizeof...(T)> {
+        };
+
+        template <typename A, typename B>
+        struct width<std::pair<A, B>> : std::integral_constant<size_t, 2> {
+        };
+
+    } // namespace scratch_detail
+
+    class Scratch {
+        struct Table {
+            std::string columns;
+            bool leased = false;
+        };
+
+        DB& db_;
+        std::map<std::string, Table> tables_;
+
+        void exec(const std::string& sql) {
+            db_.prepare(sql).exec();
+        }
+
+        static std::string qualified(const std::string& name) {
+            return "temp." + quote_identifier(name);
+        }
+
+    public:
+        class Lease {
+            Scratch* scratch_;
+            std::string name_;
+            size_t columns_;
+
+            friend class Scratch;
+
+            Lease(Scratch* s, std::string name, size_t columns) : scratch_(s), name_(std::move(name)), columns_(columns) {
+            }
+
+        public:
+            Lease(const Lease&) = delete;
+            Lease& operator = (const Lease&) = delete;
+
+            Lease(Lease&& l) : scratch_(l.scratch_), name_(std::move(l.name_)), columns_(l.columns_) {
+                l.scratch_ = nullptr;
+            }
+
+            ~Lease() {
+                if (scratch_) {
+                    scratch_->release(name_);
+                }
+            }
+
+            //! name to use in queries (temp."<name>")
+            std::string name() const {
+                return qualified(name_);
+            }
+
+            //! Append rows of [first, last), in one transaction unless one is already open. Throws
+            //! SQLITE_RANGE if the rows don't have a value for every column.
+            template <typename It>
+            size_t insert(It first, It last) {
+                // the rows are bound in place and must stay alive until the step
+                static_assert(std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<It>::iterator_category>::value &&
+                    std::is_lvalue_reference<typename std::iterator_traits<It>::reference>::value,
+                    "scratch rows must be elements of a container");
+                using Row = typename std::decay<typename std::iterator_traits<It>::reference>::type;
+                if (scratch_detail::width<Row>::value != columns_) {
+                    throw Error(SQLITE_RANGE, "rows have ", scratch_detail::width<Row>::value, " values, scratch table ", name_, " has ",
+                        columns_, " columns");
+                }
+                enum { chunk = 64 };
+                DB& db = scratch_->db_;
+                std::string row = "(?";
+                for (size_t i = 1; i < columns_; ++i) {
+                    row += ",?";
+                }
+                row += ")";
+                auto make = [&](size_t n) {
+                    std::string sql = "INSERT INTO " + qualified(name_) + " VALUES " + row;
+                    for (size_t i = 1; i < n; ++i) {
+                        sql += "," + row;
+                    }
+                    return db.prepare(sql + ";");
+                };
+
+                std::unique_ptr<Transaction> t;
+                if (sqlite3_get_autocommit(db.get())) {
+                    t.reset(new Transaction(db.transaction()));
+                }
+
+                // full chunks are bound as the rows are walked, only the last short one again
+                Statement full = make(chunk);
+                size_t rows = 0;
+                size_t n = 0;
+                It start = first;
+                for (; first != last; ++first) {
+                    scratch_detail::bind_row(full, static_cast<unsigned>(1 + n * columns_), *first);
+                    if (++n == chunk) {
+                        full.exec();
+                        rows += n;
+                        n = 0;
+                        start = std::next(first);
+                    }
+                }
+                if (n) {
+                    Statement tail = make(n);
+                    unsigned pos = 1;
+                    for (; start != last; ++start, pos += static_cast<unsigned>(columns_)) {
+                        scratch_detail::bind_row(tail, pos, *start);
+                    }
+                    tail.exec();
+                    rows += n;
+                }
+                if (t) {
+                    t->commit();
+                }
+                return rows;
+            }
+
+            template <typename Range>
+            size_t insert(const Range& rows) {
+                return insert(std::begin(rows), std::end(rows));
+            }
+        };
+
+        //! the connection keeps temp tables in memory from now on
+        explicit Scratch(DB& db) : db_(db) {
+            exec("PRAGMA temp_store=MEMORY;");
+        }
+
+        Scratch(const Scratch&) = delete;
+        Scratch& operator = (const Scratch&) = delete;
+
+        ~Scratch() {
+            for (const auto& t : tables_) {
+                sqlite3_exec(db_.get(), ("DROP TABLE IF EXISTS " + qualified(t.first) + ";").c_str(), nullptr, nullptr, nullptr);
+            }
+        }
+
+        //! Empty TEMP table with the columns (e.g. {"id INTEGER", "name TEXT"}), reused if it was
+        //! created with the same columns before.
+        Lease table(const std::string& name, const std::vector<std::string>& columns) {
+            std::string spec;
+            for (const auto& c : columns) {
+                spec += (spec.empty() ? "" : ", ") + c;
+            }
+
+            auto it = tables_.find(name);
+            if (it != tables_.end() && it->second.leased) {
+                throw Error(SQLITE_MISUSE, "scratch table ", name, " is in use");
+            }
+            if (it == tables_.end() || it->second.columns != spec) {
+                exec("DROP TABLE IF EXISTS " + qualified(name) + ";");
+                exec("CREATE TEMP TABLE " + quote_identifier(name) + " (" + spec + ");");
+                it = tables_.insert_or_assign(name, Table{spec, false}).first;
+            }
+            it->second.leased = true;
+            return Lease(this, name, columns.size());
+        }
+
+        //! scratch tables currently known, leased or not
+        size_t size() const {
+            return tables_.size();
+        }
+
+    private:
+        void release(const std::string& name) {
+            auto it = tables_.find(name);
+            if (it == tables_.end()) {
+                return;
+            }
+            it->second.leased = false;
+            // the truncate optimization makes this cheap; the table is kept for the next lease
+            if (sqlite3_exec(db_.get(), ("DELETE FROM " + qualified(name) + ";").c_str(), nullptr, nullptr, nullptr) != SQLITE_OK) {
+                sqlite3_exec(db_.get(), ("DROP TABLE IF EXISTS " + qualified(name) + ";").c_str(), nullptr, nullptr, nullptr);
+                tables_.erase(it);
+            }
+        }
+    };
+
+} // namespace sqlitexx
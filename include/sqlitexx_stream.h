@@ -0,0 +1,408 @@
+#pragma once
+
+#include "sqlitexx.h"
+#include <atomic>
+#include <charconv>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * Streaming of query results to a file descriptor.
+ *
+ * stream() steps the statement on a worker thread which encodes rows into a small set of large
+ * reusable buffers; the calling thread hands full buffers to the descriptor with writev(). When all
+ * buffers are waiting to be written the worker stops stepping until one comes back, so a slow
+ * consumer (a full pipe or socket) pauses the query instead of growing memory.
+ *
+ * Encoders: CsvEncoder (RFC 4180 with a header line), JsonEncoder (array of objects) and
+ * BinaryEncoder: "SQLXROW1", varint column count, names as varint length and bytes, then per row a
+ * 1 byte followed by the values and finally a 0 byte. A value is a type byte (SQLITE_INTEGER, ...)
+ * followed by a zigzag varint, 8 bytes of double or a varint length and bytes; NULL has no payload.
+ *
+ * Writing to a closed pipe raises SIGPIPE, ignore it in programs streaming to other processes.
+ */
+
+namespace sqlitexx {
+
+    namespace stream_format {
+
+        inline void put_varint(std::string& out, uint64_t x) {
+            while (x >= 0x80) {
+                out.push_back(static_cast<char>(x | 0x80));
+                x >>= 7;
+            }
+            out.push_back(static_cast<char>(x));
+        }
+
+        template <typename T>
+        inline void put_number(std::string& out, T x) {
+            char buf[32];
+            auto res = std::to_chars(buf, buf + sizeof(buf), x);
+            out.append(buf, res.ptr);
+        }
+
+        inline void put_double(std::string& out, double x) {
+            put_number(out, x);
+            // keep reals distinguishable from integers like SQLite does
+            if (std::isfinite(x) && std::abs(x) < 1e15 && x == static_cast<double>(static_cast<int64_t>(x))) {
+                out += ".0";
+            }
+        }
+
+        inline void put_hex(std::string& out, const unsigned char* data, size_t len) {
+            static const char digits[] = "0123456789abcdef";
+            for (size_t i = 0; i < len; ++i) {
+                out.push_back(digits[data[i] >> 4]);
+                out.push_back(digits[data[i] & 15]);
+            }
+        }
+
+    } // namespace stream_format
+
+    class CsvEncoder {
+        static void quoted(std::string& out, std::string_view s) {
+            if (s.find_first_of(",\"\r\n") == std::string_view::npos) {
+                out += s;
+                return;
+            }
+            out.push_back('"');
+            for (char c : s) {
+                if (c == '"') {
+                    out.push_back('"');
+                }
+                out.push_back(c);
+            }
+            out.push_back('"');
+        }
+
+    public:
+        void begin(sqlite3_stmt* st, std::string& out) {
+            int n = sqlite3_column_count(st);
+            for (int i = 0; i < n; ++i) {
+                if (i) {
+                    out.push_back(',');
+                }
+                quoted(out, sqlite3_column_name(st, i));
+            }
+            out += "\r\n";
+        }
+
+        void row(sqlite3_stmt* st, std::string& out) {
+            int n = sqlite3_column_count(st);
+            for (int i = 0; i < n; ++i) {
+                if (i) {
+                    out.push_back(',');
+                }
+                switch (sqlite3_column_type(st, i)) {
+                case SQLITE_NULL:
+                    break;
+                case SQLITE_INTEGER:
+                    stream_format::put_number(out, static_cast<int64_t>(sqlite3_column_int64(st, i)));
+                    break;
+                case SQLITE_FLOAT:
+                    stream_format::put_double(out, sqlite3_column_double(st, i));
+                    break;
+                default: {
+                    const char* data = reinterpret_cast<const char*>(sqlite3_column_text(st, i));
+                    quoted(out, std::string_view(data ? data : "", sqlite3_column_bytes(st, i)));
+                }
+                }
+            }
+            out += "\r\n";
+        }
+
+        void end(sqlite3_stmt*, std::string&) {
+        }
+    };
+
+    class JsonEncoder {
+        std::vector<std::string> keys_;
+        bool first_ = true;
+
+        static void string(std::string& out, std::string_view s) {
+            static const char digits[] = "0123456789abcdef";
+            out.push_back('"');
+            for (unsigned char c : s) {
+                if (c == '"' || c == '\\') {
+                    out.push_back('\\');
+                    out.push_back(c);
+                } else if (c < 0x20) {
+                    out += "\\u00";
+                    out.push_back(digits[c >> 4]);
+                    out.push_back(digits[c & 15]);
+                } else {
+                    out.push_back(c);
+                }
+            }
+            out.push_back('"');
+        }
+
+    public:
+        void begin(sqlite3_stmt* st, std::string& out) {
+            keys_.clear();
+            for (int i = 0; i < sqlite3_column_count(st); ++i) {
+                std::string key;
+                string(key, sqlite3_column_name(st, i));
+                keys_.push_back(key + ':');
+            }
+            first_ = true;
+            out.push_back('[');
+        }
+
+        //! objects with column names as keys; blobs are hex strings, infinities null
+        void row(sqlite3_stmt* st, std::string& out) {
+            out += first_ ? "\n{" : ",\n{";
+            first_ = false;
+            for (size_t i = 0; i < keys_.size(); ++i) {
+                if (i) {
+                    out.push_back(',');
+                }
+                out += keys_[i];
+                switch (sqlite3_column_type(st, i)) {
+                case SQLITE_NULL:
+                    out += "null";
+                    break;
+                case SQLITE_INTEGER:
+                    stream_format::put_number(out, static_cast<int64_t>(sqlite3_column_int64(st, i)));
+                    break;
+                case SQLITE_FLOAT: {
+                    double x = sqlite3_column_double(st, i);
+                    if (std::isfinite(x)) {
+                        stream_format::put_double(out, x);
+                    } else {
+                        out += "null";
+                    }
+                    break;
+                }
+                case SQLITE_BLOB: {
+                    const unsigned char* data = static_cast<const unsigned char*>(sqlite3_column_blob(st, i));
+                    out.push_back('"');
+                    stream_format::put_hex(out, data, sqlite3_column_bytes(st, i));
+                    out.push_back('"');
+                    break;
+                }
+                default: {
+                    const char* data = reinterpret_cast<const char*>(sqlite3_column_text(st, i));
+                    string(out, std::string_view(data ? data : "", sqlite3_column_bytes(st, i)));
+                }
+                }
+            }
+            out.push_back('}');
+        }
+
+        void end(sqlite3_stmt*, std::string& out) {
+            out += "\n]\n";
+        }
+    };
+
+    class BinaryEncoder {
+    public:
+        void begin(sqlite3_stmt* st, std::string& out) {
+            out += "SQLXROW1";
+            int n = sqlite3_column_count(st);
+            stream_format::put_varint(out, n);
+            for (int i = 0; i < n; ++i) {
+                const char* name = sqlite3_column_name(st, i);
+                size_t len = std::strlen(name);
+                stream_format::put_varint(out, len);
+                out.append(name, len);
+            }
+        }
+
+        void row(sqlite3_stmt* st, std::string& out) {
+            out.push_back(1);
+            int n = sqlite3_column_count(st);
+            for (int i = 0; i < n; ++i) {
+                int type = sqlite3_column_type(st, i);
+                out.push_back(static_cast<char>(type));
+                switch (type) {
+                case SQLITE_INTEGER: {
+                    int64_t x = sqlite3_column_int64(st, i);
+                    stream_format::put_varint(out, (static_cast<uint64_t>(x) << 1) ^ static_cast<uint64_t>(x >> 63));
+                    break;
+                }
+                case SQLITE_FLOAT: {
+                    double x = sqlite3_column_double(st, i);
+                    char bytes[8];
+                    std::memcpy(bytes, &x, 8);
+                    out.append(bytes, 8);
+                    break;
+                }
+                case SQLITE_TEXT:
+                case SQLITE_BLOB: {
+                    const char* data = type == SQLITE_TEXT ? reinterpret_cast<const char*>(sqlite3_column_text(st, i))
+                                                           : static_cast<const char*>(sqlite3_column_blob(st, i));
+                    size_t len = sqlite3_column_bytes(st, i);
+                    stream_format::put_varint(out, len);
+                    out.append(data ? data : "", len);
+                    break;
+                }
+                }
+            }
+        }
+
+        void end(sqlite3_stmt*, std::string& out) {
+            out.push_back(0);
+        }
+    };
+
+    struct StreamOptions {
+        size_t buffer_size = 256 * 1024;    //!< a buffer is handed to the writer when it grows beyond this
+        size_t buffers = 4;                 //!< buffers in flight, the memory bound of the stream
+    };
+
+    struct StreamStats {
+        uint64_t rows = 0;
+        uint64_t bytes = 0;
+        uint64_t writes = 0;                //!< writev() calls
+        uint64_t stalls = 0;                //!< times stepping paused because all buffers were in flight
+    };
+
+    //! Run the statement to completion and write its rows encoded by enc to fd, see above.
+    //! Throws on query errors and on write errors (the query is then abandoned).
+    template <typename Encoder>
+    StreamStats stream(Statement& st, int fd, Encoder enc, const StreamOptions& opts = StreamOptions{}) {
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::vector<std::string> storage(std::max<size_t>(opts.buffers, 2));
+        std::vector<std::string*> free_buffers;
+        std::deque<std::string*> full;
+        for (auto& b : storage) {
+            b.reserve(opts.buffer_size + opts.buffer_size / 4);
+            free_buffers.push_back(&b);
+        }
+        bool finished = false;
+        bool cancelled = false;
+        std::exception_ptr failure;
+        StreamStats stats;
+
+        std::thread producer([&] {
+            sqlite3_stmt* s = st.get();
+            std::string* buf = nullptr;
+            auto take = [&]() -> bool {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (free_buffers.empty()) {
+                    ++stats.stalls;
+                    changed.wait(lock, [&] { return !free_buffers.empty() || cancelled; });
+                }
+                if (cancelled) {
+                    return false;
+                }
+                buf = free_buffers.back();
+                free_buffers.pop_back();
+                buf->clear();
+                return true;
+            };
+            auto give = [&] {
+                std::lock_guard<std::mutex> lock(mutex);
+                full.push_back(buf);
+                buf = nullptr;
+                changed.notify_all();
+            };
+
+            try {
+                // a cancelled stream leaves the statement in the middle of its rows
+                ResetGuard guard(st);
+                if (take()) {
+                    enc.begin(s, *buf);
+                    uint64_t rows = 0;
+                    while (st.step()) {
+                        enc.row(s, *buf);
+                        ++rows;
+                        if (buf->size() >= opts.buffer_size) {
+                            give();
+                            if (!take()) {
+                                break;
+                            }
+                        }
+                    }
+                    if (buf) {
+                        enc.end(s, *buf);
+                        give();
+                    }
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stats.rows = rows;
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                failure = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = true;
+            changed.notify_all();
+        });
+
+        // writer: everything queued goes out in one writev()
+        std::vector<std::string*> batch;
+        std::vector<iovec> iov;
+        int error = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return !full.empty() || finished; });
+                if (full.empty()) {
+                    break;
+                }
+                batch.assign(full.begin(), full.end());
+                full.clear();
+            }
+
+            iov.clear();
+            for (auto* b : batch) {
+                if (!b->empty()) {
+                    iov.push_back(iovec{const_cast<char*>(b->data()), b->size()});
+                }
+            }
+            size_t first = 0;
+            while (first < iov.size()) {
+                ssize_t n = ::writev(fd, iov.data() + first, std::min<size_t>(iov.size() - first, IOV_MAX));
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    error = errno;
+                    break;
+                }
+                ++stats.writes;
+                stats.bytes += n;
+                // skip what was written, a partial write leaves the rest of an iovec
+                while (first < iov.size() && static_cast<size_t>(n) >= iov[first].iov_len) {
+                    n -= iov[first].iov_len;
+                    ++first;
+                }
+                if (first < iov.size()) {
+                    iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + n;
+                    iov[first].iov_len -= n;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            free_buffers.insert(free_buffers.end(), batch.begin(), batch.end());
+            if (error) {
+                cancelled = true;
+            }
+            changed.notify_all();
+            if (error) {
+                break;
+            }
+        }
+
+        producer.join();
+        if (error) {
+            throw Error(SQLITE_IOERR_WRITE, "can't write query results: ", std::strerror(error));
+        }
+        if (failure) {
+            std::rethrow_exception(failure);
+        }
+        return stats;
+    }
+
+} // namespace sqlitexx
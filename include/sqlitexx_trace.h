@@ -0,0 +1,422 @@
+#pragma once
+
+#include "sqlitexx.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+/**
+ * Workload capture and replay.
+ *
+ * TraceWriter is a Tracer which stores SQL, parameters, connection and time of every statement
+ * execution into a compact binary file; records are encoded by the executing thread and written by
+ * a background thread. Trace::load() reads the file back and replay() executes it again on fresh
+ * connections at the original or a scaled speed and reports statement latencies.
+ *
+ * File format: magic "SQLXTRC1" followed by records, all integers are LEB128 varints:
+ *     'S' id length bytes                          - SQL text, sent once per distinct statement
+ *     'E' delta_ns connection sql nparams params   - execution, delta from the previous execution
+ * A parameter is a type byte (SQLITE_INTEGER, ...) and a zigzag varint, 8 bytes of double or a
+ * length and bytes of text; NULL has no payload.
+ */
+
+namespace sqlitexx {
+
+    namespace trace_format {
+
+        static const char magic[] = "SQLXTRC1";
+
+        inline void put_varint(std::string& out, uint64_t x) {
+            while (x >= 0x80) {
+                out.push_back(static_cast<char>(x | 0x80));
+                x >>= 7;
+            }
+            out.push_back(static_cast<char>(x));
+        }
+
+        inline bool get_varint(const std::string& in, size_t& pos, uint64_t& x) {
+            x = 0;
+            for (int shift = 0; shift < 64 && pos < in.size(); shift += 7) {
+                unsigned char c = in[pos++];
+                x |= static_cast<uint64_t>(c & 0x7f) << shift;
+                if (!(c & 0x80)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        inline uint64_t zigzag(int64_t x) {
+            return (static_cast<uint64_t>(x) << 1) ^ static_cast<uint64_t>(x >> 63);
+        }
+
+        inline int64_t unzigzag(uint64_t x) {
+            return static_cast<int64_t>(x >> 1) ^ -static_cast<int64_t>(x & 1);
+        }
+
+    } // namespace trace_format
+
+    //! Tracer writing a trace file, attach it with DB::trace().
+    class TraceWriter : public Tracer {
+        enum { flush_size = 1 << 16 };
+
+        std::FILE* file_ = nullptr;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::condition_variable written_;
+        std::string pending_;
+        std::unordered_map<std::string, uint64_t> sql_ids_;
+        std::unordered_map<sqlite3*, uint64_t> connections_;
+        std::chrono::steady_clock::time_point start_;
+        uint64_t last_ns_ = 0;
+        uint64_t records_ = 0;
+        uint64_t requested_ = 0;
+        uint64_t flushed_ = 0;
+        bool stop_ = false;
+        bool failed_ = false;
+        std::thread writer_;
+
+        void write_loop() {
+            std::string chunk;
+            std::unique_lock<std::mutex> lock(mutex_);
+            for (;;) {
+                wake_.wait_for(lock, std::chrono::milliseconds(100), [this] {
+                    return stop_ || pending_.size() >= flush_size || requested_ != flushed_;
+                });
+
+                uint64_t requested = requested_;
+                bool sync = requested != flushed_;
+                chunk.clear();
+                chunk.swap(pending_);
+                bool stop = stop_;
+
+                lock.unlock();
+                if (!chunk.empty() && std::fwrite(chunk.data(), 1, chunk.size(), file_) != chunk.size()) {
+                    failed_ = true;
+                }
+                if (sync) {
+                    std::fflush(file_);
+                }
+                lock.lock();
+
+                flushed_ = requested;
+                written_.notify_all();
+                if (stop && pending_.empty()) {
+                    return;
+                }
+            }
+        }
+
+        bool stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stop_) {
+                    return !failed_;
+                }
+                stop_ = true;
+                ++requested_;
+            }
+            wake_.notify_one();
+            writer_.join();
+            if (std::fclose(file_) != 0) {
+                failed_ = true;
+            }
+            return !failed_;
+        }
+
+    public:
+        explicit TraceWriter(const std::string& path) : start_(std::chrono::steady_clock::now()) {
+            file_ = std::fopen(path.c_str(), "wb");
+            if (!file_) {
+                throw Error(SQLITE_CANTOPEN, "can't create trace file '", path, "'");
+            }
+            std::fwrite(trace_format::magic, 1, 8, file_);
+            writer_ = std::thread([this] { write_loop(); });
+        }
+
+        TraceWriter(const TraceWriter&) = delete;
+        TraceWriter& operator = (const TraceWriter&) = delete;
+
+        ~TraceWriter() {
+            stop();
+        }
+
+        void statement(sqlite3_stmt* stmt, const std::vector<Param>& params) override {
+            // parameters are encoded outside of the lock, they are the bulk of the record
+            thread_local std::string body;
+            body.clear();
+            trace_format::put_varint(body, params.size());
+            for (const auto& p : params) {
+                body.push_back(static_cast<char>(p.type));
+                switch (p.type) {
+                case SQLITE_INTEGER:
+                    trace_format::put_varint(body, trace_format::zigzag(p.i));
+                    break;
+                case SQLITE_FLOAT: {
+                    char bytes[8];
+                    std::memcpy(bytes, &p.d, 8);
+                    body.append(bytes, 8);
+                    break;
+                }
+                case SQLITE_TEXT:
+                case SQLITE_BLOB:
+                    trace_format::put_varint(body, p.s.size());
+                    body += p.s;
+                    break;
+                }
+            }
+
+            const char* sql = sqlite3_sql(stmt);
+            sqlite3* db = sqlite3_db_handle(stmt);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stop_) {
+                return;
+            }
+
+            auto conn = connections_.emplace(db, connections_.size()).first->second;
+            auto ins = sql_ids_.emplace(sql ? sql : "", sql_ids_.size());
+            if (ins.second) {
+                pending_.push_back('S');
+                trace_format::put_varint(pending_, ins.first->second);
+                trace_format::put_varint(pending_, ins.first->first.size());
+                pending_ += ins.first->first;
+            }
+
+            // the clock is read under the lock so times in the file never go back
+            uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+            now = std::max(now, last_ns_);
+            pending_.push_back('E');
+            trace_format::put_varint(pending_, now - last_ns_);
+            trace_format::put_varint(pending_, conn);
+            trace_format::put_varint(pending_, ins.first->second);
+            pending_ += body;
+            last_ns_ = now;
+            ++records_;
+
+            if (pending_.size() >= flush_size) {
+                wake_.notify_one();
+            }
+        }
+
+        //! wait until all records captured so far are in the file
+        void flush() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (stop_) {
+                return;
+            }
+            uint64_t ticket = ++requested_;
+            wake_.notify_one();
+            written_.wait(lock, [&] { return flushed_ >= ticket; });
+        }
+
+        //! stop capturing and close the file; throws if anything could not be written
+        void close() {
+            if (!stop()) {
+                throw Error(SQLITE_IOERR, "can't write trace file");
+            }
+        }
+
+        //! number of executions captured
+        uint64_t records() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return records_;
+        }
+    };
+
+    struct TraceEvent {
+        uint64_t time_ns;       //!< since start of the capture
+        uint32_t connection;
+        uint32_t sql;           //!< index in Trace::sql
+        std::vector<Tracer::Param> params;
+    };
+
+    struct Trace {
+        std::vector<std::string> sql;
+        std::vector<TraceEvent> events;
+
+        static Trace load(const std::string& path) {
+            std::FILE* f = std::fopen(path.c_str(), "rb");
+            if (!f) {
+                throw Error(SQLITE_CANTOPEN, "can't open trace file '", path, "'");
+            }
+            std::string data;
+            char buf[1 << 16];
+            size_t n;
+            while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0) {
+                data.append(buf, n);
+            }
+            std::fclose(f);
+
+            if (data.compare(0, 8, trace_format::magic) != 0) {
+                throw Error(SQLITE_FORMAT, "'", path, "' is not a trace file");
+            }
+
+            Trace res;
+            uint64_t time = 0;
+            size_t pos = 8;
+            auto corrupt = [&] {
+                return Error(SQLITE_CORRUPT, "trace file '", path, "' is corrupt at offset ", pos);
+            };
+            while (pos < data.size()) {
+                char tag = data[pos++];
+                uint64_t a, b, c, len;
+                if (tag == 'S') {
+                    if (!trace_format::get_varint(data, pos, a) || !trace_format::get_varint(data, pos, len) ||
+                            a != res.sql.size() || len > data.size() - pos) {
+                        throw corrupt();
+                    }
+                    res.sql.push_back(data.substr(pos, len));
+                    pos += len;
+                } else if (tag == 'E') {
+                    if (!trace_format::get_varint(data, pos, a) || !trace_format::get_varint(data, pos, b) ||
+                            !trace_format::get_varint(data, pos, c) || !trace_format::get_varint(data, pos, len) ||
+                            c >= res.sql.size() || len > data.size() - pos) {
+                        throw corrupt();
+                    }
+                    time += a;
+                    TraceEvent ev{time, static_cast<uint32_t>(b), static_cast<uint32_t>(c), {}};
+                    ev.params.resize(len);
+                    for (auto& p : ev.params) {
+                        if (pos >= data.size()) {
+                            throw corrupt();
+                        }
+                        p.type = static_cast<unsigned char>(data[pos++]);
+                        if (p.type == SQLITE_INTEGER) {
+                            if (!trace_format::get_varint(data, pos, a)) {
+                                throw corrupt();
+                            }
+                            p.i = trace_format::unzigzag(a);
+                        } else if (p.type == SQLITE_FLOAT) {
+                            if (data.size() - pos < 8) {
+                                throw corrupt();
+                            }
+                            std::memcpy(&p.d, data.data() + pos, 8);
+                            pos += 8;
+                        } else if (p.type == SQLITE_TEXT || p.type == SQLITE_BLOB) {
+                            if (!trace_format::get_varint(data, pos, a) || a > data.size() - pos) {
+                                throw corrupt();
+                            }
+                            p.s = data.substr(pos, a);
+                            pos += a;
+                        } else if (p.type != SQLITE_NULL) {
+                            throw corrupt();
+                        }
+                    }
+                    res.events.push_back(std::move(ev));
+                } else {
+                    throw corrupt();
+                }
+            }
+            return res;
+        }
+    };
+
+    struct ReplayOptions {
+        //! replay connections, 0 is one per captured connection. Captured connection c runs on
+        //! replay connection c % connections, so fewer connections may interleave transactions.
+        unsigned connections = 0;
+        //! 1 is the original pace, 2 twice as fast, 0 as fast as possible
+        double speed = 1.0;
+        //! opens a replay connection, called once per connection
+        std::function<std::unique_ptr<DB>()> open;
+    };
+
+    struct ReplayReport {
+        std::vector<uint64_t> latencies_ns;     //!< sorted
+        uint64_t errors = 0;
+        double seconds = 0;
+
+        uint64_t percentile(double p) const {
+            if (latencies_ns.empty()) {
+                return 0;
+            }
+            size_t idx = static_cast<size_t>(p / 100.0 * (latencies_ns.size() - 1) + 0.5);
+            return latencies_ns[std::min(idx, latencies_ns.size() - 1)];
+        }
+    };
+
+    inline ReplayReport replay(const Trace& trace, const ReplayOptions& opts) {
+        unsigned n = opts.connections;
+        if (!n) {
+            for (const auto& ev : trace.events) {
+                n = std::max(n, ev.connection + 1);
+            }
+            n = std::max(n, 1u);
+        }
+
+        std::vector<std::unique_ptr<DB>> dbs;
+        for (unsigned i = 0; i < n; ++i) {
+            dbs.push_back(opts.open());
+        }
+
+        std::vector<std::vector<uint64_t>> latencies(n);
+        std::vector<uint64_t> errors(n);
+        auto start = std::chrono::steady_clock::now();
+
+        auto worker = [&](unsigned id) {
+            DB& db = *dbs[id];
+            std::vector<std::unique_ptr<Statement>> cache(trace.sql.size());
+
+            for (const auto& ev : trace.events) {
+                if (ev.connection % n != id) {
+                    continue;
+                }
+                if (opts.speed > 0) {
+                    std::this_thread::sleep_until(start + std::chrono::nanoseconds(static_cast<uint64_t>(ev.time_ns / opts.speed)));
+                }
+
+                auto t0 = std::chrono::steady_clock::now();
+                try {
+                    auto& st = cache[ev.sql];
+                    if (!st) {
+                        st.reset(new Statement(db.prepare(trace.sql[ev.sql])));
+                    }
+                    st->clear_bindings();
+                    for (size_t i = 0; i < ev.params.size(); ++i) {
+                        const auto& p = ev.params[i];
+                        if (p.type == SQLITE_INTEGER) {
+                            st->bind(i + 1, p.i);
+                        } else if (p.type == SQLITE_FLOAT) {
+                            st->bind(i + 1, p.d);
+                        } else if (p.type == SQLITE_TEXT) {
+                            st->bind(i + 1, p.s);
+                        } else if (p.type == SQLITE_BLOB) {
+                            st->bind_blob(i + 1, p.s);
+                        }
+                    }
+                    while (st->step()) {
+                    }
+                } catch (const Error&) {
+                    // a failed step has reset the statement
+                    ++errors[id];
+                }
+                latencies[id].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count());
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < n; ++i) {
+            threads.emplace_back(worker, i);
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        ReplayReport report;
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for (unsigned i = 0; i < n; ++i) {
+            report.latencies_ns.insert(report.latencies_ns.end(), latencies[i].begin(), latencies[i].end());
+            report.errors += errors[i];
+        }
+        std::sort(report.latencies_ns.begin(), report.latencies_ns.end());
+        return report;
+    }
+
+} // namespace sqlitexx
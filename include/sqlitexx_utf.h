@@ -0,0 +1,417 @@
+#pragma once
+
+#include "sqlitexx.h"
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#if !defined(SQLITEXX_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SQLITEXX_UTF_X86 1
+#include <immintrin.h>
+#elif !defined(SQLITEXX_NO_SIMD) && defined(__aarch64__) && defined(__ARM_NEON)
+#define SQLITEXX_UTF_NEON 1
+#include <arm_neon.h>
+#endif
+
+/**
+ * UTF-8 validation and UTF-8 <-> UTF-16 transcoding for the bind and decode paths.
+ *
+ * SQLite stores whatever bytes it gets as TEXT, so invalid UTF-8 ends up in indexes and breaks
+ * collations and conversions later. bind_utf8() checks the text before binding, bind_utf16() and
+ * text16() transcode with the functions here instead of SQLite's byte-at-a-time conversion.
+ *
+ * Runs of ASCII, the common case, are checked and widened or narrowed 16 or 32 bytes at a time
+ * with SSE2, AVX2 or NEON, chosen at runtime (AVX2 only where the CPU has it); multi-byte
+ * sequences are validated by scalar code. Define SQLITEXX_NO_SIMD to build the scalar code only.
+ */
+
+namespace sqlitexx {
+
+    namespace utf {
+
+        enum Isa { SCALAR, SSE2, AVX2, NEON };
+
+        //! vectorised kernels: each returns how many leading units are ASCII (and copies them)
+        struct Kernels {
+            Isa isa;
+            size_t (*ascii_prefix)(const char* s, size_t n);
+            size_t (*widen_ascii)(const char* s, size_t n, char16_t* out);
+            size_t (*narrow_ascii)(const char16_t* s, size_t n, char* out);
+        };
+
+        namespace detail {
+
+            inline size_t ascii_prefix_scalar(const char* s, size_t n) {
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    uint64_t w;
+                    std::memcpy(&w, s + i, 8);
+                    if (w & 0x8080808080808080ull) {
+                        break;
+                    }
+                }
+                while (i < n && !(static_cast<unsigned char>(s[i]) & 0x80)) {
+                    ++i;
+                }
+                return i;
+            }
+
+            inline size_t widen_ascii_scalar(const char* s, size_t n, char16_t* out) {
+                size_t i = 0;
+                for (; i < n && !(static_cast<unsigned char>(s[i]) & 0x80); ++i) {
+                    out[i] = static_cast<unsigned char>(s[i]);
+                }
+                return i;
+            }
+
+            inline size_t narrow_ascii_scalar(const char16_t* s, size_t n, char* out) {
+                size_t i = 0;
+                for (; i < n && s[i] < 0x80; ++i) {
+                    out[i] = static_cast<char>(s[i]);
+                }
+                return i;
+            }
+
+#ifdef SQLITEXX_UTF_X86
+            __attribute__((target("sse2"))) inline size_t ascii_prefix_sse2(const char* s, size_t n) {
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i)));
+                    if (mask) {
+                        return i + __builtin_ctz(mask);
+                    }
+                }
+                return i + ascii_prefix_scalar(s + i, n - i);
+            }
+
+            __attribute__((target("sse2"))) inline size_t widen_ascii_sse2(const char* s, size_t n, char16_t* out) {
+                const __m128i zero = _mm_setzero_si128();
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+                    if (_mm_movemask_epi8(v)) {
+                        break;
+                    }
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi8(v, zero));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8), _mm_unpackhi_epi8(v, zero));
+                }
+                return i + widen_ascii_scalar(s + i, n - i, out + i);
+            }
+
+            __attribute__((target("sse2"))) inline size_t narrow_ascii_sse2(const char16_t* s, size_t n, char* out) {
+                const __m128i high = _mm_set1_epi16(static_cast<short>(0xff80));
+                const __m128i zero = _mm_setzero_si128();
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+                    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + 8));
+                    __m128i over = _mm_and_si128(_mm_or_si128(a, b), high);
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi16(over, zero)) != 0xffff) {
+                        break;
+                    }
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(a, b));
+                }
+                return i + narrow_ascii_scalar(s + i, n - i, out + i);
+            }
+
+            __attribute__((target("avx2"))) inline size_t ascii_prefix_avx2(const char* s, size_t n) {
+                size_t i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    unsigned mask = _mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i)));
+                    if (mask) {
+                        return i + __builtin_ctz(mask);
+                    }
+                }
+                return i + ascii_prefix_sse2(s + i, n - i);
+            }
+
+            __attribute__((target("avx2"))) inline size_t widen_ascii_avx2(const char* s, size_t n, char16_t* out) {
+                size_t i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+                    if (_mm256_movemask_epi8(v)) {
+                        break;
+                    }
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+                }
+                return i + widen_ascii_sse2(s + i, n - i, out + i);
+            }
+
+            __attribute__((target("avx2"))) inline size_t narrow_ascii_avx2(const char16_t* s, size_t n, char* out) {
+                const __m256i high = _mm256_set1_epi16(static_cast<short>(0xff80));
+                size_t i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+                    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i + 16));
+                    if (!_mm256_testz_si256(_mm256_or_si256(a, b), high)) {
+                        break;
+                    }
+                    // packus works on 128-bit lanes: restore the order of the quarters
+                    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), packed);
+                }
+                return i + narrow_ascii_sse2(s + i, n - i, out + i);
+            }
+#endif
+
+#ifdef SQLITEXX_UTF_NEON
+            inline size_t ascii_prefix_neon(const char* s, size_t n) {
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    if (vmaxvq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(s + i))) & 0x80) {
+                        break;
+                    }
+                }
+                return i + ascii_prefix_scalar(s + i, n - i);
+            }
+
+            inline size_t widen_ascii_neon(const char* s, size_t n, char16_t* out) {
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(s + i));
+                    if (vmaxvq_u8(v) & 0x80) {
+                        break;
+                    }
+                    vst1q_u16(reinterpret_cast<uint16_t*>(out + i), vmovl_u8(vget_low_u8(v)));
+                    vst1q_u16(reinterpret_cast<uint16_t*>(out + i + 8), vmovl_high_u8(v));
+                }
+                return i + widen_ascii_scalar(s + i, n - i, out + i);
+            }
+
+            inline size_t narrow_ascii_neon(const char16_t* s, size_t n, char* out) {
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    uint16x8_t a = vld1q_u16(reinterpret_cast<const uint16_t*>(s + i));
+                    uint16x8_t b = vld1q_u16(reinterpret_cast<const uint16_t*>(s + i + 8));
+                    if (vmaxvq_u16(vorrq_u16(a, b)) >= 0x80) {
+                        break;
+                    }
+                    vst1q_u8(reinterpret_cast<uint8_t*>(out + i), vcombine_u8(vmovn_u16(a), vmovn_u16(b)));
+                }
+                return i + narrow_ascii_scalar(s + i, n - i, out + i);
+            }
+#endif
+
+            inline const Kernels* kernels_for(Isa isa) {
+                static const Kernels scalar{ SCALAR, ascii_prefix_scalar, widen_ascii_scalar, narrow_ascii_scalar };
+#ifdef SQLITEXX_UTF_X86
+                static const Kernels sse2{ SSE2, ascii_prefix_sse2, widen_ascii_sse2, narrow_ascii_sse2 };
+                static const Kernels avx2{ AVX2, ascii_prefix_avx2, widen_ascii_avx2, narrow_ascii_avx2 };
+                if (isa == AVX2 && __builtin_cpu_supports("avx2")) {
+                    return &avx2;
+                }
+                if (isa == SSE2 && __builtin_cpu_supports("sse2")) {
+                    return &sse2;
+                }
+#endif
+#ifdef SQLITEXX_UTF_NEON
+                static const Kernels neon{ NEON, ascii_prefix_neon, widen_ascii_neon, narrow_ascii_neon };
+                if (isa == NEON) {
+                    return &neon;
+                }
+#endif
+                return isa == SCALAR ? &scalar : nullptr;
+            }
+
+            inline const Kernels* best_kernels() {
+                for (Isa isa : { AVX2, SSE2, NEON }) {
+                    if (const Kernels* k = kernels_for(isa)) {
+                        return k;
+                    }
+                }
+                return kernels_for(SCALAR);
+            }
+
+            inline std::atomic<const Kernels*>& current() {
+                static std::atomic<const Kernels*> k{best_kernels()};
+                return k;
+            }
+
+            //! length of the valid multi-byte sequence at s[0], 0 if it is invalid (Unicode table 3-7)
+            inline size_t sequence(const unsigned char* s, size_t n, char32_t& cp) {
+                auto cont = [&](size_t i, unsigned char lo = 0x80, unsigned char hi = 0xbf) {
+                    return i < n && s[i] >= lo && s[i] <= hi;
+                };
+                unsigned char c = s[0];
+                if (c >= 0xc2 && c <= 0xdf) {
+                    if (!cont(1)) {
+                        return 0;
+                    }
+                    cp = (c & 0x1fu) << 6 | (s[1] & 0x3fu);
+                    return 2;
+                }
+                if (c >= 0xe0 && c <= 0xef) {
+                    if (!cont(1, c == 0xe0 ? 0xa0 : 0x80, c == 0xed ? 0x9f : 0xbf) || !cont(2)) {
+                        return 0;
+                    }
+                    cp = (c & 0x0fu) << 12 | (s[1] & 0x3fu) << 6 | (s[2] & 0x3fu);
+                    return 3;
+                }
+                if (c >= 0xf0 && c <= 0xf4) {
+                    if (!cont(1, c == 0xf0 ? 0x90 : 0x80, c == 0xf4 ? 0x8f : 0xbf) || !cont(2) || !cont(3)) {
+                        return 0;
+                    }
+                    cp = (c & 0x07u) << 18 | (s[1] & 0x3fu) << 12 | (s[2] & 0x3fu) << 6 | (s[3] & 0x3fu);
+                    return 4;
+                }
+                return 0;
+            }
+
+        } // namespace detail
+
+        //! kernels in use
+        inline Isa isa() {
+            return detail::current().load(std::memory_order_relaxed)->isa;
+        }
+
+        //! Use the kernels of isa (for tests and benchmarks); false if the CPU or build lacks them.
+        inline bool use_isa(Isa isa) {
+            const Kernels* k = detail::kernels_for(isa);
+            if (k) {
+                detail::current().store(k, std::memory_order_relaxed);
+            }
+            return k != nullptr;
+        }
+
+        //! Whether s is valid UTF-8 (no overlong forms, surrogates or code points above U+10FFFF);
+        //! otherwise error (if set) is the offset of the first invalid byte.
+        inline bool valid_utf8(std::string_view s, size_t* error = nullptr) {
+            const Kernels* k = detail::current().load(std::memory_order_relaxed);
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(s.data());
+            size_t n = s.size();
+            size_t i = 0;
+            while (i < n) {
+                if (p[i] < 0x80) {
+                    i += k->ascii_prefix(s.data() + i, n - i);
+                    continue;
+                }
+                char32_t cp;
+                size_t len = detail::sequence(p + i, n - i, cp);
+                if (!len) {
+                    if (error) {
+                        *error = i;
+                    }
+                    return false;
+                }
+                i += len;
+            }
+            return true;
+        }
+
+        //! UTF-8 to UTF-16 into out (its capacity is reused); false for invalid input
+        inline bool utf8_to_utf16(std::string_view s, std::u16string& out) {
+            const Kernels* k = detail::current().load(std::memory_order_relaxed);
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(s.data());
+            size_t n = s.size();
+            // never more UTF-16 units than UTF-8 bytes
+            out.resize(n);
+            char16_t* o = &out[0];
+            size_t i = 0;
+            size_t j = 0;
+            while (i < n) {
+                if (p[i] < 0x80) {
+                    size_t m = k->widen_ascii(s.data() + i, n - i, o + j);
+                    i += m;
+                    j += m;
+                    continue;
+                }
+                char32_t cp;
+                size_t len = detail::sequence(p + i, n - i, cp);
+                if (!len) {
+                    out.clear();
+                    return false;
+                }
+                i += len;
+                if (cp >= 0x10000) {
+                    cp -= 0x10000;
+                    o[j++] = static_cast<char16_t>(0xd800 + (cp >> 10));
+                    o[j++] = static_cast<char16_t>(0xdc00 + (cp & 0x3ff));
+                } else {
+                    o[j++] = static_cast<char16_t>(cp);
+                }
+            }
+            out.resize(j);
+            return true;
+        }
+
+        //! UTF-16 to UTF-8 into out (its capacity is reused); false for unpaired surrogates
+        inline bool utf16_to_utf8(std::u16string_view s, std::string& out) {
+            const Kernels* k = detail::current().load(std::memory_order_relaxed);
+            size_t n = s.size();
+            // at most 3 bytes per unit, a surrogate pair (2 units) is 4 bytes
+            out.resize(n * 3);
+            char* o = &out[0];
+            size_t i = 0;
+            size_t j = 0;
+            while (i < n) {
+                char32_t c = s[i];
+                if (c < 0x80) {
+                    size_t m = k->narrow_ascii(s.data() + i, n - i, o + j);
+                    i += m;
+                    j += m;
+                    continue;
+                }
+                if (c >= 0xd800 && c <= 0xdfff) {
+                    if (c >= 0xdc00 || i + 1 == n || s[i + 1] < 0xdc00 || s[i + 1] > 0xdfff) {
+                        out.clear();
+                        return false;
+                    }
+                    c = 0x10000 + ((c - 0xd800) << 10) + (s[i + 1] - 0xdc00);
+                    ++i;
+                }
+                ++i;
+                if (c < 0x800) {
+                    o[j++] = static_cast<char>(0xc0 | c >> 6);
+                } else if (c < 0x10000) {
+                    o[j++] = static_cast<char>(0xe0 | c >> 12);
+                    o[j++] = static_cast<char>(0x80 | (c >> 6 & 0x3f));
+                } else {
+                    o[j++] = static_cast<char>(0xf0 | c >> 18);
+                    o[j++] = static_cast<char>(0x80 | (c >> 12 & 0x3f));
+                    o[j++] = static_cast<char>(0x80 | (c >> 6 & 0x3f));
+                }
+                o[j++] = static_cast<char>(0x80 | (c & 0x3f));
+            }
+            out.resize(j);
+            return true;
+        }
+
+    } // namespace utf
+
+    //! bind text after checking that it is valid UTF-8, invalid text throws SQLITE_MISMATCH
+    inline void bind_utf8(Statement& st, unsigned pos, const std::string& value) {
+        size_t error = 0;
+        if (!utf::valid_utf8(value, &error)) {
+            throw Error(SQLITE_MISMATCH, "parameter ", pos, " is not valid UTF-8 (byte ", error, ")");
+        }
+        st.bind(pos, value);
+    }
+
+    //! bind UTF-16 text converted to UTF-8, unpaired surrogates throw SQLITE_MISMATCH
+    inline void bind_utf16(Statement& st, unsigned pos, std::u16string_view value) {
+        thread_local std::string buffer;
+        if (!utf::utf16_to_utf8(value, buffer)) {
+            throw Error(SQLITE_MISMATCH, "parameter ", pos, " is not valid UTF-16");
+        }
+        st.bind(pos, buffer);
+    }
+
+    //! column text checked to be valid UTF-8, valid until the next step, reset or conversion
+    inline std::string_view text_utf8(Statement::Value v) {
+        std::string_view s = v.as_text_view();
+        if (!utf::valid_utf8(s)) {
+            throw Error(SQLITE_MISMATCH, "column text is not valid UTF-8");
+        }
+        return s;
+    }
+
+    //! column text as UTF-16 into out, which is reused; invalid UTF-8 throws SQLITE_MISMATCH
+    inline void text16(Statement::Value v, std::u16string& out) {
+        if (!utf::utf8_to_utf16(v.as_text_view(), out)) {
+            throw Error(SQLITE_MISMATCH, "column text is not valid UTF-8");
+        }
+    }
+
+} // namespace sqlitexx
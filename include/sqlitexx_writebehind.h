@@ -0,0 +1,333 @@
+#pragma once
+
+#include "sqlitexx.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <tuple>
+
+/**
+ * Write-behind log for fire-and-forget inserts.
+ *
+ * WriteBehind<Args...> queues records in a bounded lock-free ring (Vyukov's MPMC queue) and
+ * returns; a background thread drains the ring into batched transactions through one prepared
+ * INSERT. Durability is relaxed on purpose: a record is in the database only after its batch is
+ * committed. flush() is a barrier for everything appended before it, close() drains the ring or
+ * gives up and counts what was lost. Stats account for every appended record.
+ *
+ * append() takes no lock unless the ring is full, then it sleeps until the writer has taken
+ * records out. The writer sleeps on a condition variable until its batch is due or flush(),
+ * close() or a full ring wake it, and wakes the flushing threads after each commit.
+ *
+ * The connection belongs to the writer thread while the log is open; use another connection to
+ * the same database for queries.
+ */
+
+namespace sqlitexx {
+
+    //! bounded multi-producer multi-consumer queue, capacity is a power of 2
+    template <typename T>
+    class MPMCRing {
+        struct Cell {
+            std::atomic<size_t> seq;
+            T data;
+        };
+
+        std::unique_ptr<Cell[]> cells_;
+        size_t mask_;
+        alignas(64) std::atomic<size_t> head_{0};
+        alignas(64) std::atomic<size_t> tail_{0};
+
+    public:
+        explicit MPMCRing(size_t capacity) {
+            size_t n = 2;
+            while (n < capacity) {
+                n <<= 1;
+            }
+            cells_.reset(new Cell[n]);
+            mask_ = n - 1;
+            for (size_t i = 0; i < n; ++i) {
+                cells_[i].seq.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        size_t capacity() const {
+            return mask_ + 1;
+        }
+
+        //! false if the ring is full; ticket is the position of the element in the queue
+        bool try_push(T&& x, size_t& ticket) {
+            size_t pos = tail_.load(std::memory_order_relaxed);
+            for (;;) {
+                Cell& c = cells_[pos & mask_];
+                size_t seq = c.seq.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+                if (diff == 0) {
+                    if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        c.data = std::move(x);
+                        c.seq.store(pos + 1, std::memory_order_release);
+                        ticket = pos;
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = tail_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool try_pop(T& x) {
+            size_t pos = head_.load(std::memory_order_relaxed);
+            for (;;) {
+                Cell& c = cells_[pos & mask_];
+                size_t seq = c.seq.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+                if (diff == 0) {
+                    if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        x = std::move(c.data);
+                        c.seq.store(pos + mask_ + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = head_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        //! elements pushed so far (approximate while producers run)
+        size_t pushed() const {
+            return tail_.load(std::memory_order_acquire);
+        }
+
+        //! elements in the queue (approximate while producers and consumers run)
+        size_t size() const {
+            size_t head = head_.load(std::memory_order_acquire);
+            size_t tail = tail_.load(std::memory_order_acquire);
+            return tail > head ? tail - head : 0;
+        }
+    };
+
+    struct WriteBehindOptions {
+        size_t capacity = 65536;                            //!< records in the ring
+        size_t batch_size = 4096;                           //!< records per transaction
+        std::chrono::microseconds max_delay{10000};         //!< time a record may wait for its batch
+        bool drop_when_full = false;                        //!< drop (and count) records instead of waiting for space
+    };
+
+    struct WriteBehindStats {
+        uint64_t appended = 0;
+        uint64_t committed = 0;
+        uint64_t dropped = 0;       //!< not queued because the ring was full
+        uint64_t failed = 0;        //!< insert or commit failed
+        uint64_t lost = 0;          //!< still queued when the log was closed without draining
+    };
+
+    template <typename...Args>
+    class WriteBehind {
+        using Record = std::tuple<Args...>;
+
+        DB& db_;
+        Statement insert_;
+        WriteBehindOptions opts_;
+        MPMCRing<Record> ring_;
+        std::atomic<uint64_t> done_{0};         //!< records taken out of the ring and finished
+        std::atomic<uint64_t> committed_{0};
+        std::atomic<uint64_t> dropped_{0};
+        std::atomic<uint64_t> failed_{0};
+        std::atomic<uint64_t> lost_{0};
+        std::atomic<uint64_t> flush_requests_{0};
+        std::atomic<int> state_{0};             // 0 running, 1 draining, 2 stopping
+        bool writing_ = true;                   //!< the writer runs, guarded by mutex_
+        bool full_ = false;                     //!< a producer waits for space, guarded by mutex_
+        size_t waiting_ = 0;                    //!< producers waiting for space, guarded by mutex_
+        std::mutex mutex_;
+        std::condition_variable wake_;          //!< to the writer: flush or close requested
+        std::condition_variable done_cv_;       //!< from the writer: records finished
+        std::condition_variable space_cv_;      //!< from the writer: records taken out of the ring
+        std::thread writer_;
+
+        void taken() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (waiting_) {
+                space_cv_.notify_all();
+            }
+        }
+
+        void finished(uint64_t n) {
+            done_.fetch_add(n, std::memory_order_release);
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_cv_.notify_all();
+        }
+
+        void drain() {
+            drain_ring();
+            std::lock_guard<std::mutex> lock(mutex_);
+            writing_ = false;
+            done_cv_.notify_all();
+        }
+
+        template <size_t...I>
+        void bind(const Record& r, std::index_sequence<I...>) {
+            bool dummy[] = { true, (insert_.bind(I + 1, std::get<I>(r)), true)... };
+            (void)dummy;
+        }
+
+        void drain_ring() {
+            std::vector<Record> batch;
+            batch.reserve(opts_.batch_size);
+            Record r;
+            auto last_commit = std::chrono::steady_clock::now();
+
+            for (;;) {
+                int state = state_.load(std::memory_order_acquire);
+                if (state == 2) {
+                    // whatever is left is lost
+                    uint64_t left = 0;
+                    while (ring_.try_pop(r)) {
+                        ++left;
+                    }
+                    taken();
+                    lost_ += left + batch.size();
+                    finished(left + batch.size());
+                    return;
+                }
+
+                size_t before = batch.size();
+                while (batch.size() < opts_.batch_size && ring_.try_pop(r)) {
+                    batch.push_back(std::move(r));
+                }
+                if (batch.size() != before) {
+                    taken();
+                }
+
+                auto now = std::chrono::steady_clock::now();
+                bool due = batch.size() >= opts_.batch_size || now - last_commit >= opts_.max_delay ||
+                    flush_requests_.load(std::memory_order_acquire) || state == 1;
+                if (batch.empty() || !due) {
+                    if (batch.empty() && state == 1) {
+                        return;
+                    }
+                    // appends don't wake the writer, it looks at the ring again when the batch is due
+                    auto delay = batch.empty() ? opts_.max_delay : opts_.max_delay - (now - last_commit);
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    wake_.wait_for(lock, delay, [&] {
+                        return full_ || flush_requests_.load(std::memory_order_relaxed) || state_.load(std::memory_order_relaxed) != state;
+                    });
+                    full_ = false;
+                    continue;
+                }
+
+                commit(batch);
+                batch.clear();
+                last_commit = now;
+            }
+        }
+
+        void commit(const std::vector<Record>& batch) {
+            uint64_t ok = 0;
+            try {
+                auto t = db_.transaction();
+                for (const auto& rec : batch) {
+                    try {
+                        // exec() resets the insert for the next record, also when it fails
+                        bind(rec, std::index_sequence_for<Args...>{});
+                        insert_.exec();
+                        ++ok;
+                    } catch (const Error&) {
+                    }
+                }
+                t.commit();
+            } catch (const Error&) {
+                ok = 0;
+            }
+            committed_ += ok;
+            failed_ += batch.size() - ok;
+            finished(batch.size());
+        }
+
+    public:
+        //! insert_sql has a parameter for every element of a record
+        WriteBehind(DB& db, const std::string& insert_sql, const WriteBehindOptions& opts = WriteBehindOptions{})
+            : db_(db), insert_(db.prepare(insert_sql)), opts_(opts), ring_(opts.capacity) {
+            writer_ = std::thread([this] { drain(); });
+        }
+
+        WriteBehind(const WriteBehind&) = delete;
+        WriteBehind& operator = (const WriteBehind&) = delete;
+
+        ~WriteBehind() {
+            close();
+        }
+
+        //! queue a record; false if it was dropped because the ring is full or the log is closed
+        bool append(Args...args) {
+            if (state_.load(std::memory_order_relaxed) != 0) {
+                ++dropped_;
+                return false;
+            }
+            Record r(std::move(args)...);
+            size_t ticket;
+            while (!ring_.try_push(std::move(r), ticket)) {
+                if (opts_.drop_when_full || state_.load(std::memory_order_relaxed) != 0) {
+                    ++dropped_;
+                    return false;
+                }
+                std::unique_lock<std::mutex> lock(mutex_);
+                full_ = true;
+                wake_.notify_one();
+                ++waiting_;
+                space_cv_.wait(lock, [&] {
+                    return ring_.size() < ring_.capacity() || state_.load(std::memory_order_relaxed) != 0;
+                });
+                --waiting_;
+            }
+            return true;
+        }
+
+        //! wait until every record appended before the call is committed (or failed)
+        void flush() {
+            uint64_t target = ring_.pushed();
+            std::unique_lock<std::mutex> lock(mutex_);
+            ++flush_requests_;
+            wake_.notify_one();
+            done_cv_.wait(lock, [&] { return done_.load(std::memory_order_acquire) >= target || !writing_; });
+            --flush_requests_;
+        }
+
+        //! stop the writer; with drain queued records are committed first, otherwise they are lost
+        void close(bool drain = true) {
+            if (!writer_.joinable()) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                state_.store(drain ? 1 : 2, std::memory_order_release);
+                wake_.notify_one();
+                space_cv_.notify_all();
+            }
+            writer_.join();
+
+            // appended concurrently with close()
+            Record r;
+            while (ring_.try_pop(r)) {
+                ++lost_;
+            }
+        }
+
+        WriteBehindStats stats() const {
+            WriteBehindStats s;
+            s.committed = committed_.load();
+            s.failed = failed_.load();
+            s.lost = lost_.load();
+            s.dropped = dropped_.load();
+            s.appended = ring_.pushed() + s.dropped;
+            return s;
+        }
+    };
+
+} // namespace sqlitexx
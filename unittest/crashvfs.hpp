@@ -0,0 +1,374 @@
+#pragma once
+
+#include "sqlitexx.h"
+#include <cstring>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// In-memory VFS for crash-consistency tests.
+//
+// Every file keeps its durable content (as of the last xSync) and the list of writes and truncates
+// issued since. After crash_after(n) the n-th mutating operation (write, truncate, sync or delete)
+// is the last one that happens: all later I/O fails as if the machine lost power. recover() then
+// rebuilds the files from the durable state, optionally keeping a random subset of the unsynced
+// operations to model reordering by the disk. Deletes are durable immediately.
+//
+// The VFS has no shared memory support: use WAL only together with PRAGMA locking_mode=EXCLUSIVE.
+
+namespace sqlitexx {
+
+    namespace testing {
+
+        class CrashVFS {
+            struct Pending {
+                bool truncate = false;
+                sqlite3_int64 offset = 0;
+                std::string data;
+            };
+
+            struct FileData {
+                std::string durable;
+                std::string current;
+                std::vector<Pending> pending;
+            };
+
+            struct File {
+                sqlite3_file base;
+                CrashVFS* vfs;
+                std::shared_ptr<FileData> data;
+                std::string path;
+                bool delete_on_close;
+            };
+
+            sqlite3_vfs vfs_;
+            sqlite3_vfs* parent_;
+            std::string name_;
+            std::map<std::string, std::shared_ptr<FileData>> files_;
+            uint64_t ops_ = 0;
+            uint64_t crash_at_ = 0;
+            bool crashed_ = false;
+            unsigned temp_files_ = 0;
+
+            static CrashVFS* self(sqlite3_vfs* vfs) {
+                return static_cast<CrashVFS*>(vfs->pAppData);
+            }
+
+            static File* file(sqlite3_file* f) {
+                return reinterpret_cast<File*>(f);
+            }
+
+            //! account for one mutating operation; false if the power is already off
+            bool mutate() {
+                if (crashed_) {
+                    return false;
+                }
+                ++ops_;
+                if (crash_at_ && ops_ >= crash_at_) {
+                    // this operation is the last one to reach the disk
+                    crashed_ = true;
+                }
+                return true;
+            }
+
+            static void apply(std::string& content, const Pending& op) {
+                if (op.truncate) {
+                    content.resize(op.offset);
+                    return;
+                }
+                size_t end = op.offset + op.data.size();
+                if (content.size() < end) {
+                    content.resize(end, '\0');
+                }
+                std::memcpy(&content[op.offset], op.data.data(), op.data.size());
+            }
+
+            static int x_close(sqlite3_file* f) {
+                File* p = file(f);
+                if (p->delete_on_close) {
+                    p->vfs->files_.erase(p->path);
+                }
+                p->~File();
+                return SQLITE_OK;
+            }
+
+            static int x_read(sqlite3_file* f, void* buf, int amount, sqlite3_int64 offset) {
+                File* p = file(f);
+                if (p->vfs->crashed_) {
+                    return SQLITE_IOERR_READ;
+                }
+
+                const std::string& content = p->data->current;
+                sqlite3_int64 avail = static_cast<sqlite3_int64>(content.size()) - offset;
+                if (avail >= amount) {
+                    std::memcpy(buf, content.data() + offset, amount);
+                    return SQLITE_OK;
+                }
+
+                std::memset(buf, 0, amount);
+                if (avail > 0) {
+                    std::memcpy(buf, content.data() + offset, avail);
+                }
+                return SQLITE_IOERR_SHORT_READ;
+            }
+
+            static int x_write(sqlite3_file* f, const void* buf, int amount, sqlite3_int64 offset) {
+                File* p = file(f);
+                if (!p->vfs->mutate()) {
+                    return SQLITE_IOERR_WRITE;
+                }
+
+                Pending op;
+                op.offset = offset;
+                op.data.assign(static_cast<const char*>(buf), amount);
+                apply(p->data->current, op);
+                p->data->pending.push_back(std::move(op));
+                return SQLITE_OK;
+            }
+
+            static int x_truncate(sqlite3_file* f, sqlite3_int64 size) {
+                File* p = file(f);
+                if (!p->vfs->mutate()) {
+                    return SQLITE_IOERR_TRUNCATE;
+                }
+
+                Pending op;
+                op.truncate = true;
+                op.offset = size;
+                apply(p->data->current, op);
+                p->data->pending.push_back(std::move(op));
+                return SQLITE_OK;
+            }
+
+            static int x_sync(sqlite3_file* f, int) {
+                File* p = file(f);
+                if (!p->vfs->mutate()) {
+                    return SQLITE_IOERR_FSYNC;
+                }
+
+                p->data->durable = p->data->current;
+                p->data->pending.clear();
+                return SQLITE_OK;
+            }
+
+            static int x_file_size(sqlite3_file* f, sqlite3_int64* size) {
+                File* p = file(f);
+                if (p->vfs->crashed_) {
+                    return SQLITE_IOERR_FSTAT;
+                }
+                *size = p->data->current.size();
+                return SQLITE_OK;
+            }
+
+            static int x_lock(sqlite3_file*, int) {
+                return SQLITE_OK;
+            }
+
+            static int x_check_reserved_lock(sqlite3_file*, int* out) {
+                *out = 0;
+                return SQLITE_OK;
+            }
+
+            static int x_file_control(sqlite3_file*, int, void*) {
+                return SQLITE_NOTFOUND;
+            }
+
+            static int x_sector_size(sqlite3_file*) {
+                return 512;
+            }
+
+            static int x_device_characteristics(sqlite3_file*) {
+                // no atomic or sequential write guarantees: sqlite has to be as careful as it can
+                return 0;
+            }
+
+            static const sqlite3_io_methods* io_methods() {
+                static const sqlite3_io_methods methods = {
+                    1,
+                    &x_close,
+                    &x_read,
+                    &x_write,
+                    &x_truncate,
+                    &x_sync,
+                    &x_file_size,
+                    &x_lock,
+                    &x_lock,
+                    &x_check_reserved_lock,
+                    &x_file_control,
+                    &x_sector_size,
+                    &x_device_characteristics,
+                    nullptr, nullptr, nullptr, nullptr, nullptr, nullptr
+                };
+                return &methods;
+            }
+
+            static int x_open(sqlite3_vfs* vfs, const char* name, sqlite3_file* f, int flags, int* out_flags) {
+                CrashVFS* v = self(vfs);
+                f->pMethods = nullptr;
+                if (v->crashed_) {
+                    return SQLITE_CANTOPEN;
+                }
+
+                std::string path = name ? name : "crashvfs-temp-" + std::to_string(++v->temp_files_);
+                auto it = v->files_.find(path);
+                if (it == v->files_.end()) {
+                    if (!(flags & SQLITE_OPEN_CREATE)) {
+                        return SQLITE_CANTOPEN;
+                    }
+                    it = v->files_.emplace(path, std::make_shared<FileData>()).first;
+                }
+
+                File* p = new (f) File;
+                p->vfs = v;
+                p->data = it->second;
+                p->path = path;
+                p->delete_on_close = (flags & SQLITE_OPEN_DELETEONCLOSE) != 0;
+                p->base.pMethods = io_methods();
+                if (out_flags) {
+                    *out_flags = flags;
+                }
+                return SQLITE_OK;
+            }
+
+            static int x_delete(sqlite3_vfs* vfs, const char* name, int) {
+                CrashVFS* v = self(vfs);
+                if (!v->mutate()) {
+                    return SQLITE_IOERR_DELETE;
+                }
+                v->files_.erase(name);
+                return SQLITE_OK;
+            }
+
+            static int x_access(sqlite3_vfs* vfs, const char* name, int, int* out) {
+                CrashVFS* v = self(vfs);
+                auto it = v->files_.find(name);
+                // like the unix VFS: an empty file does not exist (matters for hot journals)
+                *out = it != v->files_.end() && !it->second->current.empty();
+                return SQLITE_OK;
+            }
+
+            static int x_full_pathname(sqlite3_vfs*, const char* name, int size, char* out) {
+                sqlite3_snprintf(size, out, "%s", name);
+                return SQLITE_OK;
+            }
+
+            static void* x_dl_open(sqlite3_vfs* vfs, const char* name) {
+                return self(vfs)->parent_->xDlOpen(self(vfs)->parent_, name);
+            }
+
+            static void x_dl_error(sqlite3_vfs* vfs, int size, char* out) {
+                self(vfs)->parent_->xDlError(self(vfs)->parent_, size, out);
+            }
+
+            static void (*x_dl_sym(sqlite3_vfs* vfs, void* handle, const char* name))(void) {
+                return self(vfs)->parent_->xDlSym(self(vfs)->parent_, handle, name);
+            }
+
+            static void x_dl_close(sqlite3_vfs* vfs, void* handle) {
+                self(vfs)->parent_->xDlClose(self(vfs)->parent_, handle);
+            }
+
+            static int x_randomness(sqlite3_vfs* vfs, int size, char* out) {
+                return self(vfs)->parent_->xRandomness(self(vfs)->parent_, size, out);
+            }
+
+            static int x_sleep(sqlite3_vfs* vfs, int us) {
+                return self(vfs)->parent_->xSleep(self(vfs)->parent_, us);
+            }
+
+            static int x_current_time(sqlite3_vfs* vfs, double* out) {
+                return self(vfs)->parent_->xCurrentTime(self(vfs)->parent_, out);
+            }
+
+            static int x_get_last_error(sqlite3_vfs*, int, char*) {
+                return 0;
+            }
+
+        public:
+            explicit CrashVFS(const std::string& name) : parent_(sqlite3_vfs_find(nullptr)), name_(name) {
+                std::memset(&vfs_, 0, sizeof(vfs_));
+                vfs_.iVersion = 1;
+                vfs_.szOsFile = sizeof(File);
+                vfs_.mxPathname = 512;
+                vfs_.zName = name_.c_str();
+                vfs_.pAppData = this;
+                vfs_.xOpen = &x_open;
+                vfs_.xDelete = &x_delete;
+                vfs_.xAccess = &x_access;
+                vfs_.xFullPathname = &x_full_pathname;
+                vfs_.xDlOpen = &x_dl_open;
+                vfs_.xDlError = &x_dl_error;
+                vfs_.xDlSym = &x_dl_sym;
+                vfs_.xDlClose = &x_dl_close;
+                vfs_.xRandomness = &x_randomness;
+                vfs_.xSleep = &x_sleep;
+                vfs_.xCurrentTime = &x_current_time;
+                vfs_.xGetLastError = &x_get_last_error;
+
+                int res;
+                if ((res = sqlite3_vfs_register(&vfs_, 0)) != SQLITE_OK) {
+                    throw Error(res, "can't register VFS ", name_);
+                }
+            }
+
+            CrashVFS(const CrashVFS&) = delete;
+            CrashVFS& operator = (const CrashVFS&) = delete;
+
+            ~CrashVFS() {
+                sqlite3_vfs_unregister(&vfs_);
+            }
+
+            const char* name() const {
+                return name_.c_str();
+            }
+
+            //! remove all files and disarm the crash
+            void reset() {
+                files_.clear();
+                ops_ = 0;
+                crash_at_ = 0;
+                crashed_ = false;
+            }
+
+            //! lose power right after the n-th mutating operation (0 disables the crash)
+            void crash_after(uint64_t n) {
+                ops_ = 0;
+                crash_at_ = n;
+                crashed_ = false;
+            }
+
+            //! mutating operations since reset()/crash_after()
+            uint64_t operations() const {
+                return ops_;
+            }
+
+            bool crashed() const {
+                return crashed_;
+            }
+
+            //! Reboot after a crash. Without rng every unsynced operation is lost, otherwise each one
+            //! survives independently with probability 1/2. All files must be closed.
+            void recover(std::mt19937_64* rng = nullptr) {
+                for (auto& f : files_) {
+                    FileData& d = *f.second;
+                    std::string content = d.durable;
+                    if (rng) {
+                        for (const auto& op : d.pending) {
+                            if ((*rng)() & 1) {
+                                apply(content, op);
+                            }
+                        }
+                    }
+                    d.durable = d.current = content;
+                    d.pending.clear();
+                }
+                crash_at_ = 0;
+                crashed_ = false;
+            }
+        };
+
+    } // namespace testing
+
+} // namespace sqlitexx
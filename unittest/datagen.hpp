@@ -0,0 +1,590 @@
+#pragma once
+
+#include "sqlitexx.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+// Deterministic benchmark data: seeded xoshiro256** streams, columnar batches with uniform,
+// sequential or Zipf-distributed keys, variable-length text and blobs and NULL ratios, a bulk
+// loader and a cache of prebuilt database images.
+//
+// Values are generated in fixed blocks of rows and every (seed, column, block) has its own random
+// stream, so any range of rows is the same no matter how it was split into batches or in which
+// order the batches were generated.
+
+namespace sqlitexx {
+
+    namespace testing {
+
+        inline uint64_t splitmix64(uint64_t& x) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            return z ^ (z >> 31);
+        }
+
+        //! high 64 bits of a * b
+        inline uint64_t mulhi64(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+            __extension__ typedef unsigned __int128 u128;
+            return static_cast<uint64_t>((static_cast<u128>(a) * b) >> 64);
+#else
+            uint64_t al = a & 0xffffffffu, ah = a >> 32;
+            uint64_t bl = b & 0xffffffffu, bh = b >> 32;
+            uint64_t ll = al * bl;
+            uint64_t mid = (ll >> 32) + (al * bh & 0xffffffffu) + (ah * bl & 0xffffffffu);
+            return ah * bh + (al * bh >> 32) + (ah * bl >> 32) + (mid >> 32);
+#endif
+        }
+
+        //! Four independent xoshiro256** generators in structure-of-arrays layout. fill() advances all
+        //! lanes in lockstep, which compilers turn into SIMD code.
+        class Xoshiro256x4 {
+            enum { lanes = 4 };
+            uint64_t s_[4][lanes];
+            uint64_t buf_[lanes];
+            unsigned pos_ = lanes;
+
+            static uint64_t rotl(uint64_t x, int k) {
+                return (x << k) | (x >> (64 - k));
+            }
+
+            void step(uint64_t* out) {
+                for (int l = 0; l < lanes; ++l) {
+                    out[l] = rotl(s_[1][l] * 5, 7) * 9;
+                    uint64_t t = s_[1][l] << 17;
+                    s_[2][l] ^= s_[0][l];
+                    s_[3][l] ^= s_[1][l];
+                    s_[1][l] ^= s_[2][l];
+                    s_[0][l] ^= s_[3][l];
+                    s_[2][l] ^= t;
+                    s_[3][l] = rotl(s_[3][l], 45);
+                }
+            }
+
+        public:
+            explicit Xoshiro256x4(uint64_t seed) {
+                for (int l = 0; l < lanes; ++l) {
+                    for (int i = 0; i < 4; ++i) {
+                        s_[i][l] = splitmix64(seed);
+                    }
+                }
+            }
+
+            uint64_t operator () () {
+                if (pos_ == lanes) {
+                    step(buf_);
+                    pos_ = 0;
+                }
+                return buf_[pos_++];
+            }
+
+            void fill(uint64_t* out, size_t n) {
+                while (pos_ < lanes && n) {
+                    *out++ = buf_[pos_++];
+                    --n;
+                }
+                for (; n >= lanes; n -= lanes, out += lanes) {
+                    step(out);
+                }
+                for (; n; --n) {
+                    *out++ = (*this)();
+                }
+            }
+
+            //! uniform double in [0, 1)
+            double uniform() {
+                return ((*this)() >> 11) * (1.0 / 9007199254740992.0);
+            }
+
+            //! uniform integer in [0, n) (Lemire's multiply-shift, bias is below 2^-64 * n)
+            uint64_t below(uint64_t n) {
+                return mulhi64((*this)(), n);
+            }
+        };
+
+        //! Zipf distribution over 1..n with exponent s, rejection-inversion sampling (Hormann & Derflinger),
+        //! O(1) memory for any n.
+        class Zipf {
+            double exponent_;
+            double n_;
+            double h_x1_;
+            double h_n_;
+            double s_;
+
+            static double helper1(double x) {
+                return std::fabs(x) > 1e-8 ? std::log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+            }
+
+            static double helper2(double x) {
+                return std::fabs(x) > 1e-8 ? std::expm1(x) / x : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+            }
+
+            double h(double x) const {
+                return std::exp(-exponent_ * std::log(x));
+            }
+
+            double h_integral(double x) const {
+                double log_x = std::log(x);
+                return helper2((1 - exponent_) * log_x) * log_x;
+            }
+
+            double h_integral_inverse(double x) const {
+                double t = x * (1 - exponent_);
+                if (t < -1) {
+                    t = -1;
+                }
+                return std::exp(helper1(t) * x);
+            }
+
+        public:
+            Zipf(uint64_t n, double exponent) : exponent_(exponent), n_(static_cast<double>(n)) {
+                h_x1_ = h_integral(1.5) - 1;
+                h_n_ = h_integral(n_ + 0.5);
+                s_ = 2 - h_integral_inverse(h_integral(2.5) - h(2));
+            }
+
+            uint64_t operator () (Xoshiro256x4& rng) const {
+                for (;;) {
+                    double u = h_n_ + rng.uniform() * (h_x1_ - h_n_);
+                    double x = h_integral_inverse(u);
+                    double k = std::floor(x + 0.5);
+                    if (k < 1) {
+                        k = 1;
+                    } else if (k > n_) {
+                        k = n_;
+                    }
+                    if (k - x <= s_ || u >= h_integral(k + 0.5) - h(k)) {
+                        return static_cast<uint64_t>(k);
+                    }
+                }
+            }
+        };
+
+        struct ColumnSpec {
+            enum Type { INTEGER, REAL, TEXT, BLOB };
+            enum Distribution { SEQUENCE, UNIFORM, ZIPF };
+
+            std::string name;
+            Type type = INTEGER;
+            Distribution distribution = UNIFORM;
+            int64_t min = 0;                //!< integer range or minimal text/blob length
+            int64_t max = 1000000;          //!< integer range or maximal text/blob length
+            double zipf_exponent = 1.0;
+            double null_ratio = 0.0;
+
+            static ColumnSpec sequence(std::string name) {
+                ColumnSpec c;
+                c.name = std::move(name);
+                c.distribution = SEQUENCE;
+                c.min = 1;
+                return c;
+            }
+
+            static ColumnSpec uniform(std::string name, int64_t min, int64_t max) {
+                ColumnSpec c;
+                c.name = std::move(name);
+                c.min = min;
+                c.max = max;
+                return c;
+            }
+
+            //! keys 1..n, key 1 is the most frequent
+            static ColumnSpec zipf(std::string name, int64_t n, double exponent = 1.0) {
+                ColumnSpec c;
+                c.name = std::move(name);
+                c.distribution = ZIPF;
+                c.min = 1;
+                c.max = n;
+                c.zipf_exponent = exponent;
+                return c;
+            }
+
+            static ColumnSpec real(std::string name) {
+                ColumnSpec c;
+                c.name = std::move(name);
+                c.type = REAL;
+                return c;
+            }
+
+            static ColumnSpec text(std::string name, int64_t min_len, int64_t max_len) {
+                ColumnSpec c;
+                c.name = std::move(name);
+                c.type = TEXT;
+                c.min = min_len;
+                c.max = max_len;
+                return c;
+            }
+
+            static ColumnSpec blob(std::string name, int64_t min_len, int64_t max_len) {
+                ColumnSpec c = text(std::move(name), min_len, max_len);
+                c.type = BLOB;
+                return c;
+            }
+
+            ColumnSpec& nulls(double ratio) {
+                null_ratio = ratio;
+                return *this;
+            }
+
+            const char* sql_type() const {
+                static const char* names[] = { "INTEGER", "REAL", "TEXT", "BLOB" };
+                return names[type];
+            }
+        };
+
+        //! One column of a batch. Text and blob values are stored back to back in data.
+        struct ColumnBatch {
+            ColumnSpec::Type type = ColumnSpec::INTEGER;
+            std::vector<int64_t> ints;
+            std::vector<double> reals;
+            std::string data;
+            std::vector<size_t> offsets;    //!< rows + 1 offsets into data
+            std::vector<uint8_t> nulls;     //!< empty if the column has no NULLs
+
+            bool is_null(size_t row) const {
+                return !nulls.empty() && nulls[row];
+            }
+
+            const char* bytes(size_t row, size_t& len) const {
+                len = offsets[row + 1] - offsets[row];
+                return data.data() + offsets[row];
+            }
+        };
+
+        struct Batch {
+            size_t first_row = 0;
+            size_t rows = 0;
+            std::vector<ColumnBatch> columns;
+        };
+
+        class Dataset {
+            std::vector<ColumnSpec> columns_;
+            uint64_t seed_;
+
+            enum { block_rows = 4096 };
+
+            //! all rows of one block, every (seed, column, block) has its own stream
+            void generate_block(const ColumnSpec& spec, size_t column, size_t block, ColumnBatch& out) const {
+                uint64_t stream = seed_ ^ (0x51afd7ed558ccd1dull * (column + 1));
+                splitmix64(stream);
+                Xoshiro256x4 rng(splitmix64(stream) ^ (block * 0xd6e8feb86659fd93ull));
+                const size_t rows = block_rows;
+                const size_t first_row = block * block_rows;
+
+                out.type = spec.type;
+                switch (spec.type) {
+                case ColumnSpec::INTEGER:
+                    out.ints.resize(rows);
+                    if (spec.distribution == ColumnSpec::SEQUENCE) {
+                        for (size_t i = 0; i < rows; ++i) {
+                            out.ints[i] = spec.min + static_cast<int64_t>(first_row + i);
+                        }
+                    } else if (spec.distribution == ColumnSpec::ZIPF) {
+                        Zipf zipf(spec.max, spec.zipf_exponent);
+                        for (size_t i = 0; i < rows; ++i) {
+                            out.ints[i] = static_cast<int64_t>(zipf(rng));
+                        }
+                    } else {
+                        uint64_t range = static_cast<uint64_t>(spec.max - spec.min) + 1;
+                        rng.fill(reinterpret_cast<uint64_t*>(out.ints.data()), rows);
+                        for (auto& x : out.ints) {
+                            x = spec.min + static_cast<int64_t>(mulhi64(static_cast<uint64_t>(x), range));
+                        }
+                    }
+                    break;
+                case ColumnSpec::REAL:
+                    out.reals.resize(rows);
+                    for (auto& x : out.reals) {
+                        x = rng.uniform();
+                    }
+                    break;
+                case ColumnSpec::TEXT:
+                case ColumnSpec::BLOB: {
+                    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ";
+                    uint64_t span = static_cast<uint64_t>(spec.max - spec.min) + 1;
+                    out.offsets.resize(rows + 1);
+                    out.offsets[0] = 0;
+                    for (size_t i = 0; i < rows; ++i) {
+                        out.offsets[i + 1] = out.offsets[i] + spec.min + rng.below(span);
+                    }
+                    out.data.resize(out.offsets[rows]);
+                    std::vector<uint64_t> words((out.data.size() + 7) / 8);
+                    rng.fill(words.data(), words.size());
+                    const unsigned char* src = reinterpret_cast<const unsigned char*>(words.data());
+                    if (spec.type == ColumnSpec::TEXT) {
+                        for (size_t i = 0; i < out.data.size(); ++i) {
+                            out.data[i] = alphabet[src[i] % (sizeof(alphabet) - 1)];
+                        }
+                    } else if (!out.data.empty()) {
+                        std::memcpy(&out.data[0], src, out.data.size());
+                    }
+                    break;
+                }
+                }
+
+                if (spec.null_ratio > 0) {
+                    out.nulls.resize(rows);
+                    uint64_t threshold = static_cast<uint64_t>(spec.null_ratio * 18446744073709551616.0);
+                    for (auto& n : out.nulls) {
+                        n = spec.null_ratio >= 1 || rng() < threshold;
+                    }
+                }
+            }
+
+            //! append rows [from, to) of a generated block
+            static void append(ColumnBatch& out, const ColumnBatch& block, size_t from, size_t to) {
+                switch (block.type) {
+                case ColumnSpec::INTEGER:
+                    out.ints.insert(out.ints.end(), block.ints.begin() + from, block.ints.begin() + to);
+                    break;
+                case ColumnSpec::REAL:
+                    out.reals.insert(out.reals.end(), block.reals.begin() + from, block.reals.begin() + to);
+                    break;
+                case ColumnSpec::TEXT:
+                case ColumnSpec::BLOB:
+                    if (out.offsets.empty()) {
+                        out.offsets.push_back(0);
+                    }
+                    for (size_t i = from; i < to; ++i) {
+                        out.offsets.push_back(out.offsets.back() + block.offsets[i + 1] - block.offsets[i]);
+                    }
+                    out.data.append(block.data, block.offsets[from], block.offsets[to] - block.offsets[from]);
+                    break;
+                }
+                if (!block.nulls.empty()) {
+                    out.nulls.insert(out.nulls.end(), block.nulls.begin() + from, block.nulls.begin() + to);
+                }
+            }
+
+        public:
+            Dataset(std::vector<ColumnSpec> columns, uint64_t seed) : columns_(std::move(columns)), seed_(seed) {
+            }
+
+            const std::vector<ColumnSpec>& columns() const {
+                return columns_;
+            }
+
+            uint64_t seed() const {
+                return seed_;
+            }
+
+            //! Rows [first_row, first_row + rows). Values are generated in fixed blocks, so a row is the
+            //! same whatever batch it was requested in.
+            Batch batch(size_t first_row, size_t rows) const {
+                Batch b;
+                b.first_row = first_row;
+                b.rows = rows;
+                b.columns.resize(columns_.size());
+                ColumnBatch block;
+                for (size_t c = 0; c < columns_.size(); ++c) {
+                    b.columns[c].type = columns_[c].type;
+                    for (size_t row = first_row; row < first_row + rows; ) {
+                        size_t start = row % block_rows;
+                        size_t end = std::min<size_t>(block_rows, start + (first_row + rows - row));
+                        generate_block(columns_[c], c, row / block_rows, block);
+                        append(b.columns[c], block, start, end);
+                        row += end - start;
+                    }
+                    if (!rows && (columns_[c].type == ColumnSpec::TEXT || columns_[c].type == ColumnSpec::BLOB)) {
+                        b.columns[c].offsets.push_back(0);
+                    }
+                }
+                return b;
+            }
+
+            //! FNV-1a of everything that affects the generated data
+            uint64_t fingerprint() const {
+                // doubles in full precision, to_string() keeps 6 decimals only
+                auto real = [](double x) {
+                    char buf[32];
+                    std::snprintf(buf, sizeof(buf), "%.17g", x);
+                    return std::string(buf);
+                };
+                std::string desc = "datagen-v1:" + std::to_string(seed_);
+                for (const auto& c : columns_) {
+                    desc += ":" + c.name + "/" + std::to_string(c.type) + "/" + std::to_string(c.distribution) + "/"
+                        + std::to_string(c.min) + "/" + std::to_string(c.max) + "/" + real(c.zipf_exponent)
+                        + "/" + real(c.null_ratio);
+                }
+                uint64_t h = 0xcbf29ce484222325ull;
+                for (unsigned char ch : desc) {
+                    h = (h ^ ch) * 0x100000001b3ull;
+                }
+                return h;
+            }
+        };
+
+        //! Create table and fill it with rows of the dataset in one transaction. Rows are inserted by a
+        //! multi-row INSERT prepared once and rebound in place (bind_static) for every chunk.
+        inline void load(DB& db, const std::string& table, const Dataset& ds, size_t rows, size_t batch_rows = 65536) {
+            const auto& cols = ds.columns();
+            std::string sql = "CREATE TABLE " + table + " (";
+            for (size_t c = 0; c < cols.size(); ++c) {
+                sql += (c ? ", " : "") + cols[c].name + " " + cols[c].sql_type();
+            }
+            db.prepare(sql + ");").exec();
+
+            const size_t chunk = std::max<size_t>(1, std::min<size_t>(256, 32766 / cols.size()));
+            auto make_insert = [&](size_t n) {
+                std::string row = "(?";
+                for (size_t c = 1; c < cols.size(); ++c) {
+                    row += ",?";
+                }
+                row += ")";
+                std::string q = "INSERT INTO " + table + " VALUES " + row;
+                for (size_t i = 1; i < n; ++i) {
+                    q += "," + row;
+                }
+                return db.prepare(q + ";");
+            };
+
+            auto t = db.transaction();
+            Statement full = make_insert(chunk);
+            for (size_t first = 0; first < rows; first += batch_rows) {
+                Batch b = ds.batch(first, std::min(batch_rows, rows - first));
+
+                for (size_t start = 0; start < b.rows; start += chunk) {
+                    size_t n = std::min(chunk, b.rows - start);
+                    Statement tail = n == chunk ? Statement(nullptr) : make_insert(n);
+                    Statement& st = n == chunk ? full : tail;
+
+                    unsigned pos = 1;
+                    for (size_t r = start; r < start + n; ++r) {
+                        for (const auto& col : b.columns) {
+                            if (col.is_null(r)) {
+                                st.bind(pos, nullptr);
+                            } else if (col.type == ColumnSpec::INTEGER) {
+                                st.bind(pos, col.ints[r]);
+                            } else if (col.type == ColumnSpec::REAL) {
+                                st.bind(pos, col.reals[r]);
+                            } else {
+                                size_t len;
+                                const char* data = col.bytes(r, len);
+                                if (col.type == ColumnSpec::TEXT) {
+                                    st.bind_static(pos, std::string_view(data, len));
+                                } else {
+                                    st.bind_blob_static(pos, std::string_view(data, len));
+                                }
+                            }
+                            ++pos;
+                        }
+                    }
+                    st.exec();
+                }
+            }
+            t.commit();
+        }
+
+        struct TableSpec {
+            std::string name;
+            Dataset dataset;
+            size_t rows;
+        };
+
+        //! Remove the least recently used database images from cache_dir until they take at most
+        //! max_bytes (all of them for 0), keep is never removed. Returns the number of removed images.
+        inline size_t trim_cache(const std::string& cache_dir, uint64_t max_bytes, const std::string& keep = "") {
+            struct Image {
+                std::string path;
+                time_t used;
+                uint64_t size;
+            };
+            std::vector<Image> images;
+            uint64_t total = 0;
+            if (DIR* dir = opendir(cache_dir.c_str())) {
+                while (dirent* e = readdir(dir)) {
+                    std::string name = e->d_name;
+                    struct stat st;
+                    std::string path = cache_dir + "/" + name;
+                    if (name.compare(0, 8, "datagen-") != 0 || name.size() < 11 || name.compare(name.size() - 3, 3, ".db") != 0 ||
+                        path == keep || stat(path.c_str(), &st) != 0) {
+                        continue;
+                    }
+                    images.push_back(Image{path, st.st_mtime, static_cast<uint64_t>(st.st_size)});
+                    total += st.st_size;
+                }
+                closedir(dir);
+            }
+
+            std::sort(images.begin(), images.end(), [](const Image& a, const Image& b) { return a.used < b.used; });
+            size_t removed = 0;
+            for (const auto& im : images) {
+                if (total <= max_bytes && max_bytes) {
+                    break;
+                }
+                if (std::remove(im.path.c_str()) == 0) {
+                    total -= im.size;
+                    ++removed;
+                }
+            }
+            return removed;
+        }
+
+        //! Replace content of db with the tables. The image is built once and cached in cache_dir as
+        //! a database file named after the fingerprint of the tables, later calls only copy its pages.
+        //! Other images are evicted, least recently used first, so that the cache stays within
+        //! max_cache_bytes besides this one. Returns path of the image.
+        inline std::string load_cached(DB& db, const std::vector<TableSpec>& tables, const std::string& cache_dir,
+            uint64_t max_cache_bytes = uint64_t(1) << 30) {
+            uint64_t h = 0xcbf29ce484222325ull;
+            for (const auto& t : tables) {
+                h = (h ^ t.dataset.fingerprint()) * 0x100000001b3ull;
+                h = (h ^ t.rows) * 0x100000001b3ull;
+                for (unsigned char ch : t.name) {
+                    h = (h ^ ch) * 0x100000001b3ull;
+                }
+            }
+            char name[32];
+            std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(h));
+            std::string path = cache_dir + "/datagen-" + name + ".db";
+
+            if (access(path.c_str(), R_OK) != 0) {
+                // build under a private name and publish atomically, parallel runs may race here
+                std::string tmp = path + ".tmp-" + std::to_string(getpid());
+                {
+                    DB image{tmp};
+                    image.prepare("PRAGMA journal_mode=OFF;").exec();
+                    image.prepare("PRAGMA synchronous=OFF;").exec();
+                    for (const auto& t : tables) {
+                        load(image, t.name, t.dataset, t.rows);
+                    }
+                }
+                if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+                    std::remove(tmp.c_str());
+                    throw Error(SQLITE_CANTOPEN, "can't store database image ", path);
+                }
+            } else {
+                // the modification time is the last use for trim_cache()
+                utime(path.c_str(), nullptr);
+            }
+            struct stat st;
+            uint64_t own = stat(path.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+            trim_cache(cache_dir, max_cache_bytes > own ? max_cache_bytes - own : 1, path);
+
+            DB image{path, SQLITE_OPEN_READONLY};
+            sqlite3_backup* backup = sqlite3_backup_init(db.get(), "main", image.get(), "main");
+            if (!backup) {
+                throw Error(sqlite3_errcode(db.get()), "can't copy database image ", path);
+            }
+            sqlite3_backup_step(backup, -1);
+            int res = sqlite3_backup_finish(backup);
+            if (res != SQLITE_OK) {
+                throw Error(res, "can't copy database image ", path);
+            }
+            return path;
+        }
+
+    } // namespace testing
+
+} // namespace sqlitexx
@@ -0,0 +1,327 @@
+#pragma once
+
+#include "unittest.hpp"
+#include <limits>
+#include <tuple>
+#include <type_traits>
+
+// Property-based testing for atto: generators with shrinking and seeded runs.
+//
+// A generator is a copyable object with
+//     using value_type = ...;
+//     value_type operator () (random_engine& rng, unsigned size) const;
+//     std::vector<value_type> shrink(const value_type& x) const;  // simpler candidates, simplest first
+//
+// FOR_ALL(prop, gen1, gen2, ...) calls prop(x1, x2, ...) with generated values. The property fails if it
+// returns false or throws; the arguments are then shrunk and reported together with the seed.
+// Runs are seeded from the runner (--seed S) so a failure is reproduced by rerunning with that seed.
+
+namespace atto {
+
+    namespace unittest {
+
+        using random_engine = std::mt19937_64;
+
+        struct property_config {
+            unsigned runs = 100;
+            unsigned max_size = 100;
+            unsigned max_shrinks = 1000;
+        };
+
+        template <typename T>
+        inline void describe(std::ostream& out, const T& x);
+
+        template <typename T>
+        inline void describe_one(std::ostream& out, const T& x, std::true_type) {
+            out << x;
+        }
+
+        template <typename T>
+        inline void describe_one(std::ostream& out, const T&, std::false_type) {
+            out << "<?>";
+        }
+
+        inline void describe_one(std::ostream& out, const std::string& x, std::true_type) {
+            out << '"' << x << '"';
+        }
+
+        template <typename T>
+        inline void describe_one(std::ostream& out, const std::vector<T>& x, std::false_type) {
+            out << '[';
+            for (size_t i = 0; i < x.size(); ++i) {
+                if (i) {
+                    out << ", ";
+                }
+                describe(out, x[i]);
+            }
+            out << ']';
+        }
+
+        template <typename T>
+        inline void describe(std::ostream& out, const T& x) {
+            describe_one(out, x, typename can_print<const T&>::type{});
+        }
+
+        //! integers in [lo, hi], small sizes produce values close to zero
+        template <typename T>
+        struct integers {
+            using value_type = T;
+            T lo;
+            T hi;
+
+            integers(T l = std::numeric_limits<T>::min(), T h = std::numeric_limits<T>::max()) : lo(l), hi(h) {
+            }
+
+            T target() const {
+                return lo > 0 ? lo : (hi < 0 ? hi : 0);
+            }
+
+            T operator () (random_engine& rng, unsigned size) const {
+                T a = lo;
+                T b = hi;
+                // occasionally use the full range to hit the boundaries
+                if (rng() % 8) {
+                    // distances are computed unsigned, t - lo does not fit into T for the full range
+                    using U = typename std::make_unsigned<T>::type;
+                    U s = static_cast<U>(std::min<uint64_t>(size, static_cast<uint64_t>(std::numeric_limits<T>::max())));
+                    T t = target();
+                    a = (static_cast<U>(t) - static_cast<U>(lo) > s) ? static_cast<T>(t - static_cast<T>(s)) : lo;
+                    b = (static_cast<U>(hi) - static_cast<U>(t) > s) ? static_cast<T>(t + static_cast<T>(s)) : hi;
+                }
+                return std::uniform_int_distribution<T>(a, b)(rng);
+            }
+
+            std::vector<T> shrink(const T& x) const {
+                std::vector<T> res;
+                T t = target();
+                if (x == t) {
+                    return res;
+                }
+                res.push_back(t);
+                // halve the distance to the target, then step by one
+                T half = static_cast<T>(x - (x - t) / 2);
+                if (half != x && half != t) {
+                    res.push_back(half);
+                }
+                T step = static_cast<T>(x > t ? x - 1 : x + 1);
+                if (step != t && step != half) {
+                    res.push_back(step);
+                }
+                return res;
+            }
+        };
+
+        struct booleans {
+            using value_type = bool;
+
+            bool operator () (random_engine& rng, unsigned) const {
+                return rng() & 1;
+            }
+
+            std::vector<bool> shrink(bool x) const {
+                return x ? std::vector<bool>{false} : std::vector<bool>{};
+            }
+        };
+
+        //! one of the given values, shrinks towards the first one
+        template <typename T>
+        struct elements {
+            using value_type = T;
+            std::vector<T> values;
+
+            elements(std::initializer_list<T> v) : values(v) {
+            }
+
+            T operator () (random_engine& rng, unsigned) const {
+                return values[rng() % values.size()];
+            }
+
+            std::vector<T> shrink(const T& x) const {
+                std::vector<T> res;
+                for (const auto& v : values) {
+                    if (v == x) {
+                        break;
+                    }
+                    res.push_back(v);
+                }
+                return res;
+            }
+        };
+
+        //! vectors of up to max_len elements of another generator
+        template <typename G>
+        struct vectors {
+            using value_type = std::vector<typename G::value_type>;
+            G gen;
+            unsigned max_len;
+
+            vectors(G g, unsigned len = 100) : gen(std::move(g)), max_len(len) {
+            }
+
+            value_type operator () (random_engine& rng, unsigned size) const {
+                unsigned len = rng() % (std::min(size, max_len) + 1);
+                value_type res;
+                res.reserve(len);
+                for (unsigned i = 0; i < len; ++i) {
+                    res.push_back(gen(rng, size));
+                }
+                return res;
+            }
+
+            std::vector<value_type> shrink(const value_type& x) const {
+                std::vector<value_type> res;
+                if (x.empty()) {
+                    return res;
+                }
+
+                res.push_back(value_type{});
+                // drop the second half, the first half, then single elements
+                if (x.size() > 1) {
+                    res.emplace_back(x.begin(), x.begin() + x.size() / 2);
+                    res.emplace_back(x.begin() + x.size() / 2, x.end());
+                }
+                for (size_t i = 0; i < x.size(); ++i) {
+                    value_type y = x;
+                    y.erase(y.begin() + i);
+                    res.push_back(std::move(y));
+                }
+                // simplify one element at a time
+                for (size_t i = 0; i < x.size(); ++i) {
+                    for (auto& e : gen.shrink(x[i])) {
+                        value_type y = x;
+                        y[i] = std::move(e);
+                        res.push_back(std::move(y));
+                    }
+                }
+                return res;
+            }
+        };
+
+        //! strings of characters from alphabet
+        struct strings {
+            using value_type = std::string;
+            unsigned max_len;
+            std::string alphabet;
+
+            strings(unsigned len = 100, std::string chars = "abcdefghijklmnopqrstuvwxyz0123456789 ") : max_len(len), alphabet(std::move(chars)) {
+            }
+
+            std::string operator () (random_engine& rng, unsigned size) const {
+                unsigned len = rng() % (std::min(size, max_len) + 1);
+                std::string res(len, ' ');
+                for (auto& c : res) {
+                    c = alphabet[rng() % alphabet.size()];
+                }
+                return res;
+            }
+
+            std::vector<std::string> shrink(const std::string& x) const {
+                std::vector<std::string> res;
+                if (x.empty()) {
+                    return res;
+                }
+                res.emplace_back();
+                if (x.size() > 1) {
+                    res.push_back(x.substr(0, x.size() / 2));
+                }
+                for (size_t i = 0; i < x.size(); ++i) {
+                    res.push_back(x.substr(0, i) + x.substr(i + 1));
+                }
+                return res;
+            }
+        };
+
+        namespace detail {
+
+            template <typename Prop, typename Tuple, size_t...I>
+            bool holds(Prop& prop, const Tuple& args, std::index_sequence<I...>, std::string& why) {
+                try {
+                    return prop(std::get<I>(args)...);
+                } catch (const error& e) {
+                    why = e.what();
+                } catch (const std::exception& e) {
+                    why = std::string("exception: ") + e.what();
+                }
+                return false;
+            }
+
+            template <typename Tuple, size_t...I>
+            void describe_args(std::ostream& out, const Tuple& args, std::index_sequence<I...>) {
+                bool dummy[] = { (out << "\n    arg " << I << ": ", describe(out, std::get<I>(args)), true)... };
+                (void)dummy;
+            }
+
+            // Try the shrink candidates of argument K, keep the first one that still fails.
+            template <size_t K, typename Prop, typename Tuple, typename Gens>
+            bool shrink_arg(Prop& prop, Tuple& args, const Gens& gens, std::string& why, unsigned& budget) {
+                for (auto& candidate : std::get<K>(gens).shrink(std::get<K>(args))) {
+                    if (!budget) {
+                        return false;
+                    }
+                    --budget;
+
+                    Tuple next = args;
+                    std::get<K>(next) = std::move(candidate);
+                    std::string next_why;
+                    if (!holds(prop, next, std::make_index_sequence<std::tuple_size<Tuple>::value>{}, next_why)) {
+                        args = std::move(next);
+                        why = std::move(next_why);
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            template <typename Prop, typename Tuple, typename Gens, size_t...I>
+            bool shrink_step(Prop& prop, Tuple& args, const Gens& gens, std::string& why, unsigned& budget, std::index_sequence<I...>) {
+                bool shrunk = false;
+                bool dummy[] = { (shrunk = shrunk || shrink_arg<I>(prop, args, gens, why, budget))... };
+                (void)dummy;
+                return shrunk;
+            }
+
+        } // namespace detail
+
+        template <typename Prop, typename...G>
+        void for_all(int line, const property_config& cfg, Prop prop, const G&...gens) {
+            using args_t = std::tuple<typename G::value_type...>;
+            auto indices = std::index_sequence_for<G...>{};
+            std::tuple<G...> generators(gens...);
+            uint64_t seed = global_tests().seed();
+
+            for (unsigned run = 0; run < cfg.runs; ++run) {
+                // every run has its own stream so the failing one does not depend on the others
+                random_engine rng(seed * 0x9e3779b97f4a7c15ull + run);
+                unsigned size = 1 + run * cfg.max_size / std::max(cfg.runs, 1u);
+                args_t args{gens(rng, size)...};
+
+                std::string why;
+                if (detail::holds(prop, args, indices, why)) {
+                    continue;
+                }
+
+                unsigned budget = cfg.max_shrinks;
+                unsigned steps = 0;
+                while (budget && detail::shrink_step(prop, args, generators, why, budget, indices)) {
+                    ++steps;
+                }
+
+                std::ostringstream msg;
+                msg << "property failed on run " << run << " (seed " << seed << ", " << steps << " shrinks)";
+                if (!why.empty()) {
+                    msg << ": " << why;
+                }
+                detail::describe_args(msg, args, indices);
+                throw error(line, msg.str());
+            }
+        }
+
+    } // namespace unittest
+
+} // namespace atto
+
+#define FOR_ALL(prop, ...) \
+    ::atto::unittest::for_all(__LINE__, ::atto::unittest::property_config{}, prop, __VA_ARGS__)
+
+#define FOR_ALL_CONFIG(config, prop, ...) \
+    ::atto::unittest::for_all(__LINE__, config, prop, __VA_ARGS__)
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "sqlitexx.h"
+#include "unittest.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// Unique databases for tests. Names never collide between tests or between test processes
+// running in parallel, and files are removed when the factory is cleaned up.
+
+namespace sqlitexx {
+
+    namespace testing {
+
+        class TestDBFactory {
+            std::vector<std::string> files_;
+
+            static std::string unique_name() {
+                static std::atomic<unsigned> counter{0};
+                return "atto-" + std::to_string(getpid()) + "-" + std::to_string(++counter);
+            }
+
+            static bool writable_dir(const char* dir) {
+                return dir && *dir && access(dir, W_OK | X_OK) == 0;
+            }
+
+        public:
+            //! flags to open names returned by the factory with
+            static constexpr int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+
+            TestDBFactory() = default;
+            TestDBFactory(const TestDBFactory&) = delete;
+            TestDBFactory& operator = (const TestDBFactory&) = delete;
+
+            ~TestDBFactory() {
+                cleanup();
+            }
+
+            //! private in-memory database, one per connection
+            std::string memory() {
+                return ":memory:";
+            }
+
+            //! in-memory database shared by all connections of this process opened with this name
+            std::string shared_memory() {
+                return "file:" + unique_name() + "?mode=memory&cache=shared";
+            }
+
+            //! Directory for database files: $ATTO_TMPDIR, /dev/shm (tmpfs, no fsync cost), $TMPDIR or /tmp.
+            static std::string temp_dir() {
+                const char* candidates[] = { std::getenv("ATTO_TMPDIR"), "/dev/shm", std::getenv("TMPDIR"), "/tmp" };
+                for (const char* dir : candidates) {
+                    if (writable_dir(dir)) {
+                        return dir;
+                    }
+                }
+                return ".";
+            }
+
+            //! database file for tests which need a real file (WAL, several processes)
+            std::string temp_file() {
+                std::string path = temp_dir() + "/" + unique_name() + ".db";
+                files_.push_back(path);
+                return path;
+            }
+
+            //! remove all files created by temp_file() together with their journals
+            void cleanup() {
+                for (const auto& f : files_) {
+                    for (const char* suffix : { "", "-journal", "-wal", "-shm" }) {
+                        std::remove((f + suffix).c_str());
+                    }
+                }
+                files_.clear();
+            }
+        };
+
+        //! atto fixture: databases created by the test are removed in teardown
+        struct TestDBFixture : public ::atto::unittest::fixture, public TestDBFactory {
+            void teardown() {
+                cleanup();
+            }
+        };
+
+    } // namespace testing
+
+} // namespace sqlitexx
@@ -1,5 +1,22 @@
+#if __has_include(<zlib.h>)
+#define SQLITEXX_WITH_ZLIB
+#endif
 #include "sqlitexx.h"
+#include "sqlitexx_trace.h"
+#include "sqlitexx_pool.h"
+#include "sqlitexx_migrate.h"
+#include "sqlitexx_json.h"
+#include "sqlitexx_stream.h"
+#include "sqlitexx_writebehind.h"
+#include "sqlitexx_scratch.h"
+#include "sqlitexx_decode.h"
+#include "sqlitexx_utf.h"
+#include "sqlitexx_compress.h"
 #include "unittest.hpp"
+#include "property.hpp"
+#include "crashvfs.hpp"
+#include "testdb.hpp"
+#include "datagen.hpp"
 // #include "so_stdoutstream.hpp"
 // #include "stream.h"
 // #include "reflect.hpp"
@@ -7,10 +24,20 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <cstdlib>
+#include <thread>
+#include <atomic>
+#include <map>
+#include <deque>
+#include <functional>
+#if __cplusplus >= 202002L
+#include <ranges>
+#endif
 
-SMALL_TEST(sqlitexx) {
-    sqlitexx::DB db{"test_sqlitexx_unittest.db"};
-	DEFER(unlink("test_sqlitexx_unittest.db"));
+using sqlitexx::testing::TestDBFixture;
+using sqlitexx::testing::ColumnSpec;
+
+SMALL_TEST_F(TestDBFixture, sqlitexx, "sqlitexx") {
+    sqlitexx::DB db{temp_file()};
 
     auto q = db.prepare("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT, text TEXT, x FLOAT, n NUMBER);");
     q.exec();
@@ -34,6 +61,1828 @@ SMALL_TEST(sqlitexx) {
     }
 }
 
+// Meant to be run under -fsanitize=thread: connections and transactions of several threads on one file.
+LARGE_TEST_F(TestDBFixture, sqlitexx_concurrency, "sqlitexx", "threads") {
+    std::string name = temp_file();
+    const int threads = 4;
+    const int rounds = 200;
+
+    {
+        sqlitexx::DB db{name};
+        db.prepare("PRAGMA journal_mode=WAL;").exec();
+        db.prepare("CREATE TABLE IF NOT EXISTS test (id INTEGER PRIMARY KEY, thread INTEGER, value INTEGER);").exec();
+        db.prepare("DELETE FROM test;").exec();
+    }
+
+    std::atomic<int> committed{0};
+    std::atomic<int> errors{0};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            try {
+                sqlitexx::DB db{name};
+                sqlite3_busy_timeout(db.get(), 10000);
+                int mine = 0;
+                for (int i = 0; i < rounds; ++i) {
+                    auto tr = db.transaction();
+                    // write first: a deferred transaction that reads first can't be upgraded in WAL mode
+                    db.prepare("INSERT INTO test VALUES(null, ?, ?);", t, i).exec();
+                    int own = std::stoi(db.prepare("SELECT count(*) FROM test WHERE thread = ?;", t).exec());
+                    // rows of this thread: the committed ones and the one inserted just now
+                    EXPECT_EQ(own, mine + 1);
+                    if (i % 3 == 0) {
+                        tr.rollback();
+                    } else {
+                        tr.commit();
+                        ++mine;
+                        ++committed;
+                    }
+                }
+            } catch (const sqlitexx::Error& e) {
+                std::cerr << "thread " << t << ": " << e.what() << " (" << e.code() << ")" << std::endl;
+                ++errors;
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    CHECK(errors.load() == 0);
+    sqlitexx::DB db{name};
+    CHECK(std::stoi(db.prepare("SELECT count(*) FROM test;").exec()) == committed.load());
+}
+
+SMALL_TEST_F(TestDBFixture, sqlitexx_commit_busy, "sqlitexx") {
+    std::string name = temp_file();
+    sqlitexx::DB writer{name};
+    sqlitexx::DB reader{name};
+    writer.prepare("CREATE TABLE test (x INTEGER);").exec();
+    writer.prepare("INSERT INTO test VALUES (1), (2);").exec();
+    sqlite3_busy_timeout(writer.get(), 50);
+
+    // a reader in the middle of a scan keeps the writer from committing
+    auto scan = reader.prepare("SELECT x FROM test;");
+    CHECK(scan.step());
+    auto tr = writer.transaction();
+    writer.prepare("INSERT INTO test VALUES (3);").exec();
+    int code = 0;
+    try {
+        tr.commit();
+    } catch (const sqlitexx::Error& e) {
+        code = e.code();
+    }
+    CHECK_EQ(code, SQLITE_BUSY);
+
+    // the transaction is still open and commits once the reader is done
+    scan.reset();
+    tr.commit();
+    CHECK_EQ(reader.prepare("SELECT count(*) FROM test;").exec(), "3");
+}
+
+SMALL_TEST_F(TestDBFixture, sqlitexx_shared_memory, "sqlitexx") {
+    std::string name = shared_memory();
+    sqlitexx::DB writer{name, TestDBFixture::flags};
+    sqlitexx::DB reader{name, TestDBFixture::flags};
+    writer.prepare("CREATE TABLE test (x INTEGER);").exec();
+    writer.prepare("INSERT INTO test VALUES(42);").exec();
+    CHECK_EQ(reader.prepare("SELECT x FROM test;").exec(), "42");
+
+    sqlitexx::DB other{shared_memory(), TestDBFixture::flags};
+    CHECK_EQ(other.prepare("SELECT count(*) FROM sqlite_master;").exec(), "0");
+}
+
+SMALL_TEST(sqlitexx_bind_roundtrip, "sqlitexx", "property") {
+    sqlitexx::DB db;
+    db.prepare("CREATE TABLE test (i INTEGER, s TEXT);").exec();
+
+    FOR_ALL([&](int64_t i, const std::string& s) {
+        db.prepare("DELETE FROM test;").exec();
+        db.prepare("INSERT INTO test VALUES(?, ?);", i, s).exec();
+        auto q = db.prepare("SELECT i, s FROM test;");
+        return q.step() && q[0].as_int() == i && q[1].as_text() == s;
+    }, atto::unittest::integers<int64_t>(), atto::unittest::strings(64));
+}
+
+namespace {
+
+    struct kv_op {
+        enum kind_t { PUT, ERASE, VERIFY, COMMIT, ROLLBACK, TRANSFER } kind = VERIFY;
+        int key = 0;
+        int value = 0;
+
+        bool operator == (const kv_op& op) const {
+            return kind == op.kind && key == op.key && value == op.value;
+        }
+
+        friend std::ostream& operator << (std::ostream& out, const kv_op& op) {
+            static const char* names[] = { "put", "erase", "verify", "commit", "rollback", "transfer" };
+            return out << names[op.kind] << "(" << op.key << ", " << op.value << ")";
+        }
+    };
+
+    struct kv_ops {
+        using value_type = kv_op;
+
+        kv_op operator () (atto::unittest::random_engine& rng, unsigned) const {
+            kv_op op;
+            op.kind = static_cast<kv_op::kind_t>(rng() % 6);
+            op.key = rng() % 8;
+            op.value = rng() % 1000;
+            return op;
+        }
+
+        std::vector<kv_op> shrink(const kv_op& op) const {
+            std::vector<kv_op> res;
+            if (op.key || op.value) {
+                kv_op simple = op;
+                simple.key = 0;
+                simple.value = 0;
+                res.push_back(simple);
+            }
+            return res;
+        }
+    };
+
+    using kv_model = std::map<int, int>;
+
+    // the accounts are shared by all threads, transfers keep their total
+    enum { kv_accounts = 4, kv_balance = 1000 };
+
+    int64_t total_balance(sqlitexx::DB& db) {
+        return std::stoll(db.prepare("SELECT sum(balance) FROM accounts;").exec());
+    }
+
+    kv_model read_partition(sqlitexx::DB& db, int thread) {
+        kv_model res;
+        auto q = db.prepare("SELECT key, value FROM kv WHERE thread = ?;", thread);
+        while (q.step()) {
+            res[q[0].as_int()] = q[1].as_int();
+        }
+        return res;
+    }
+
+    // Each thread owns a key partition and checks it against its model, and moves money between
+    // the shared accounts. Transactions that can't be committed because of concurrent writers are
+    // treated as rolled back.
+    bool run_kv_program(const std::string& name, int thread, const std::vector<kv_op>& program, kv_model& committed) {
+        sqlitexx::DB db{name};
+        sqlite3_busy_timeout(db.get(), 10000);
+
+        kv_model pending = committed;
+        std::unique_ptr<sqlitexx::Transaction> tr;
+        for (const auto& op : program) {
+            try {
+                if (!tr) {
+                    tr = std::make_unique<sqlitexx::Transaction>(db.transaction());
+                }
+
+                switch (op.kind) {
+                case kv_op::PUT:
+                    db.prepare("INSERT OR REPLACE INTO kv VALUES(?, ?, ?);", thread, op.key, op.value).exec();
+                    pending[op.key] = op.value;
+                    break;
+                case kv_op::ERASE:
+                    db.prepare("DELETE FROM kv WHERE thread = ? AND key = ?;", thread, op.key).exec();
+                    pending.erase(op.key);
+                    break;
+                case kv_op::VERIFY:
+                    if (read_partition(db, thread) != pending || total_balance(db) != kv_accounts * kv_balance) {
+                        return false;
+                    }
+                    break;
+                case kv_op::TRANSFER:
+                    db.prepare("UPDATE accounts SET balance = balance - ? WHERE id = ?;", op.value, op.key % kv_accounts).exec();
+                    db.prepare("UPDATE accounts SET balance = balance + ? WHERE id = ?;", op.value, (op.key + 1) % kv_accounts).exec();
+                    break;
+                case kv_op::COMMIT:
+                    tr->commit();
+                    tr.reset();
+                    committed = pending;
+                    break;
+                case kv_op::ROLLBACK:
+                    tr->rollback();
+                    tr.reset();
+                    pending = committed;
+                    break;
+                }
+            } catch (const sqlitexx::Error& e) {
+                if ((e.code() & 0xff) != SQLITE_BUSY || !tr) {
+                    throw;
+                }
+                tr->rollback();
+                tr.reset();
+                pending = committed;
+            }
+        }
+
+        // the destructor commits the last transaction
+        tr.reset();
+        kv_model result = read_partition(db, thread);
+        if (result != pending && result != committed) {
+            return false;
+        }
+        committed = result;
+        return true;
+    }
+
+} // namespace
+
+LARGE_TEST_F(TestDBFixture, sqlitexx_transaction_stress, "sqlitexx", "threads", "property") {
+    std::string name = temp_file();
+
+    {
+        sqlitexx::DB db{name};
+        db.prepare("PRAGMA journal_mode=WAL;").exec();
+        db.prepare("CREATE TABLE IF NOT EXISTS kv (thread INTEGER, key INTEGER, value INTEGER, PRIMARY KEY (thread, key));").exec();
+        db.prepare("CREATE TABLE IF NOT EXISTS accounts (id INTEGER PRIMARY KEY, balance INTEGER);").exec();
+    }
+
+    atto::unittest::property_config config;
+    config.runs = 50;
+    config.max_size = 64;
+    atto::unittest::vectors<kv_ops> programs(kv_ops{}, 64);
+
+    FOR_ALL_CONFIG(config, [&](const std::vector<kv_op>& p0, const std::vector<kv_op>& p1, const std::vector<kv_op>& p2) {
+        sqlitexx::DB db{name};
+        db.prepare("DELETE FROM kv;").exec();
+        db.prepare("DELETE FROM accounts;").exec();
+        for (int i = 0; i < kv_accounts; ++i) {
+            db.prepare("INSERT INTO accounts VALUES (?, ?);", i, static_cast<int>(kv_balance)).exec();
+        }
+
+        const std::vector<kv_op>* programs[] = { &p0, &p1, &p2 };
+        kv_model models[3];
+        std::atomic<bool> ok{true};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 3; ++t) {
+            threads.emplace_back([&, t]() {
+                try {
+                    if (!run_kv_program(name, t, *programs[t], models[t])) {
+                        ok = false;
+                    }
+                } catch (const std::exception& e) {
+                    std::cerr << "thread " << t << ": " << e.what() << std::endl;
+                    ok = false;
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        for (int t = 0; ok && t < 3; ++t) {
+            ok = read_partition(db, t) == models[t];
+        }
+        return ok && total_balance(db) == kv_accounts * kv_balance;
+    }, programs, programs, programs);
+}
+
+namespace {
+
+    struct crash_mode {
+        const char* journal;
+        const char* synchronous;
+        bool durable;
+        bool survives_reordering;
+    };
+
+    const int crash_accounts = 8;
+    const int crash_transfers = 24;
+
+    //! money moves between accounts, acknowledged counts transactions whose commit returned
+    void crash_workload(sqlitexx::testing::CrashVFS& vfs, const crash_mode& mode, int& acknowledged) {
+        sqlitexx::DB db{"crash.db", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, vfs.name()};
+        // no shared memory in the test VFS, WAL needs exclusive locking
+        db.prepare("PRAGMA locking_mode=EXCLUSIVE;").exec();
+        db.prepare(std::string("PRAGMA journal_mode=") + mode.journal + ";").exec();
+        db.prepare(std::string("PRAGMA synchronous=") + mode.synchronous + ";").exec();
+        db.prepare("PRAGMA cache_size=8;").exec();
+
+        {
+            auto t = db.transaction();
+            db.prepare("CREATE TABLE account (id INTEGER PRIMARY KEY, balance INTEGER NOT NULL);").exec();
+            db.prepare("CREATE TABLE transfer (id INTEGER PRIMARY KEY, src INTEGER, dst INTEGER, amount INTEGER, note TEXT);").exec();
+            db.prepare("CREATE INDEX transfer_src ON transfer (src);").exec();
+            for (int i = 0; i < crash_accounts; ++i) {
+                db.prepare("INSERT INTO account VALUES(?, 100);", i).exec();
+            }
+            t.commit();
+        }
+        ++acknowledged;
+
+        for (int i = 0; i < crash_transfers; ++i) {
+            int src = i % crash_accounts;
+            int dst = (i * 3 + 1) % crash_accounts;
+            int amount = i % 17 + 1;
+
+            auto t = db.transaction();
+            db.prepare("UPDATE account SET balance = balance - ? WHERE id = ?;", amount, src).exec();
+            db.prepare("UPDATE account SET balance = balance + ? WHERE id = ?;", amount, dst).exec();
+            // notes are large enough to split pages
+            db.prepare("INSERT INTO transfer VALUES(null, ?, ?, ?, ?);", src, dst, amount, std::string(200 + 97 * i % 1500, 'a' + i % 26)).exec();
+            t.commit();
+            ++acknowledged;
+        }
+    }
+
+    //! empty string if the recovered database is consistent
+    std::string crash_verify(sqlitexx::testing::CrashVFS& vfs, const crash_mode& mode, int acknowledged) {
+        sqlitexx::DB db{"crash.db", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, vfs.name()};
+        db.prepare("PRAGMA locking_mode=EXCLUSIVE;").exec();
+
+        std::string integrity = db.prepare("PRAGMA integrity_check;").exec();
+        if (integrity != "ok") {
+            return "integrity check: " + integrity;
+        }
+
+        if (db.prepare("SELECT count(*) FROM sqlite_master WHERE name = 'account';").exec() == "0") {
+            return (mode.durable && acknowledged > 0) ? "committed schema is lost" : "";
+        }
+
+        if (db.prepare("SELECT count(*) FROM account;").exec() != std::to_string(crash_accounts)) {
+            return "accounts are lost";
+        }
+        if (db.prepare("SELECT sum(balance) FROM account;").exec() != std::to_string(crash_accounts * 100)) {
+            return "money is not preserved";
+        }
+
+        std::string mismatched = db.prepare(
+                "SELECT count(*) FROM account a WHERE balance != 100"
+                " - (SELECT coalesce(sum(amount), 0) FROM transfer WHERE src = a.id)"
+                " + (SELECT coalesce(sum(amount), 0) FROM transfer WHERE dst = a.id);").exec();
+        if (mismatched != "0") {
+            return "balances do not match transfers";
+        }
+
+        // the transaction in flight at the crash may or may not survive
+        int transfers = std::stoi(db.prepare("SELECT count(*) FROM transfer;").exec());
+        if (transfers > acknowledged) {
+            return "more transfers than were issued";
+        }
+        if (mode.durable && transfers < acknowledged - 1) {
+            return "acknowledged transfers are lost";
+        }
+
+        return "";
+    }
+
+} // namespace
+
+LARGE_TEST(sqlitexx_crash_consistency, "sqlitexx", "crash") {
+    sqlitexx::testing::CrashVFS vfs("atto-crash");
+    std::mt19937_64 rng(atto::unittest::global_tests().seed());
+    // Rollback journal with synchronous=NORMAL does not sync the journal header, so it is only
+    // safe when the disk keeps write order (the harness finds broken transfers otherwise).
+    const crash_mode modes[] = {
+        { "DELETE", "FULL", true, true },
+        { "DELETE", "NORMAL", false, false },
+        { "WAL", "FULL", true, true },
+        { "WAL", "NORMAL", false, true },
+    };
+
+    unsigned crash_points = 0;
+    for (const auto& mode : modes) {
+        vfs.reset();
+        int acknowledged = 0;
+        crash_workload(vfs, mode, acknowledged);
+        CHECK(acknowledged == crash_transfers + 1);
+        uint64_t total = vfs.operations();
+
+        for (uint64_t k = 1; k <= total; ++k) {
+            // first lose every unsynced write, then keep a random subset of them
+            for (int reorder = 0; reorder < (mode.survives_reordering ? 2 : 1); ++reorder) {
+                vfs.reset();
+                vfs.crash_after(k);
+                acknowledged = 0;
+                try {
+                    crash_workload(vfs, mode, acknowledged);
+                } catch (const sqlitexx::Error&) {
+                }
+                CHECK(vfs.crashed());
+
+                vfs.recover(reorder ? &rng : nullptr);
+                std::string problem = crash_verify(vfs, mode, acknowledged);
+                if (!problem.empty()) {
+                    throw atto::unittest::error(__LINE__, std::string(mode.journal) + "/" + mode.synchronous + " crash after operation "
+                            + std::to_string(k) + (reorder ? " with reordering" : "") + ": " + problem);
+                }
+                ++crash_points;
+            }
+        }
+    }
+
+    std::cout << crash_points << " crash points verified" << std::endl;
+}
+
+SMALL_TEST_F(TestDBFixture, sqlitexx_trace_replay, "sqlitexx", "trace") {
+    std::string trace_file = temp_file();
+    std::string source = temp_file();
+    {
+        sqlitexx::TraceWriter writer(trace_file);
+        sqlitexx::DB db{source};
+        db.trace(&writer);
+
+        db.prepare("CREATE TABLE test (id INTEGER PRIMARY KEY, name TEXT, x REAL, n INTEGER);").exec();
+        {
+            auto t = db.transaction();
+            auto ins = db.prepare("INSERT INTO test VALUES (?, ?, ?, ?);");
+            for (int64_t i = 0; i < 200; ++i) {
+                ins.bind(1, i);
+                ins.bind(2, "name " + std::to_string(i));
+                ins.bind(3, i / 8.0);
+                if (i % 3) {
+                    ins.bind(4, i * -1000000007);
+                } else {
+                    ins.bind(4, nullptr);
+                }
+                ins.exec();
+            }
+        }
+        auto q = db.prepare("SELECT count(*) FROM test WHERE n IS NULL;");
+        CHECK_EQ(q.exec(), "67");
+        writer.flush();
+        CHECK_EQ(writer.records(), 204u);
+    }
+
+    auto trace = sqlitexx::Trace::load(trace_file);
+    CHECK_EQ(trace.events.size(), 204u);
+    CHECK_EQ(trace.sql.size(), 5u);
+    const auto& ev = trace.events[10];
+    CHECK_EQ(trace.sql[ev.sql], "INSERT INTO test VALUES (?, ?, ?, ?);");
+    CHECK_EQ(ev.params.size(), 4u);
+    CHECK_EQ(ev.params[1].s, "name 8");
+    CHECK_EQ(ev.params[2].d, 1.0);
+    CHECK_EQ(ev.params[3].i, 8 * -1000000007ll);
+    for (size_t i = 1; i < trace.events.size(); ++i) {
+        CHECK_LE(trace.events[i - 1].time_ns, trace.events[i].time_ns);
+    }
+
+    std::string target = temp_file();
+    sqlitexx::ReplayOptions opts;
+    opts.speed = 0;
+    opts.open = [&] { return std::make_unique<sqlitexx::DB>(target); };
+    auto report = sqlitexx::replay(trace, opts);
+    CHECK_EQ(report.errors, 0u);
+    CHECK_EQ(report.latencies_ns.size(), 204u);
+    CHECK_LE(report.percentile(50), report.percentile(99));
+
+    const char* digest = "SELECT sum(n) || ' ' || count(name) || ' ' || sum(x) || ' ' || count(*) FILTER (WHERE n IS NULL) FROM test;";
+    CHECK_EQ(sqlitexx::DB{target}.prepare(digest).exec(), sqlitexx::DB{source}.prepare(digest).exec());
+}
+
+SMALL_TEST(sqlitexx_step_n, "sqlitexx") {
+    using namespace std::chrono_literals;
+    sqlitexx::DB db;
+    db.prepare("CREATE TABLE test (n INTEGER);").exec();
+    db.prepare("INSERT INTO test WITH RECURSIVE s(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM s WHERE n < 10000) SELECT n FROM s;").exec();
+
+    // round-robin scheduler: a task is resumed until it reports it is done
+    std::deque<std::function<bool()>> tasks;
+    std::vector<std::string> finished;
+
+    auto scan = db.prepare("SELECT n FROM test ORDER BY n;");
+    int64_t expected = 1;
+    unsigned slices = 0;
+    tasks.push_back([&] {
+        ++slices;
+        bool done = scan.step_n(1000, 0ns, [&](sqlitexx::Statement& st) {
+            CHECK_EQ(st[0].as_int(), expected);
+            ++expected;
+        });
+        if (done) {
+            finished.push_back("scan");
+        }
+        return done;
+    });
+    for (int i = 0; i < 3; ++i) {
+        // short queries on the same connection while the scan is open
+        tasks.push_back([&, i] {
+            auto q = db.prepare("SELECT count(*) FROM test WHERE n % 3 = ?;", i);
+            CHECK_EQ(q.exec(), i == 1 ? "3334" : "3333");
+            finished.push_back("short");
+            return true;
+        });
+    }
+
+    while (!tasks.empty()) {
+        auto task = std::move(tasks.front());
+        tasks.pop_front();
+        if (!task()) {
+            tasks.push_back(std::move(task));
+        }
+    }
+
+    CHECK_EQ(expected, 10001);
+    CHECK_EQ(slices, 11u);
+    CHECK_EQ(finished.back(), "scan");
+
+    // time budget and the driver
+    auto all = db.prepare("SELECT n FROM test;");
+    unsigned rows = 0;
+    unsigned yields = 0;
+    all.run_cooperative(0, 1ms, [&](sqlitexx::Statement&) { ++rows; }, [&] { ++yields; });
+    CHECK_EQ(rows, 10000u);
+    CHECK_LE(yields, rows);
+
+    // the deadline is checked between rows: a slow first step still yields a row per call
+    auto sorted = db.prepare("SELECT a.n FROM test a, test b WHERE b.n <= 10 ORDER BY a.n % 7, a.n;");
+    rows = 0;
+    yields = 0;
+    sorted.run_cooperative(0, 1ns, [&](sqlitexx::Statement&) { ++rows; }, [&] { ++yields; });
+    CHECK_EQ(rows, 100000u);
+    CHECK_GT(yields, 0u);
+}
+
+SMALL_TEST(sqlitexx_reset, "sqlitexx") {
+    sqlitexx::DB db;
+    db.prepare("CREATE TABLE test (n INTEGER, s TEXT);").exec();
+
+    // exec() resets: the same statement runs again with new bindings
+    auto ins = db.prepare("INSERT INTO test VALUES (?, ?);");
+    for (int i = 1; i <= 5; ++i) {
+        ins.bind(1, i);
+        ins.bind(2, "row " + std::to_string(i));
+        ins.exec();
+    }
+    ins.clear_bindings();
+    ins.exec();
+    CHECK_EQ(db.prepare("SELECT count(*) FROM test WHERE n IS NULL AND s IS NULL;").exec(), "1");
+
+    // a SELECT through exec() does not stay open
+    auto count = db.prepare("SELECT count(*) FROM test;");
+    CHECK_EQ(count.exec(), "6");
+    CHECK(!sqlite3_stmt_busy(count.get()));
+    CHECK_EQ(count.exec(), "6");
+
+    // step() after the end runs the query again
+    auto q = db.prepare("SELECT n FROM test WHERE n <= ? ORDER BY n;", 2);
+    for (int pass = 0; pass < 2; ++pass) {
+        CHECK(q.step());
+        CHECK_EQ(q[0].as_int(), 1);
+        CHECK(q.step());
+        CHECK_EQ(q[0].as_int(), 2);
+        CHECK(!q.step());
+        CHECK(!sqlite3_stmt_busy(q.get()));
+    }
+
+    // abandoned iterations are reset when the scope ends
+    {
+        auto rows = q.rows();
+        auto it = rows.begin();
+        ++it;
+        CHECK(sqlite3_stmt_busy(q.get()));
+    }
+    CHECK(!sqlite3_stmt_busy(q.get()));
+    {
+        sqlitexx::ResetGuard guard(q);
+        CHECK(q.step());
+    }
+    CHECK(!sqlite3_stmt_busy(q.get()));
+
+    // an error resets the statement too, it can run again after it
+    db.prepare("CREATE UNIQUE INDEX test_n ON test (n);").exec();
+    ins.bind(1, 1);
+    bool failed = false;
+    try {
+        ins.exec();
+    } catch (const sqlitexx::Error& e) {
+        failed = (e.code() & 0xff) == SQLITE_CONSTRAINT;
+    }
+    CHECK(failed);
+    CHECK(!sqlite3_stmt_busy(ins.get()));
+    ins.bind(1, 100);
+    ins.exec();
+    CHECK_EQ(count.exec(), "7");
+}
+
+SMALL_TEST(sqlitexx_iterate, "sqlitexx") {
+    sqlitexx::DB db;
+    db.prepare("CREATE TABLE test (n INTEGER);").exec();
+    db.prepare("INSERT INTO test WITH RECURSIVE s(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM s WHERE n < 100) SELECT n FROM s;").exec();
+
+    // the first row is the first one of the query, and a finished loop can run again
+    auto q = db.prepare("SELECT n FROM test WHERE n <= ? ORDER BY n;", 10);
+    for (int pass = 0; pass < 2; ++pass) {
+        std::vector<int64_t> seen;
+        for (auto& row : q) {
+            seen.push_back(row[0].as_int());
+        }
+        CHECK_EQ(seen.size(), 10u);
+        CHECK_EQ(seen.front(), 1);
+        CHECK_EQ(seen.back(), 10);
+    }
+
+    // a loop left with break starts from the first row next time
+    for (auto& row : q) {
+        if (row[0].as_int() == 3) {
+            break;
+        }
+    }
+    CHECK_EQ((*q.begin())[0].as_int(), 1);
+    q.reset();
+
+    // no rows: begin() is the end
+    auto none = db.prepare("SELECT n FROM test WHERE n < 0;");
+    CHECK(none.begin() == none.end());
+    CHECK(!sqlite3_stmt_busy(none.get()));
+
+    // iterators of the statement are the same position
+    auto it = q.begin();
+    auto copy = it;
+    ++it;
+    CHECK(it == copy);
+    CHECK_EQ(copy->operator[](0).as_int(), 2);
+    q.reset();
+
+#ifdef __cpp_lib_ranges
+    static_assert(std::input_iterator<sqlitexx::Statement::iterator>);
+    static_assert(std::sentinel_for<sqlitexx::Statement::sentinel, sqlitexx::Statement::iterator>);
+    static_assert(std::ranges::input_range<sqlitexx::Statement&>);
+
+    // views over the rows, nothing is buffered
+    auto all = db.prepare("SELECT n FROM test ORDER BY n;");
+    int64_t sum = 0;
+    for (int64_t x : all
+            | std::views::transform([](sqlitexx::Statement& r) { return r[0].as_int(); })
+            | std::views::filter([](int64_t x) { return x % 10 == 0; })
+            | std::views::take(3)) {
+        sum += x;
+    }
+    CHECK_EQ(sum, 60);
+    all.reset();
+#endif
+}
+
+SMALL_TEST_F(TestDBFixture, sqlitexx_schema, "sqlitexx") {
+    std::string name = temp_file();
+    sqlitexx::DB db{name};
+    db.prepare("CREATE TABLE users (id INTEGER PRIMARY KEY, name TEXT NOT NULL UNIQUE, karma REAL DEFAULT 0);").exec();
+    db.prepare("CREATE TABLE posts (id INTEGER PRIMARY KEY, author INTEGER REFERENCES users(id) ON DELETE CASCADE, body TEXT, "
+        "len INTEGER GENERATED ALWAYS AS (length(body)) VIRTUAL);").exec();
+    db.prepare("CREATE INDEX posts_author ON posts (author, lower(body)) WHERE author IS NOT NULL;").exec();
+
+    auto schema = db.schema();
+    CHECK_EQ(schema->tables.size(), 2u);
+    CHECK_EQ(schema->tables[0].name, "posts");
+
+    const sqlitexx::TableInfo* users = schema->table("USERS");
+    ASSERT(users);
+    CHECK_EQ(users->columns.size(), 3u);
+    CHECK_EQ(users->columns[0].pk, 1);
+    CHECK_EQ(users->column("name")->type, "TEXT");
+    CHECK(users->column("name")->not_null);
+    CHECK_EQ(*users->column("karma")->default_value, "0");
+    CHECK(!users->column("id")->default_value);
+    CHECK(!users->column("missing"));
+    ASSERT(users->indexes.size() == 1);
+    CHECK(users->indexes[0].unique);
+    CHECK_EQ(users->indexes[0].origin, "u");
+    CHECK_EQ(users->indexes[0].columns.size(), 1u);
+
+    const sqlitexx::TableInfo* posts = schema->table("posts");
+    ASSERT(posts);
+    CHECK(posts->column("len")->hidden);
+    const sqlitexx::IndexInfo* idx = posts->index("posts_author");
+    ASSERT(idx);
+    CHECK(idx->partial);
+    ASSERT(idx->columns.size() == 2);
+    CHECK_EQ(idx->columns[0], "author");
+    CHECK_EQ(idx->columns[1], "");
+    ASSERT(posts->foreign_keys.size() == 1);
+    CHECK_EQ(posts->foreign_keys[0].table, "users");
+    CHECK_EQ(posts->foreign_keys[0].from[0], "author");
+    CHECK_EQ(posts->foreign_keys[0].to[0], "id");
+    CHECK_EQ(posts->foreign_keys[0].on_delete, "CASCADE");
+
+    // cached while the schema is the same, data changes do not matter
+    db.prepare("INSERT INTO users (name) VALUES ('a');").exec();
+    CHECK_EQ(db.schema().get(), schema.get());
+
+    // schema changes of this and of other connections are seen, old snapshots stay as they were
+    db.prepare("ALTER TABLE users ADD COLUMN email TEXT;").exec();
+    auto changed = db.schema();
+    CHECK_NE(changed.get(), schema.get());
+    CHECK_EQ(changed->table("users")->columns.size(), 4u);
+    CHECK_EQ(schema->table("users")->columns.size(), 3u);
+    {
+        sqlitexx::DB other{name};
+        other.prepare("CREATE TABLE tags (name TEXT);").exec();
+    }
+    ASSERT(db.schema()->table("tags"));
+}
+
+SMALL_TEST(sqlitexx_decode, "sqlitexx") {
+    sqlitexx::DB db;
+    db.prepare("CREATE TABLE m (id INTEGER PRIMARY KEY, n INT NOT NULL, x DOUBLE PRECISION, s VARCHAR(10), v NUMERIC, b);").exec();
+    db.prepare("INSERT INTO m VALUES (1, 10, 1.5, 'one', 1, x'00');").exec();
+    // flexible typing: 2.0 is stored as an integer in x, text stays text in n
+    db.prepare("INSERT INTO m VALUES (2, 'twenty', 2, 2, 2.5, NULL);").exec();
+
+    auto q = db.prepare("SELECT id AS key, n, x, s, v, b, n + 1 FROM m ORDER BY id;");
+    const auto& cols = q.columns();
+    ASSERT(cols.size() == 7);
+    CHECK_EQ(&cols, &q.columns());
+    CHECK_EQ(cols[0].name, "key");
+    CHECK_EQ(cols[0].origin, "id");
+    CHECK_EQ(cols[0].table, "m");
+    CHECK_EQ(cols[0].database, "main");
+    CHECK_EQ(cols[1].affinity, sqlitexx::ColumnDesc::INTEGER);
+    CHECK(!cols[1].nullable);
+    CHECK_EQ(cols[2].declared_type, "DOUBLE PRECISION");
+    CHECK_EQ(cols[2].affinity, sqlitexx::ColumnDesc::REAL);
+    CHECK(cols[2].nullable);
+    CHECK_EQ(cols[3].affinity, sqlitexx::ColumnDesc::TEXT);
+    CHECK_EQ(cols[4].affinity, sqlitexx::ColumnDesc::NUMERIC);
+    CHECK_EQ(cols[5].affinity, sqlitexx::ColumnDesc::BLOB);
+    CHECK_EQ(cols[6].declared_type, "");
+    CHECK_EQ(cols[6].table, "");
+
+    sqlitexx::RowDecoder<int64_t, std::string, double, std::string, double, std::optional<std::string>, int64_t> decode(q);
+    CHECK(decode.fast(0));
+    CHECK(!decode.fast(1));
+    CHECK(decode.fast(2));
+    CHECK(decode.fast(3));
+    CHECK(!decode.fast(4));
+
+    ASSERT(q.step());
+    auto row = decode.decode();
+    CHECK_EQ(std::get<1>(row), "10");
+    CHECK_EQ(std::get<2>(row), 1.5);
+    CHECK_EQ(std::get<3>(row), "one");
+    CHECK_EQ(std::get<4>(row), 1.0);
+    CHECK_EQ(std::get<5>(row)->size(), 1u);
+    CHECK_EQ(std::get<6>(row), 11);
+
+    ASSERT(q.step());
+    decode.decode(row);
+    CHECK_EQ(std::get<0>(row), 2);
+    CHECK_EQ(std::get<1>(row), "twenty");
+    CHECK_EQ(std::get<2>(row), 2.0);
+    CHECK_EQ(std::get<3>(row), "2");
+    CHECK_EQ(std::get<4>(row), 2.5);
+    CHECK(!std::get<5>(row));
+    CHECK_EQ(std::get<6>(row), 1);
+    q.reset();
+
+    // text which is not a number can't be an integer
+    auto bad = db.prepare("SELECT s FROM m WHERE id = 1;");
+    sqlitexx::RowDecoder<int64_t> ints(bad);
+    CHECK(!ints.fast(0));
+    ASSERT(bad.step());
+    int code = 0;
+    try {
+        ints.decode();
+    } catch (const sqlitexx::Error& e) {
+        code = e.code();
+    }
+    CHECK_EQ(code, SQLITE_MISMATCH);
+    bad.reset();
+
+    // a typed fetch trusts the declared type, NULL is still checked where the column allows it
+    auto trusted = db.prepare("SELECT n, x FROM m WHERE id = 2;");
+    sqlitexx::RowDecoder<int64_t, double> typed(trusted);
+    ASSERT(trusted.step());
+    CHECK_EQ(std::get<0>(typed.decode()), 0);
+    trusted.reset();
+    auto null_x = db.prepare("SELECT x FROM m WHERE id = 3;");
+    db.prepare("INSERT INTO m VALUES (3, 3, NULL, NULL, NULL, NULL);").exec();
+    sqlitexx::RowDecoder<double> doubles(null_x);
+    ASSERT(null_x.step());
+    code = 0;
+    try {
+        doubles.decode();
+    } catch (const sqlitexx::Error& e) {
+        code = e.code();
+    }
+    CHECK_EQ(code, SQLITE_MISMATCH);
+    null_x.reset();
+    db.prepare("DELETE FROM m WHERE id = 3;").exec();
+
+    // a schema change prepares the statement again and the columns are read again
+    auto all = db.prepare("SELECT * FROM m;");
+    CHECK_EQ(all.columns().size(), 6u);
+    db.prepare("ALTER TABLE m ADD COLUMN extra TEXT;").exec();
+    ASSERT(all.step());
+    all.reset();
+    ASSERT(all.columns().size() == 7);
+    CHECK_EQ(all.columns()[6].name, "extra");
+    CHECK_EQ(all.columns()[6].affinity, sqlitexx::ColumnDesc::TEXT);
+
+    // resetting the counters doesn't hide a schema change from columns() or the decoder
+    auto last = db.prepare("SELECT * FROM m WHERE id = 1;");
+    sqlitexx::RowDecoder<int64_t, int64_t, double, std::string, double, std::optional<std::string>, std::optional<int64_t>> wide(last);
+    CHECK(!wide.fast(6));
+    all.stats(true);
+    last.stats(true);
+    db.prepare("ALTER TABLE m DROP COLUMN extra;").exec();
+    db.prepare("ALTER TABLE m ADD COLUMN extra INTEGER;").exec();
+    ASSERT(all.step());
+    all.reset();
+    CHECK_EQ(all.columns()[6].affinity, sqlitexx::ColumnDesc::INTEGER);
+    ASSERT(last.step());
+    auto decoded = wide.decode();
+    CHECK(wide.fast(6));
+    CHECK(!std::get<6>(decoded));
+    last.reset();
+}
+
+SMALL_TEST(sqlitexx_utf, "sqlitexx", "utf") {
+    using sqlitexx::utf::Isa;
+    const std::string mixed = "plain ascii, then caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80 and ascii again";
+    const std::u16string mixed16 = u"plain ascii, then café € \U0001F600 and ascii again";
+    const std::vector<std::string> invalid = {
+        "\x80", "\xc0\xaf", "\xc3", "\xe0\x80\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xf5\x80\x80\x80", "\xff",
+    };
+
+    Isa restore = sqlitexx::utf::isa();
+    DEFER(sqlitexx::utf::use_isa(restore));
+    for (Isa isa : { Isa::SCALAR, Isa::SSE2, Isa::AVX2, Isa::NEON }) {
+        if (!sqlitexx::utf::use_isa(isa)) {
+            continue;
+        }
+        CHECK_EQ(sqlitexx::utf::isa(), isa);
+
+        // the invalid byte is found in the vector part, the tail and between sequences
+        for (size_t pad = 0; pad < 70; pad += 7) {
+            std::string prefix(pad, 'a');
+            CHECK(sqlitexx::utf::valid_utf8(prefix + mixed + prefix));
+            for (const auto& bad : invalid) {
+                size_t error = 0;
+                CHECK(!sqlitexx::utf::valid_utf8(prefix + bad + mixed, &error));
+                CHECK_EQ(error, pad);
+                CHECK(!sqlitexx::utf::valid_utf8(prefix + mixed + bad, &error));
+                CHECK_EQ(error, pad + mixed.size());
+            }
+
+            std::u16string prefix16(pad, u'a');
+            std::u16string wide;
+            CHECK(sqlitexx::utf::utf8_to_utf16(prefix + mixed + prefix, wide));
+            CHECK(wide == prefix16 + mixed16 + prefix16);
+            std::string narrow;
+            CHECK(sqlitexx::utf::utf16_to_utf8(wide, narrow));
+            CHECK_EQ(narrow, prefix + mixed + prefix);
+            CHECK(!sqlitexx::utf::utf16_to_utf8(prefix16 + u'\xd800' + prefix16, narrow));
+            CHECK(!sqlitexx::utf::utf16_to_utf8(prefix16 + u'\xdc00' + u'\xd800', narrow));
+        }
+    }
+
+    sqlitexx::DB db;
+    db.prepare("CREATE TABLE t (s TEXT);").exec();
+    auto ins = db.prepare("INSERT INTO t VALUES (?);");
+    sqlitexx::bind_utf8(ins, 1, mixed);
+    ins.exec();
+    sqlitexx::bind_utf16(ins, 1, mixed16);
+    ins.exec();
+    bool rejected = false;
+    try {
+        sqlitexx::bind_utf8(ins, 1, "bad \xc0\xaf");
+    } catch (const sqlitexx::Error& e) {
+        rejected = e.code() == SQLITE_MISMATCH;
+    }
+    CHECK(rejected);
+
+    auto q = db.prepare("SELECT s FROM t;");
+    std::u16string text;
+    int rows = 0;
+    for (auto& row : q) {
+        CHECK_EQ(sqlitexx::text_utf8(row[0]), mixed);
+        sqlitexx::text16(row[0], text);
+        CHECK(text == mixed16);
+        CHECK(row[0].as_text16() == mixed16);
+        ++rows;
+    }
+    CHECK_EQ(rows, 2);
+}
+
+SMALL_TEST(sqlitexx_compress, "sqlitexx", "compress") {
+    sqlitexx::DB db;
+    db.prepare("CREATE TABLE docs (id INTEGER PRIMARY KEY, body);").exec();
+    auto doc = [](int i) {
+        return "{\"id\": " + std::to_string(i) + ", \"level\": \"info\", \"service\": \"billing\", \"message\": \"invoice " +
+            std::to_string(i * 7919 % 1000) + " sent to customer\", \"tags\": [\"mail\", \"pdf\"]}";
+    };
+
+    {
+        sqlitexx::Compression comp(db);
+        CHECK_EQ(std::string(comp.codec_name()), sqlitexx::default_codec());
+
+        // through SQL and through binds
+        auto ins = db.prepare("INSERT INTO docs VALUES (?, sqlitexx_compress(?, 'docs'));");
+        auto bind = db.prepare("INSERT INTO docs VALUES (?, ?);");
+        for (int i = 0; i < 200; ++i) {
+            if (i % 2) {
+                ins.bind(1, i);
+                ins.bind(2, doc(i));
+                ins.exec();
+            } else {
+                bind.bind(1, i);
+                comp.bind(bind, 2, doc(i), "docs");
+                bind.exec();
+            }
+        }
+        CHECK_EQ(db.prepare("SELECT count(*) FROM docs WHERE typeof(body) = 'blob' AND length(body) < length(sqlitexx_decompress(body));").exec(), "200");
+        CHECK_EQ(db.prepare("SELECT sqlitexx_decompress(body) FROM docs WHERE id = 7;").exec(), doc(7));
+
+        auto q = db.prepare("SELECT id, body FROM docs ORDER BY id;");
+        for (auto& row : q) {
+            CHECK_EQ(comp.read(row[1]), doc(static_cast<int>(row[0].as_int())));
+        }
+
+        // short values, blobs and values which are not compressed
+        CHECK_EQ(db.prepare("SELECT sqlitexx_decompress(sqlitexx_compress('short'));").exec(), "short");
+        CHECK_EQ(db.prepare("SELECT typeof(sqlitexx_decompress(sqlitexx_compress(zeroblob(1000))));").exec(), "blob");
+        CHECK_EQ(db.prepare("SELECT sqlitexx_decompress(sqlitexx_compress(42)) + sqlitexx_decompress('1');").exec(), "43");
+        CHECK_EQ(db.prepare("SELECT sqlitexx_compress(NULL) IS NULL;").exec(), "1");
+
+        // blobs written by others pass through, damaged compressed values are errors
+        CHECK_EQ(db.prepare("SELECT hex(sqlitexx_decompress(x'01000000'));").exec(), "01000000");
+        auto foreign = db.prepare("SELECT x'0102';");
+        for (auto& row : foreign) {
+            CHECK_EQ(comp.read(row[0]), std::string_view("\x01\x02", 2));
+        }
+        int code = 0;
+        try {
+            db.prepare("SELECT sqlitexx_decompress(x'c553515a01000000');").exec();
+        } catch (const sqlitexx::Error& e) {
+            code = e.code();
+        }
+        CHECK_EQ(code, SQLITE_CORRUPT);
+
+        // a dictionary for the table makes new values smaller, old ones still decode
+        auto before = db.prepare("SELECT length(sqlitexx_compress(?, 'docs'));", doc(1000)).exec();
+        uint32_t dict = comp.train("docs", "SELECT body FROM docs;", 4096);
+        CHECK_GT(dict, 0u);
+        CHECK_EQ(comp.dictionary_of("DOCS"), dict);
+        auto after = db.prepare("SELECT length(sqlitexx_compress(?, 'docs'));", doc(1000)).exec();
+        CHECK_LT(std::stoi(after), std::stoi(before));
+        db.prepare("INSERT INTO docs VALUES (1000, sqlitexx_compress(?, 'docs'));", doc(1000)).exec();
+    }
+
+    // the dictionaries are kept in the database
+    sqlitexx::Compression comp(db);
+    CHECK_GT(comp.dictionary_of("docs"), 0u);
+    CHECK_EQ(db.prepare("SELECT count(*) FROM docs WHERE sqlitexx_decompress(body) LIKE '{\"id\": %';").exec(), "201");
+
+    // raw keeps values as they are, they still decode with a real codec
+    sqlitexx::DB plain;
+    {
+        sqlitexx::Compression raw(plain, sqlitexx::CompressionOptions{ "raw" });
+        CHECK_EQ(std::string(raw.codec_name()), "raw");
+        CHECK_EQ(raw.train("docs", "SELECT 'no dictionary';"), 0u);
+        CHECK_EQ(plain.prepare("SELECT substr(sqlitexx_compress(?1), -length(?1)) = CAST(?1 AS BLOB);", doc(1)).exec(), "1");
+        plain.prepare("CREATE TABLE docs AS SELECT sqlitexx_compress(?) AS body;", doc(1)).exec();
+    }
+    sqlitexx::Compression other(plain);
+    CHECK_EQ(plain.prepare("SELECT sqlitexx_decompress(body) FROM docs;").exec(), doc(1));
+}
+
+SMALL_TEST_F(TestDBFixture, sqlitexx_compress_dictionaries, "sqlitexx", "compress") {
+    std::string name = temp_file();
+    sqlitexx::DB writer(name);
+    sqlitexx::DB reader(name);
+    writer.prepare("CREATE TABLE logs (line TEXT);").exec();
+    sqlitexx::Compression reading(reader);
+
+    // a dictionary trained on another connection is loaded when a value needs it
+    sqlitexx::Compression writing(writer);
+    for (int i = 0; i < 100; ++i) {
+        writer.prepare("INSERT INTO logs VALUES (?);", "GET /api/v1/items/" + std::to_string(i) + " HTTP/1.1 200 OK user-agent=curl/8.0").exec();
+    }
+    CHECK_GT(writing.train("logs", "SELECT line FROM logs;", 1024), 0u);
+    std::string line = "GET /api/v1/items/1000 HTTP/1.1 200 OK user-agent=curl/8.0 and a little more to compress";
+    writer.prepare("INSERT INTO logs VALUES (sqlitexx_compress(?, 'logs'));", line).exec();
+    CHECK_EQ(reader.prepare("SELECT sqlitexx_decompress(line) FROM logs WHERE typeof(line) = 'blob';").exec(), line);
+}
+
+SMALL_TEST_F(TestDBFixture, sqlitexx_scheduler, "sqlitexx", "threads") {
+    std::string name = temp_file();
+    sqlitexx::DB{name}.prepare("CREATE TABLE log (what TEXT);").exec();
+    sqlitexx::Pool pool(1, [&] {
+        auto db = std::make_unique<sqlitexx::DB>(name);
+        sqlite3_busy_timeout(db->get(), 5000);
+        return db;
+    });
+
+    enum { INTERACTIVE, BATCH };
+    sqlitexx::Scheduler::Class interactive;
+    interactive.max_queued = 2;
+    sqlitexx::Scheduler::Class batch;
+    batch.preemption = sqlitexx::Scheduler::INTERRUPT;
+    sqlitexx::Scheduler scheduler(pool, { interactive, batch });
+
+    std::atomic<int> batch_runs{0};
+    auto long_job = scheduler.submit(BATCH, [&](sqlitexx::DB& db) {
+        auto t = db.transaction();
+        db.prepare("INSERT INTO log VALUES ('batch');").exec();
+        ++batch_runs;
+        // long enough to be still running when the interactive job arrives
+        db.prepare("WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 3000000) SELECT count(*) FROM c;").exec();
+    });
+    while (!batch_runs) {
+        std::this_thread::yield();
+    }
+
+    auto short_job = scheduler.submit(INTERACTIVE, [&](sqlitexx::DB& db) {
+        db.prepare("INSERT INTO log VALUES ('interactive');").exec();
+    });
+    // the only connection is busy, so the batch job is interrupted and the interactive one goes first
+    CHECK(short_job.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+    short_job.get();
+    long_job.get();
+
+    CHECK_EQ(batch_runs.load(), 2);
+    CHECK_EQ(scheduler.stats(BATCH).preempted, 1u);
+    CHECK_EQ(scheduler.stats(BATCH).completed, 1u);
+    // the interrupted attempt was rolled back
+    CHECK_EQ(sqlitexx::DB{name}.prepare("SELECT group_concat(what) FROM log;").exec(), "interactive,batch");
+
+    // admission control: the queue of the class is limited
+    std::promise<void> gate;
+    std::shared_future<void> open = gate.get_future().share();
+    auto blocker = scheduler.submit(INTERACTIVE, [open](sqlitexx::DB&) { open.wait(); });
+    std::vector<std::future<void>> queued;
+    bool rejected = false;
+    for (int i = 0; i < 4 && !rejected; ++i) {
+        try {
+            queued.push_back(scheduler.submit(INTERACTIVE, [](sqlitexx::DB&) {}));
+        } catch (const sqlitexx::Error& e) {
+            CHECK_EQ(e.code(), SQLITE_BUSY);
+            rejected = true;
+        }
+    }
+    CHECK(rejected);
+    gate.set_value();
+    blocker.get();
+    for (auto& f : queued) {
+        f.get();
+    }
+    CHECK_EQ(scheduler.stats(INTERACTIVE).rejected, 1u);
+}
+
+SMALL_TEST_F(TestDBFixture, sqlitexx_scheduler_locks, "sqlitexx", "threads") {
+    std::string name = temp_file();
+    sqlitexx::DB{name}.prepare("CREATE TABLE log (what TEXT);").exec();
+    sqlitexx::Pool pool(2, [&] {
+        auto db = std::make_unique<sqlitexx::DB>(name);
+        sqlite3_busy_timeout(db->get(), 5000);
+        return db;
+    });
+
+    enum { INTERACTIVE, BATCH, MAINTENANCE };
+    sqlitexx::Scheduler::Class batch;
+    batch.preemption = sqlitexx::Scheduler::INTERRUPT;
+    std::atomic<bool> finished{false};
+    std::future<void> maintenance;
+    {
+        sqlitexx::Scheduler scheduler(pool, { {}, batch, {} });
+
+        std::atomic<int> batch_runs{0};
+        auto long_job = scheduler.submit(BATCH, [&](sqlitexx::DB& db) {
+            auto t = db.transaction();
+            db.prepare("INSERT INTO log VALUES ('batch');").exec();
+            ++batch_runs;
+            db.prepare("WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 3000000) SELECT count(*) FROM c;").exec();
+            t.commit();
+        });
+        while (!batch_runs) {
+            std::this_thread::yield();
+        }
+
+        // a connection is free, but the batch job holds the write lock: it gives way to the writer
+        auto start = std::chrono::steady_clock::now();
+        auto short_job = scheduler.submit(INTERACTIVE, [&](sqlitexx::DB& db) {
+            db.prepare("INSERT INTO log VALUES ('interactive');").exec();
+        });
+        CHECK(short_job.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+        short_job.get();
+        CHECK_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+        long_job.get();
+        CHECK_EQ(scheduler.stats(BATCH).preempted, 1u);
+        CHECK_EQ(scheduler.stats(BATCH).completed, 1u);
+        CHECK_EQ(sqlitexx::DB{name}.prepare("SELECT group_concat(what) FROM log;").exec(), "interactive,batch");
+
+        // failures are counted apart
+        auto bad = scheduler.submit(INTERACTIVE, [](sqlitexx::DB& db) {
+            db.prepare("INSERT INTO missing VALUES (1);").exec();
+        });
+        try {
+            bad.get();
+            CHECK(false);
+        } catch (const sqlitexx::Error&) {
+        }
+        CHECK_EQ(scheduler.stats(INTERACTIVE).failed, 1u);
+        CHECK_EQ(scheduler.stats(INTERACTIVE).completed, 1u);
+
+        // a running job of a NONE class is not interrupted by the shutdown
+        std::atomic<bool> started{false};
+        maintenance = scheduler.submit(MAINTENANCE, [&](sqlitexx::DB& db) {
+            started = true;
+            db.prepare("WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 300000) SELECT count(*) FROM c;").exec();
+            finished = true;
+        });
+        while (!started) {
+            std::this_thread::yield();
+        }
+    }
+    CHECK(finished.load());
+    maintenance.get();
+}
+
+struct sqlitexx_query_fixture : atto::unittest::fixture {
+    std::unique_ptr<sqlitexx::DB> db;
+
+    void setup() {
+        db = std::make_unique<sqlitexx::DB>();
+        db->prepare("CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT, text TEXT, x FLOAT, n NUMBER);").exec();
+
+        auto t = db->transaction();
+        for (int i = 0; i < 100000; ++i) {
+            db->prepare("INSERT INTO test VALUES(null, ?, ?, ?);", "t_" + std::to_string(i), 1.0 / (i + 1.0), i).exec();
+        }
+    }
+
+    void teardown() {
+        db.reset();
+    }
+};
+
+BENCH_F(sqlitexx_query_fixture, sqlitexx_select, "sqlitexx") {
+    auto q = db->prepare("SELECT count(*) FROM test WHERE n % 7 = 0;");
+    CHECK_EQ(q.exec(), "14286");
+}
+
+SMALL_TEST(sqlitexx_options, "sqlitexx") {
+    sqlitexx::DB db;
+    sqlitexx::DBOptions opts;
+    opts.temp_store = 2;
+    opts.cache_spill = 0;
+    opts.cache_size = -4096;
+    opts.worker_threads = 2;
+    db.configure(opts);
+    CHECK_EQ(db.prepare("PRAGMA temp_store;").exec(), "2");
+    CHECK_EQ(db.prepare("PRAGMA cache_spill;").exec(), "0");
+    CHECK_EQ(db.prepare("PRAGMA cache_size;").exec(), "-4096");
+    CHECK_EQ(db.worker_threads(), 2);
+
+    db.prepare("CREATE TABLE t (n INTEGER);").exec();
+    db.prepare("INSERT INTO t VALUES (3), (1), (2);").exec();
+    auto q = db.prepare("SELECT n FROM t ORDER BY n;");
+    while (q.step()) {
+    }
+    auto stats = q.stats(true);
+    CHECK_EQ(stats.sorts, 1);
+    CHECK_EQ(stats.fullscan_steps, 2);
+    CHECK_EQ(q.stats().sorts, 0);
+}
+
+SMALL_TEST_F(TestDBFixture, sqlitexx_migrations, "sqlitexx") {
+    sqlitexx::Migrations m;
+    m.step("CREATE TABLE events (id INTEGER PRIMARY KEY, data TEXT);")
+        .generated_column({ "events", "user", "TEXT", "json_extract(data, '$.user')" })
+        .index({ "events_user", "events", { "user" } })
+        .index({ "events_kind_time", "events", { "json_extract(data, '$.kind')", "json_extract(data, '$.time')" } })
+        .index({ "events_errors", "events", { "json_extract(data, '$.time')" }, "json_extract(data, '$.kind') = 'error'" })
+        .hot_query("SELECT id FROM events WHERE user = ?;", "events_user")
+        .hot_query("SELECT id FROM events WHERE json_extract(data, '$.kind') = ? ORDER BY json_extract(data, '$.time');", "events_kind_time")
+        // the planner prefers events_kind_time here, any index is fine
+        .hot_query("SELECT id FROM events WHERE json_extract(data, '$.kind') = 'error' AND json_extract(data, '$.time') > ?;");
+
+    std::string name = temp_file();
+    {
+        sqlitexx::DB db{name};
+        CHECK_EQ(m.apply(db), 5);
+        CHECK_EQ(sqlitexx::Migrations::current_version(db), 5);
+        std::ostringstream warnings;
+        CHECK_EQ(m.verify(db, &warnings).size(), 0u);
+        CHECK_EQ(warnings.str(), "");
+
+        db.prepare("INSERT INTO events (data) VALUES (?);", std::string("{\"user\": \"ann\", \"kind\": \"error\", \"time\": 5}")).exec();
+        CHECK_EQ(db.prepare("SELECT id FROM events WHERE user = 'ann';").exec(), "1");
+    }
+
+    // a reopened database is up to date, a new step is applied on top
+    sqlitexx::DB db{name};
+    CHECK_EQ(m.apply(db), 0);
+    m.step("CREATE TABLE other (x INTEGER);");
+    m.hot_query("SELECT x FROM other WHERE x = 1;");
+    m.hot_query("SELECT id FROM events WHERE json_extract(data, '$.kind') = 'info' AND json_extract(data, '$.time') > ?;", "events_errors");
+    CHECK_EQ(m.apply(db), 1);
+
+    std::ostringstream warnings;
+    auto problems = m.verify(db, &warnings);
+    CHECK_EQ(problems.size(), 2u);
+    CHECK_NE(problems[0].find("scans a whole table"), std::string::npos);
+    CHECK_NE(problems[1].find("does not use index events_errors"), std::string::npos);
+    CHECK_NE(warnings.str().find("warning"), std::string::npos);
+
+    CHECK(sqlitexx::explain(db, "SELECT id FROM events WHERE user = 'x';").uses_index("events_user"));
+    CHECK(!sqlitexx::explain(db, "SELECT id FROM events WHERE user = 'x';").uses_index("events"));
+    CHECK(sqlitexx::explain(db, "SELECT * FROM events;").full_scan());
+    CHECK(!sqlitexx::explain(db, "SELECT id FROM events WHERE user = 'x';").full_scan());
+    CHECK(!sqlitexx::explain(db, "SELECT 1;").full_scan());
+    // the index gives the order, but it is read whole
+    CHECK(sqlitexx::explain(db, "SELECT id FROM events ORDER BY user;").uses_index("events_user"));
+    CHECK(sqlitexx::explain(db, "SELECT id FROM events ORDER BY user;").full_scan());
+
+    // names are quoted, terms and expressions are taken as they are
+    sqlitexx::IndexSpec keywords("order by", "group", { "\"order\"" });
+    CHECK_EQ(keywords.sql(), "CREATE INDEX IF NOT EXISTS \"order by\" ON \"group\" (\"order\");");
+    sqlitexx::Migrations quoted;
+    quoted.step("CREATE TABLE \"group\" (data TEXT);")
+        .generated_column({ "group", "order", "TEXT", "json_extract(data, '$.order')" })
+        .index(keywords);
+    sqlitexx::DB mem;
+    CHECK_EQ(quoted.apply(mem), 3);
+    CHECK(sqlitexx::explain(mem, "SELECT data FROM \"group\" WHERE \"order\" = 'x';").uses_index("order by"));
+}
+
+SMALL_TEST(sqlitexx_json, "sqlitexx", "json") {
+    sqlitexx::DB db;
+    CHECK(sqlitexx::json_available(db));
+    CHECK_EQ(sqlitexx::jsonb_available(db), sqlite3_libversion_number() >= 3045000);
+
+    sqlitexx::JsonReader json(db);
+    std::string doc = "{\"id\": 7, \"name\": \"ann\", \"score\": 2.5, \"admin\": true, \"tags\": [1, 2], \"none\": null}";
+    CHECK_EQ(*json.get<int64_t>(doc, "$.id"), 7);
+    CHECK_EQ(*json.get<double>(doc, "$.id"), 7.0);
+    CHECK_EQ(*json.get<double>(doc, "$.score"), 2.5);
+    CHECK_EQ(*json.get<std::string>(doc, "$.name"), "ann");
+    CHECK_EQ(*json.get<bool>(doc, "$.admin"), true);
+    CHECK_EQ(*json.get<std::string>(doc, "$.tags"), "[1,2]");
+    CHECK(!json.get<int64_t>(doc, "$.missing"));
+    CHECK(!json.get<std::string>(doc, "$.none"));
+    try {
+        json.get<int64_t>(doc, "$.name");
+        CHECK(false);
+    } catch (const sqlitexx::Error& e) {
+        CHECK_EQ(e.code(), SQLITE_MISMATCH);
+    }
+    CHECK_EQ(*json.get<int64_t>(doc, "$.tags[1]"), 2);
+    CHECK_EQ(*json.get<std::string>("{\"a\": {\"b\": [false]}}", "$.a"), "{\"b\":[false]}");
+    CHECK_EQ(*json.get<bool>("{\"a\": {\"b\": [false]}}", "$.a.b[0]"), false);
+    try {
+        json.get<int64_t>("{\"id\": ", "$.id");
+        CHECK(false);
+    } catch (const sqlitexx::Error& e) {
+        CHECK_EQ(e.code(), SQLITE_ERROR);
+    }
+
+    db.prepare("CREATE TABLE events (id INTEGER, kind TEXT, payload, doc);").exec();
+    std::stringstream ndjson;
+    for (int i = 0; i < 2500; ++i) {
+        ndjson << "{\"id\": " << i << ", \"kind\": \"k" << i % 3 << "\", \"payload\": {\"n\": " << i << "}}\n";
+        if (i % 100 == 0) {
+            ndjson << "\n";
+        }
+    }
+    size_t rows = sqlitexx::load_ndjson(db, "events", ndjson, {
+        { "id", "$.id" }, { "kind", "$.kind" }, { "payload", "$.payload" }, { "doc", "$" },
+    });
+    CHECK_EQ(rows, 2500u);
+    CHECK_EQ(db.prepare("SELECT count(*) FROM events WHERE kind = 'k1';").exec(), "833");
+    CHECK_EQ(db.prepare("SELECT sum(json_extract(payload, '$.n')) FROM events;").exec(), "3123750");
+    CHECK_EQ(db.prepare("SELECT json_extract(doc, '$.kind') FROM events WHERE id = 5;").exec(), "k2");
+
+    auto q = db.prepare("SELECT kind FROM events WHERE id = 4;");
+    CHECK(q.step());
+    CHECK_EQ(q[0].as_text_view(), "k1");
+
+    // a line is one object: malformed lines, other values and several values on a line are rejected
+    const std::pair<const char*, const char*> rejected[] = {
+        { "{\"id\": 1}\n{\"id\": \n", "line 2 " },
+        { "{\"id\": 1}\n\n[1]\n", "line 3 " },
+        { "{\"id\": 1}\n{\"id\": 2},{\"id\": 3}\n", "line 2 " },
+        { "{\"id\": 1}\n\"],[\"\n", "line 2 " },
+    };
+    for (const auto& r : rejected) {
+        std::stringstream bad(r.first);
+        std::string error;
+        try {
+            sqlitexx::load_ndjson(db, "events", bad, { { "id", "$.id" } });
+        } catch (const sqlitexx::Error& e) {
+            CHECK_EQ(e.code(), SQLITE_MISMATCH);
+            error = e.what();
+        }
+        CHECK_NE(error.find(r.second), std::string::npos);
+    }
+    CHECK_EQ(db.prepare("SELECT count(*) FROM events;").exec(), "2500");
+
+    // names are quoted
+    db.prepare("CREATE TABLE \"my events\" (\"the id\" INTEGER);").exec();
+    std::stringstream quoted("{\"id\": 1}\n{\"id\": 2}\n");
+    CHECK_EQ(sqlitexx::load_ndjson(db, "my events", quoted, { { "the id", "$.id" } }), 2u);
+    CHECK_EQ(db.prepare("SELECT sum(\"the id\") FROM \"my events\";").exec(), "3");
+
+    // the batches bound without a copy are seen by the tracer
+    struct Capture : sqlitexx::Tracer {
+        std::vector<std::string> texts;
+
+        void statement(sqlite3_stmt*, const std::vector<Param>& params) override {
+            for (const auto& p : params) {
+                if (p.type == SQLITE_TEXT) {
+                    texts.push_back(p.s);
+                }
+            }
+        }
+    } capture;
+    sqlitexx::DB traced;
+    traced.trace(&capture);
+    traced.prepare("CREATE TABLE events (id INTEGER, kind TEXT);").exec();
+    std::stringstream two("{\"id\": 1, \"kind\": \"traced\"}\n");
+    CHECK_EQ(sqlitexx::load_ndjson(traced, "events", two, { { "id", "$.id" }, { "kind", "$.kind" } }), 1u);
+    CHECK(std::any_of(capture.texts.begin(), capture.texts.end(), [](const std::string& t) { return t.find("traced") != std::string::npos; }));
+}
+
+template <typename Encoder>
+static std::string stream_through_pipe(sqlitexx::DB& db, const std::string& sql, sqlitexx::StreamOptions opts, sqlitexx::StreamStats& stats, bool slow = false) {
+    int fds[2];
+    ASSERT(pipe(fds) == 0);
+    std::string received;
+    std::thread reader([&] {
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+            received.append(buf, n);
+            if (slow) {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+        }
+    });
+
+    auto st = db.prepare(sql);
+    try {
+        stats = sqlitexx::stream(st, fds[1], Encoder{}, opts);
+    } catch (...) {
+        close(fds[1]);
+        reader.join();
+        close(fds[0]);
+        throw;
+    }
+    close(fds[1]);
+    reader.join();
+    close(fds[0]);
+    return received;
+}
+
+SMALL_TEST(sqlitexx_stream, "sqlitexx", "stream") {
+    sqlitexx::DB db;
+    db.prepare("CREATE TABLE t (id INTEGER, name TEXT, x REAL, b BLOB);").exec();
+    db.prepare("INSERT INTO t VALUES (1, 'plain', 1.5, x'00ff'), (2, 'with, \"quotes\"\nand lines', 3.0, NULL), (-3, NULL, NULL, x'');").exec();
+    sqlitexx::StreamStats stats;
+
+    std::string csv = stream_through_pipe<sqlitexx::CsvEncoder>(db, "SELECT id, name, x FROM t;", {}, stats);
+    CHECK_EQ(csv, "id,name,x\r\n1,plain,1.5\r\n2,\"with, \"\"quotes\"\"\nand lines\",3.0\r\n-3,,\r\n");
+    CHECK_EQ(stats.rows, 3u);
+    CHECK_EQ(stats.bytes, csv.size());
+
+    // reals out of the int64_t range
+    csv = stream_through_pipe<sqlitexx::CsvEncoder>(db, "SELECT 1e300 AS a, 9e999 AS b, -9e999 AS c, 1e16 AS d;", {}, stats);
+    CHECK_EQ(csv, "a,b,c,d\r\n1e+300,inf,-inf,1e+16\r\n");
+
+    // SQLite parses the JSON output back
+    std::string json = stream_through_pipe<sqlitexx::JsonEncoder>(db, "SELECT * FROM t;", {}, stats);
+    CHECK_EQ(db.prepare("SELECT json_valid(?);", json).exec(), "1");
+    CHECK_EQ(db.prepare("SELECT group_concat(json_extract(value, '$.name'), '|') FROM json_each(?);", json).exec(), "plain|with, \"quotes\"\nand lines");
+    CHECK_EQ(db.prepare("SELECT json_extract(?, '$[0].b') || json_extract(?, '$[1].x');", json, json).exec(), "00ff3.0");
+
+    std::string bin = stream_through_pipe<sqlitexx::BinaryEncoder>(db, "SELECT id, b FROM t;", {}, stats);
+    std::string expected("SQLXROW1\x02\x02id\x01" "b", 14);
+    expected += std::string("\x01\x01\x02\x04\x02\x00\xff", 7);
+    expected += std::string("\x01\x01\x04\x05", 4);
+    expected += std::string("\x01\x01\x05\x04\x00", 5);
+    expected.push_back(0);
+    CHECK_EQ(bin, expected);
+
+    // a slow reader and small buffers: stepping pauses instead of buffering the whole result
+    std::string big = "WITH RECURSIVE c(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM c WHERE n < 100000) SELECT n, 'row ' || n FROM c;";
+    sqlitexx::StreamOptions small;
+    small.buffer_size = 8192;
+    small.buffers = 2;
+    std::string rows = stream_through_pipe<sqlitexx::CsvEncoder>(db, big, small, stats, true);
+    CHECK_EQ(stats.rows, 100000u);
+    CHECK_EQ(stats.bytes, rows.size());
+    CHECK_GT(stats.stalls, 0u);
+    CHECK_EQ(rows.substr(rows.size() - 36), "99999,row 99999\r\n100000,row 100000\r\n");
+
+    // a failed write abandons the query and leaves the statement reset
+    int fds[2];
+    ASSERT(pipe(fds) == 0);
+    auto abandoned = db.prepare(big);
+    int code = 0;
+    try {
+        sqlitexx::stream(abandoned, fds[0], sqlitexx::CsvEncoder{}, small);
+    } catch (const sqlitexx::Error& e) {
+        code = e.code();
+    }
+    close(fds[0]);
+    close(fds[1]);
+    CHECK_EQ(code, SQLITE_IOERR_WRITE);
+    CHECK(!sqlite3_stmt_busy(abandoned.get()));
+}
+
+SMALL_TEST_F(TestDBFixture, sqlitexx_write_behind, "sqlitexx", "threads") {
+    std::string name = temp_file();
+    sqlitexx::DB db{name};
+    db.prepare("PRAGMA journal_mode=WAL;").exec();
+    db.prepare("CREATE TABLE telemetry (source INTEGER, seq INTEGER, value REAL, note TEXT);").exec();
+
+    const int producers = 4;
+    const int per_producer = 25000;
+    {
+        sqlitexx::WriteBehind<int, int64_t, double, std::string> log(db, "INSERT INTO telemetry VALUES (?, ?, ?, ?);");
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; ++p) {
+            threads.emplace_back([&, p] {
+                for (int64_t i = 0; i < per_producer; ++i) {
+                    log.append(p, i, i * 0.5, "n");
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        // the barrier: everything appended so far is visible to other connections
+        log.flush();
+        CHECK_EQ(sqlitexx::DB{name}.prepare("SELECT count(*) FROM telemetry;").exec(), std::to_string(producers * per_producer));
+        CHECK_EQ(sqlitexx::DB{name}.prepare("SELECT count(DISTINCT source * 100000 + seq) FROM telemetry;").exec(), std::to_string(producers * per_producer));
+
+        log.append(7, 0, 0.0, "last");
+        log.close();
+        auto stats = log.stats();
+        CHECK_EQ(stats.appended, uint64_t(producers * per_producer + 1));
+        CHECK_EQ(stats.committed, stats.appended);
+        CHECK_EQ(stats.lost + stats.dropped + stats.failed, 0u);
+        CHECK(!log.append(8, 0, 0.0, "closed"));
+    }
+    CHECK_EQ(db.prepare("SELECT note FROM telemetry WHERE source = 7;").exec(), "last");
+
+    // flush() and close() wake the writer, they don't wait for the batch delay
+    {
+        sqlitexx::WriteBehindOptions opts;
+        opts.max_delay = std::chrono::seconds(10);
+        sqlitexx::WriteBehind<int, int64_t, double, std::string> log(db, "INSERT INTO telemetry VALUES (?, ?, ?, ?);", opts);
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < 3; ++round) {
+            log.append(8, round, 0.0, "");
+            log.flush();
+            CHECK_EQ(sqlitexx::DB{name}.prepare("SELECT count(*) FROM telemetry WHERE source = 8;").exec(), std::to_string(round + 1));
+        }
+        log.append(8, 3, 0.0, "");
+        log.close();
+        CHECK_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+        CHECK_EQ(log.stats().committed, 4u);
+    }
+
+    // producers wait for space in a full ring instead of dropping records
+    {
+        sqlitexx::WriteBehindOptions opts;
+        opts.capacity = 16;
+        opts.batch_size = 4;
+        sqlitexx::WriteBehind<int, int64_t, double, std::string> log(db, "INSERT INTO telemetry VALUES (?, ?, ?, ?);", opts);
+        std::vector<std::thread> threads;
+        std::atomic<int> queued{0};
+        for (int p = 0; p < 2; ++p) {
+            threads.emplace_back([&, p] {
+                for (int64_t i = 0; i < 1000; ++i) {
+                    queued += log.append(10 + p, i, 0.0, "");
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        log.close();
+        CHECK_EQ(queued.load(), 2000);
+        CHECK_EQ(log.stats().committed, 2000u);
+        CHECK_EQ(log.stats().dropped, 0u);
+    }
+
+    // closing without draining accounts for every record
+    {
+        sqlitexx::WriteBehindOptions opts;
+        opts.capacity = 1024;
+        opts.drop_when_full = true;
+        opts.max_delay = std::chrono::seconds(10);
+        opts.batch_size = 1 << 20;
+        sqlitexx::WriteBehind<int, int64_t, double, std::string> log(db, "INSERT INTO telemetry VALUES (?, ?, ?, ?);", opts);
+        for (int i = 0; i < 5000; ++i) {
+            log.append(9, i, 0.0, "");
+        }
+        log.close(false);
+        auto stats = log.stats();
+        CHECK_EQ(stats.appended, 5000u);
+        CHECK_GT(stats.dropped, 0u);
+        CHECK_EQ(stats.committed + stats.dropped + stats.failed + stats.lost, stats.appended);
+        CHECK_EQ(db.prepare("SELECT count(*) FROM telemetry WHERE source = 9;").exec(), std::to_string(stats.committed));
+    }
+}
+
+SMALL_TEST(sqlitexx_scratch, "sqlitexx") {
+    sqlitexx::DB db;
+    db.prepare("CREATE TABLE users (id INTEGER PRIMARY KEY, name TEXT);").exec();
+    db.prepare("INSERT INTO users WITH RECURSIVE c(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM c WHERE n < 1000) SELECT n, 'user ' || n FROM c;").exec();
+
+    sqlitexx::Scratch scratch(db);
+    CHECK_EQ(db.prepare("PRAGMA temp_store;").exec(), "2");
+    {
+        // step 1: ids computed in C++, joined without leaving SQLite afterwards
+        std::vector<int64_t> ids;
+        for (int64_t i = 3; i <= 1000; i += 3) {
+            ids.push_back(i);
+        }
+        auto selected = scratch.table("selected", { "id INTEGER PRIMARY KEY" });
+        CHECK_EQ(selected.insert(ids), ids.size());
+
+        // step 2: a typed range of tuples and a chained query over both scratch tables
+        std::vector<std::tuple<int64_t, std::string, double>> scores;
+        for (int64_t i = 1; i <= 100; ++i) {
+            scores.emplace_back(i * 2, "s" + std::to_string(i), i / 10.0);
+        }
+        auto scored = scratch.table("scored", { "id INTEGER", "tag TEXT", "score REAL" });
+        CHECK_EQ(scored.insert(scores), 100u);
+        CHECK_EQ(db.prepare("SELECT count(*) FROM users u JOIN " + selected.name() + " USING (id) JOIN " + scored.name() + " s USING (id);").exec(), "33");
+        CHECK_EQ(db.prepare("SELECT group_concat(tag) FROM " + scored.name() + " WHERE id IN (SELECT id FROM " + selected.name() + ") AND id < 40;").exec(), "s3,s6,s9,s12,s15,s18");
+
+        try {
+            scratch.table("selected", { "id INTEGER PRIMARY KEY" });
+            CHECK(false);
+        } catch (const sqlitexx::Error& e) {
+            CHECK_EQ(e.code(), SQLITE_MISUSE);
+        }
+    }
+
+    // reused empty, recreated when the columns change
+    {
+        auto selected = scratch.table("selected", { "id INTEGER PRIMARY KEY" });
+        CHECK_EQ(db.prepare("SELECT count(*) FROM " + selected.name() + ";").exec(), "0");
+        std::vector<std::pair<int, std::string>> rows = { { 1, "a" }, { 2, "b" } };
+        auto pairs = scratch.table("scored", { "id INTEGER", "tag TEXT" });
+        pairs.insert(rows);
+        CHECK_EQ(db.prepare("SELECT group_concat(tag) FROM " + pairs.name() + ";").exec(), "a,b");
+    }
+    CHECK_EQ(scratch.size(), 2u);
+    CHECK_EQ(db.prepare("SELECT count(*) FROM sqlite_temp_master WHERE type = 'table';").exec(), "2");
+
+    // rows must have a value for every column
+    {
+        auto pairs = scratch.table("scored", { "id INTEGER", "tag TEXT" });
+        std::vector<std::tuple<int, std::string, double>> wide = { { 1, "a", 0.5 } };
+        std::vector<int> narrow = { 1 };
+        for (int i = 0; i < 2; ++i) {
+            int code = 0;
+            try {
+                if (i) {
+                    pairs.insert(narrow);
+                } else {
+                    pairs.insert(wide);
+                }
+            } catch (const sqlitexx::Error& e) {
+                code = e.code();
+            }
+            CHECK_EQ(code, SQLITE_RANGE);
+        }
+        CHECK_EQ(db.prepare("SELECT count(*) FROM " + pairs.name() + ";").exec(), "0");
+    }
+
+    // names are quoted
+    {
+        std::vector<std::string> words = { "a", "b", "c" };
+        auto odd = scratch.table("order \"items\"", { "word TEXT" });
+        CHECK_EQ(odd.insert(words), 3u);
+        CHECK_EQ(db.prepare("SELECT group_concat(word) FROM " + odd.name() + ";").exec(), "a,b,c");
+    }
+    CHECK_EQ(scratch.size(), 3u);
+}
+
+struct sqlitexx_sort_fixture : atto::unittest::fixture {
+    std::unique_ptr<sqlitexx::DB> db;
+
+    void setup() {
+        sqlitexx::testing::Dataset ds({
+            ColumnSpec::uniform("k", 0, 1000000000),
+            ColumnSpec::text("s", 8, 24),
+        }, 7);
+        db = std::make_unique<sqlitexx::DB>();
+        sqlitexx::testing::load_cached(*db, { { "t", ds, 3000000 } }, sqlitexx::testing::TestDBFactory::temp_dir());
+    }
+
+    void teardown() {
+        db.reset();
+    }
+
+    void sort() {
+        auto q = db->prepare("SELECT k, s FROM t ORDER BY s, k;");
+        size_t rows = 0;
+        while (q.step()) {
+            ++rows;
+        }
+        CHECK_EQ(rows, 3000000u);
+
+        auto stats = q.stats();
+        CHECK_EQ(stats.sorts, 1);
+        std::cout << "worker threads " << db->worker_threads() << ", vm steps " << stats.vm_steps << std::endl;
+    }
+};
+
+// the sort does not fit the default 2MB cache and is merged from temp files
+BENCH_F(sqlitexx_sort_fixture, sqlitexx_sort_default, "sqlitexx", "sort") {
+    sqlitexx::DBOptions opts;
+    opts.worker_threads = 0;
+    db->configure(opts);
+    sort();
+}
+
+// sorted runs are produced and merged by helper threads, faster with free cores
+BENCH_F(sqlitexx_sort_fixture, sqlitexx_sort_threads, "sqlitexx", "sort") {
+    sqlitexx::DBOptions opts;
+    opts.worker_threads = std::max(2u, std::thread::hardware_concurrency()) - 1;
+    db->configure(opts);
+    sort();
+}
+
+struct utf_fixture : atto::unittest::fixture {
+    std::string text;
+    sqlitexx::utf::Isa isa;
+
+    void setup() {
+        // mostly ASCII with some accented letters, like names and addresses
+        const std::string line = "Rue de la Paix 12, 75002 Paris, France; Stra\xc3\x9f" "e 7, M\xc3\xbcnchen\n";
+        while (text.size() < (64u << 20)) {
+            text += line;
+        }
+        isa = sqlitexx::utf::isa();
+    }
+
+    void teardown() {
+        sqlitexx::utf::use_isa(isa);
+    }
+
+    void transcode(sqlitexx::utf::Isa with) {
+        sqlitexx::utf::use_isa(with);
+        std::u16string wide;
+        std::string narrow;
+        auto start = std::chrono::steady_clock::now();
+        CHECK(sqlitexx::utf::valid_utf8(text));
+        auto validated = std::chrono::steady_clock::now();
+        CHECK(sqlitexx::utf::utf8_to_utf16(text, wide));
+        CHECK(sqlitexx::utf::utf16_to_utf8(wide, narrow));
+        auto done = std::chrono::steady_clock::now();
+        CHECK_EQ(narrow.size(), text.size());
+        std::cout << "kernels " << sqlitexx::utf::isa() << ": validate " << std::chrono::duration<double>(validated - start).count() <<
+            " s, round trip " << std::chrono::duration<double>(done - validated).count() << " s for " << (text.size() >> 20) << " MiB" << std::endl;
+    }
+};
+
+BENCH_F(utf_fixture, utf_scalar, "utf") {
+    transcode(sqlitexx::utf::SCALAR);
+}
+
+BENCH_F(utf_fixture, utf_simd, "utf") {
+    transcode(isa);
+}
+
+// The same log documents stored as text and compressed: the file, the pages read by a scan
+// through a small cache and the time of the inserts and of the scan with decompression.
+struct compress_fixture : TestDBFixture {
+    void measure(bool compressed) {
+        const int rows = 200000;
+        std::string name = temp_file();
+        sqlitexx::DB db{name};
+        std::unique_ptr<sqlitexx::Compression> comp;
+        if (compressed) {
+            comp = std::make_unique<sqlitexx::Compression>(db);
+        }
+        db.prepare("CREATE TABLE logs (id INTEGER PRIMARY KEY, body);").exec();
+
+        const char* services[] = { "billing", "auth", "search", "mail" };
+        auto doc = [&](int i) {
+            return "{\"ts\": " + std::to_string(1700000000 + i) + ", \"level\": \"" + (i % 10 ? "info" : "warn") + "\", \"service\": \"" +
+                services[i % 4] + "\", \"request\": \"" + std::to_string(i * 2654435761u % 100000) + "\", \"message\": \"request handled in " +
+                std::to_string(i % 997) + " ms\", \"client\": {\"ip\": \"10.0." + std::to_string(i % 256) + "." +
+                std::to_string(i * 7 % 256) + "\", \"agent\": \"Mozilla/5.0 (X11; Linux x86_64)\"}}";
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            auto t = db.transaction();
+            auto ins = db.prepare("INSERT INTO logs VALUES (?, ?);");
+            for (int i = 0; i < rows; ++i) {
+                if (comp && i == 1000) {
+                    comp->train("logs", "SELECT body FROM logs;");
+                }
+                ins.bind(1, i);
+                if (comp) {
+                    comp->bind(ins, 2, doc(i), "logs");
+                } else {
+                    ins.bind(2, doc(i));
+                }
+                ins.exec();
+            }
+            t.commit();
+        }
+        auto inserted = std::chrono::steady_clock::now();
+
+        db.prepare("PRAGMA cache_size=-256;").exec();
+        auto q = db.prepare("SELECT body FROM logs;");
+        size_t bytes = 0;
+        for (auto& row : q) {
+            bytes += comp ? comp->read(row[0]).size() : row[0].as_text_view().size();
+        }
+        auto scanned = std::chrono::steady_clock::now();
+        int reads = 0;
+        int unused = 0;
+        sqlite3_db_status(db.get(), SQLITE_DBSTATUS_CACHE_MISS, &reads, &unused, 0);
+
+        std::cout << (comp ? comp->codec_name() : "plain") << ": " << db.prepare("PRAGMA page_count;").exec() << " pages, " << reads <<
+            " page reads, insert " << std::chrono::duration<double>(inserted - start).count() << " s, scan " <<
+            std::chrono::duration<double>(scanned - inserted).count() << " s for " << (bytes >> 20) << " MiB of documents" << std::endl;
+    }
+};
+
+BENCH_F(compress_fixture, compress_plain, "compress") {
+    measure(false);
+}
+
+BENCH_F(compress_fixture, compress_codec, "compress") {
+    measure(true);
+}
+
+SMALL_TEST_F(TestDBFixture, datagen, "datagen") {
+    sqlitexx::testing::Dataset ds({
+        ColumnSpec::sequence("id"),
+        ColumnSpec::zipf("k", 1000, 1.1),
+        ColumnSpec::uniform("u", -5, 5).nulls(0.25),
+        ColumnSpec::real("x"),
+        ColumnSpec::text("s", 0, 16),
+        ColumnSpec::blob("b", 4, 4),
+    }, 42);
+
+    // a batch does not depend on the batches generated before it
+    auto whole = ds.batch(0, 2000);
+    auto part = ds.batch(1000, 1000);
+    ASSERT(whole.columns[1].ints[1500] == part.columns[1].ints[500]);
+    ASSERT(whole.columns[2].nulls[1999] == part.columns[2].nulls[999]);
+    size_t len1 = 0, len2 = 0;
+    ASSERT(std::string(whole.columns[4].bytes(1234, len1), len1) == std::string(part.columns[4].bytes(234, len2), len2));
+    ASSERT(sqlitexx::testing::Dataset(ds.columns(), 43).fingerprint() != ds.fingerprint());
+
+    sqlitexx::DB db{temp_file()};
+    std::string image = sqlitexx::testing::load_cached(db, { { "t", ds, 20000 } }, TestDBFactory::temp_dir());
+    DEFER(std::remove(image.c_str()));
+
+    CHECK_EQ(db.prepare("SELECT count(*), min(id), max(id) FROM t;").exec(), "20000");
+    CHECK_EQ(db.prepare("SELECT count(*) FROM t WHERE u < -5 OR u > 5 OR k < 1 OR k > 1000;").exec(), "0");
+    CHECK_EQ(db.prepare("SELECT count(*) FROM t WHERE length(b) <> 4 OR length(s) > 16;").exec(), "0");
+    // Zipf: the first key alone is about 1/H(1000, 1.1) of all rows, NULLs are close to the ratio
+    int top = std::stoi(db.prepare("SELECT count(*) FROM t WHERE k = 1;").exec());
+    EXPECT(top > 3000 && top < 4500);
+    int nulls = std::stoi(db.prepare("SELECT count(*) FROM t WHERE u IS NULL;").exec());
+    EXPECT(nulls > 4500 && nulls < 5500);
+
+    // the second load comes from the image and is the same data
+    sqlitexx::DB copy;
+    CHECK_EQ(sqlitexx::testing::load_cached(copy, { { "t", ds, 20000 } }, TestDBFactory::temp_dir()), image);
+    CHECK_EQ(copy.prepare("SELECT sum(k * 7 + coalesce(u, 100)) FROM t;").exec(), db.prepare("SELECT sum(k * 7 + coalesce(u, 100)) FROM t;").exec());
+
+    // other images are evicted beyond the cache size
+    std::string dir = TestDBFactory::temp_dir() + "/datagen-cache-XXXXXX";
+    ASSERT(mkdtemp(&dir[0]) != nullptr);
+    DEFER(rmdir(dir.c_str()));
+    sqlitexx::DB small1, small2;
+    std::string first = sqlitexx::testing::load_cached(small1, { { "t", ds, 1000 } }, dir);
+    std::string second = sqlitexx::testing::load_cached(small2, { { "t", ds, 2000 } }, dir, 1);
+    CHECK_NE(access(first.c_str(), F_OK), 0);
+    CHECK_EQ(access(second.c_str(), F_OK), 0);
+    CHECK_EQ(sqlitexx::testing::trim_cache(dir, 0), 1u);
+}
+
+struct datagen_fixture : atto::unittest::fixture {
+    std::unique_ptr<sqlitexx::DB> db;
+
+    void setup() {
+        // built once per cache directory, later runs start from the stored image
+        sqlitexx::testing::Dataset ds({
+            ColumnSpec::sequence("id"),
+            ColumnSpec::zipf("customer", 100000),
+            ColumnSpec::uniform("amount", 1, 10000),
+            ColumnSpec::text("note", 0, 32).nulls(0.5),
+        }, 1);
+        db = std::make_unique<sqlitexx::DB>();
+        sqlitexx::testing::load_cached(*db, { { "orders", ds, 1000000 } }, sqlitexx::testing::TestDBFactory::temp_dir());
+    }
+
+    void teardown() {
+        db.reset();
+    }
+};
+
+BENCH_F(datagen_fixture, datagen_group_by, "datagen") {
+    auto q = db->prepare("SELECT count(*) FROM (SELECT customer, sum(amount) FROM orders GROUP BY customer);");
+    CHECK(!q.exec().empty());
+}
+
 #if 0
 
 SMALL_TEST(stdoutstream) {
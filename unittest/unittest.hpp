@@ -8,6 +8,60 @@
 #include <memory>
 #include <cstring>
 #include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <random>
+#include <regex>
+#include <stdexcept>
+#include <initializer_list>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#define ATTO_HAVE_PROFILER 1
+#include <csignal>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#else
+#define ATTO_HAVE_PROFILER 0
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ATTO_HAVE_FORK 1
+#include <cerrno>
+#include <unistd.h>
+#include <sys/wait.h>
+#else
+#define ATTO_HAVE_FORK 0
+#endif
+
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define ATTO_SANITIZER 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) || __has_feature(memory_sanitizer)
+#define ATTO_SANITIZER 1
+#endif
+#endif
+#ifndef ATTO_SANITIZER
+#define ATTO_SANITIZER 0
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ATTO_LIKELY(x) __builtin_expect(!!(x), 1)
+#define ATTO_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#define ATTO_COLD __attribute__((cold, noinline))
+#define ATTO_ALWAYS_INLINE __attribute__((always_inline))
+#else
+#define ATTO_LIKELY(x) (x)
+#define ATTO_UNLIKELY(x) (x)
+#define ATTO_COLD
+#define ATTO_ALWAYS_INLINE
+#endif
 
 // Atto Unit Test framework
 
@@ -17,12 +71,13 @@ namespace atto {
 
 		template <typename T>
 		struct can_print {
-			template <typename A, decltype(std::declval<std::ostream>() << std::declval<A>())>
-			static std::true_type check(A& val);
+			template <typename A, typename = decltype(std::declval<std::ostream&>() << std::declval<A>())>
+			static std::true_type check(int);
 
+			template <typename A>
 			static std::false_type check(...);
 
-			using type = decltype(check(std::declval<T>()));
+			using type = decltype(check<T>(0));
 		};
 
 		template <typename T>
@@ -47,9 +102,53 @@ namespace atto {
         class unit_test_base {
         public:
             virtual ~unit_test_base() = default;
+            virtual void setup() {
+            }
             virtual void run() = 0;
+            virtual void teardown() {
+            }
+        };
+
+        //! Base class for test fixtures used with SMALL_TEST_F/LARGE_TEST_F/BENCH_F.
+        //! setup() and teardown() run outside of the timed region; a benchmark fixture is
+        //! set up once and shared by all iterations.
+        struct fixture {
+            void setup() {
+            }
+
+            void teardown() {
+            }
+        };
+
+        //! Scope guard used by DEFER.
+        template <typename F>
+        class deferred {
+            F func_;
+            bool active_ = true;
+        public:
+            explicit deferred(F func) : func_(std::move(func)) {
+            }
+
+            deferred(const deferred&) = delete;
+            deferred& operator = (const deferred&) = delete;
+            deferred& operator = (deferred&&) = delete;
+
+            deferred(deferred&& d) : func_(std::move(d.func_)), active_(d.active_) {
+                d.active_ = false;
+            }
+
+            ~deferred() {
+                if (active_) {
+                    func_();
+                }
+            }
         };
 
+        template <typename F>
+        deferred<F> make_deferred(F func) {
+            return deferred<F>(std::move(func));
+        }
+
         enum {
             LARGE_TEST = 1,
             BENCHMARK = 2
@@ -66,9 +165,307 @@ namespace atto {
             }
         };
 
+        //! number of failed EXPECT* checks in this process
+        inline std::atomic<unsigned>& expect_failures() {
+            static std::atomic<unsigned> failures{0};
+            return failures;
+        }
+
+        ATTO_COLD inline void check_failed(bool fatal, int line, const char* expr) {
+            if (fatal) {
+                throw ::atto::unittest::error(line, expr);
+            }
+            ++expect_failures();
+            std::cerr << "[EXPECTATION FAILED " << expr << " at line " << line << "]" << std::endl;
+        }
+
+        template <typename A, typename B>
+        ATTO_COLD void compare_failed(bool fatal, int line, const char* expr, const A& a, const char* op, const B& b) {
+            println_to(std::cerr, "Comparation error: ", a, " ", op, " ", b, " is false");
+            check_failed(fatal, line, expr);
+        }
+
+        // Cheap checks for hot loops: the operands are taken by reference, nothing is constructed
+        // and nothing is printed unless the comparison fails.
+#define ATTO_DEFINE_CHECK_OP(name, op) \
+        template <typename A, typename B> \
+        ATTO_ALWAYS_INLINE inline void name(bool fatal, int line, const char* expr, const A& a, const B& b) { \
+            if (ATTO_UNLIKELY(!(a op b))) { \
+                compare_failed(fatal, line, expr, a, #op, b); \
+            } \
+        }
+
+        ATTO_DEFINE_CHECK_OP(check_eq, ==)
+        ATTO_DEFINE_CHECK_OP(check_ne, !=)
+        ATTO_DEFINE_CHECK_OP(check_lt, <)
+        ATTO_DEFINE_CHECK_OP(check_le, <=)
+        ATTO_DEFINE_CHECK_OP(check_gt, >)
+        ATTO_DEFINE_CHECK_OP(check_ge, >=)
+#undef ATTO_DEFINE_CHECK_OP
+
+#if ATTO_HAVE_PROFILER
+        //! In-process SIGPROF sampling profiler. Stacks are captured by walking frame pointers, so build
+        //! benchmarks with -fno-omit-frame-pointer (and -rdynamic to get symbol names for the executable).
+        class sampling_profiler {
+            enum { max_depth = 64, max_samples = 1 << 16 };
+
+            struct sample {
+                unsigned depth;
+                void* frames[max_depth];
+            };
+
+            std::vector<sample> samples_;
+            std::atomic<unsigned> count_{0};
+            std::atomic<unsigned> dropped_{0};
+            uintptr_t stack_lo_ = 0;
+            uintptr_t stack_hi_ = 0;
+            int hz_;
+            struct sigaction old_action_;
+
+            static std::atomic<sampling_profiler*>& active() {
+                static std::atomic<sampling_profiler*> p{nullptr};
+                return p;
+            }
+
+            static void handler(int, siginfo_t*, void* ctx) {
+                sampling_profiler* self = active().load(std::memory_order_acquire);
+                if (self) {
+                    self->capture(static_cast<ucontext_t*>(ctx));
+                }
+            }
+
+            // Called from the signal handler: must be async-signal-safe.
+            void capture(ucontext_t* uc) {
+                unsigned idx = count_.fetch_add(1, std::memory_order_relaxed);
+                if (idx >= samples_.size()) {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+
+                sample& s = samples_[idx];
+#if defined(__x86_64__)
+                uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+                uintptr_t fp = uc->uc_mcontext.gregs[REG_RBP];
+#else
+                uintptr_t pc = uc->uc_mcontext.pc;
+                uintptr_t fp = uc->uc_mcontext.regs[29];
+#endif
+                unsigned depth = 0;
+                s.frames[depth++] = reinterpret_cast<void*>(pc);
+
+                // Samples from other threads (e.g. sqlite sorter workers) only keep their leaf frame.
+                while (depth < max_depth && fp >= stack_lo_ && fp + 2 * sizeof(uintptr_t) <= stack_hi_ && fp % sizeof(uintptr_t) == 0) {
+                    const uintptr_t* frame = reinterpret_cast<const uintptr_t*>(fp);
+                    uintptr_t next = frame[0];
+                    uintptr_t ret = frame[1];
+                    if (!ret) {
+                        break;
+                    }
+                    // return address points after the call instruction
+                    s.frames[depth++] = reinterpret_cast<void*>(ret - 1);
+                    if (next <= fp) {
+                        break;
+                    }
+                    fp = next;
+                }
+
+                s.depth = depth;
+            }
+
+            static std::string symbol_name(void* addr) {
+                Dl_info info;
+                bool found = dladdr(addr, &info) != 0;
+                if (found && info.dli_sname) {
+                    int status = 0;
+                    char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+                    std::string res = (status == 0 && demangled) ? demangled : info.dli_sname;
+                    std::free(demangled);
+                    return res;
+                }
+
+                // unresolved symbols are printed as module+offset, suitable for addr2line
+                std::ostringstream ss;
+                if (found && info.dli_fname) {
+                    const char* base = std::strrchr(info.dli_fname, '/');
+                    ss << (base ? base + 1 : info.dli_fname) << "+0x" << std::hex
+                       << (reinterpret_cast<uintptr_t>(addr) - reinterpret_cast<uintptr_t>(info.dli_fbase));
+                } else {
+                    ss << "0x" << std::hex << reinterpret_cast<uintptr_t>(addr);
+                }
+                return ss.str();
+            }
+
+        public:
+            explicit sampling_profiler(int hz) : samples_(max_samples), hz_(hz) {
+                pthread_attr_t attr;
+                if (!pthread_getattr_np(pthread_self(), &attr)) {
+                    void* addr = nullptr;
+                    size_t size = 0;
+                    if (!pthread_attr_getstack(&attr, &addr, &size)) {
+                        stack_lo_ = reinterpret_cast<uintptr_t>(addr);
+                        stack_hi_ = stack_lo_ + size;
+                    }
+                    pthread_attr_destroy(&attr);
+                }
+            }
+
+            sampling_profiler(const sampling_profiler&) = delete;
+            sampling_profiler& operator = (const sampling_profiler&) = delete;
+
+            ~sampling_profiler() {
+                stop();
+            }
+
+            void start() {
+                count_ = 0;
+                dropped_ = 0;
+                active().store(this, std::memory_order_release);
+
+                struct sigaction sa;
+                std::memset(&sa, 0, sizeof(sa));
+                sa.sa_sigaction = &sampling_profiler::handler;
+                sa.sa_flags = SA_SIGINFO | SA_RESTART;
+                sigemptyset(&sa.sa_mask);
+                sigaction(SIGPROF, &sa, &old_action_);
+
+                struct itimerval tv;
+                tv.it_interval.tv_sec = 0;
+                tv.it_interval.tv_usec = 1000000 / hz_;
+                tv.it_value = tv.it_interval;
+                setitimer(ITIMER_PROF, &tv, nullptr);
+            }
+
+            void stop() {
+                if (active().load() != this) {
+                    return;
+                }
+
+                struct itimerval tv;
+                std::memset(&tv, 0, sizeof(tv));
+                setitimer(ITIMER_PROF, &tv, nullptr);
+                // a SIGPROF still pending would kill the process under the default action; ignoring
+                // the signal discards it
+                struct sigaction ignore;
+                std::memset(&ignore, 0, sizeof(ignore));
+                ignore.sa_handler = SIG_IGN;
+                sigemptyset(&ignore.sa_mask);
+                sigaction(SIGPROF, &ignore, nullptr);
+                sigaction(SIGPROF, &old_action_, nullptr);
+                active().store(nullptr, std::memory_order_release);
+            }
+
+            unsigned samples() const {
+                return std::min<unsigned>(count_.load(), samples_.size());
+            }
+
+            unsigned dropped() const {
+                return dropped_.load();
+            }
+
+            //! write stacks in the folded format of flamegraph.pl: "root;...;leaf count"
+            void write_folded(std::ostream& out) const {
+                std::map<std::vector<void*>, unsigned> stacks;
+                for (unsigned i = 0; i < samples(); ++i) {
+                    const sample& s = samples_[i];
+                    stacks[std::vector<void*>(s.frames, s.frames + s.depth)]++;
+                }
+
+                // different addresses inside the same function collapse into one frame
+                std::map<void*, std::string> names;
+                std::map<std::string, unsigned> folded;
+                for (const auto& st : stacks) {
+                    std::string line;
+                    for (auto it = st.first.rbegin(); it != st.first.rend(); ++it) {
+                        auto& name = names[*it];
+                        if (name.empty()) {
+                            name = symbol_name(*it);
+                        }
+                        if (it != st.first.rbegin()) {
+                            line += ';';
+                        }
+                        line += name;
+                    }
+                    folded[line] += st.second;
+                }
+
+                for (const auto& f : folded) {
+                    out << f.first << ' ' << f.second << '\n';
+                }
+            }
+        };
+#endif
+
+        //! shell-like wildcard match: '*', '?' and character classes '[a-z]', '[!abc]'
+        inline bool glob_match(const char* pat, const char* str) {
+            const char* star_pat = nullptr;
+            const char* star_str = nullptr;
+
+            while (*str) {
+                if (*pat == '*') {
+                    star_pat = ++pat;
+                    star_str = str;
+                    continue;
+                }
+
+                if (*pat == '[') {
+                    const char* p = pat + 1;
+                    bool negate = *p == '!';
+                    if (negate) {
+                        ++p;
+                    }
+                    bool found = false;
+                    for (bool first = true; *p && (first || *p != ']'); first = false) {
+                        if (p[1] == '-' && p[2] && p[2] != ']') {
+                            found = found || (*str >= p[0] && *str <= p[2]);
+                            p += 3;
+                        } else {
+                            found = found || *str == *p;
+                            ++p;
+                        }
+                    }
+                    if (*p == ']' && found != negate) {
+                        pat = p + 1;
+                        ++str;
+                        continue;
+                    }
+                } else if (*pat && (*pat == '?' || *pat == *str)) {
+                    ++pat;
+                    ++str;
+                    continue;
+                }
+
+                if (!star_pat) {
+                    return false;
+                }
+                pat = star_pat;
+                str = ++star_str;
+            }
+
+            while (*pat == '*') {
+                ++pat;
+            }
+            return !*pat;
+        }
+
         class test_storage {
-            std::map<std::string, std::pair<unsigned, std::unique_ptr<unit_test_base>>> tests_;
+            struct test_entry {
+                unsigned flags = 0;
+                std::vector<std::string> tags;
+                std::unique_ptr<unit_test_base> test;
+
+                bool has_tag(const std::string& tag) const {
+                    return std::find(tags.begin(), tags.end(), tag) != tags.end();
+                }
+            };
+
+            std::map<std::string, test_entry> tests_;
+            uint64_t seed_ = 0;
             bool verbose_ = false;
+            std::string profile_dir_;
+            int profile_hz_ = 997;
+            unsigned iterations_ = 1;
+            bool fork_ = ATTO_SANITIZER != 0;
+            std::string report_dir_;
 
             void usage(std::ostream& out, const char* prog) {
                 out << "Usage: " << prog << " [-l] [-a] [test1 [test2...]]" << std::endl;
@@ -76,8 +473,21 @@ namespace atto {
                 out << "   --list, -l         print list of available tests and exit." << std::endl;
                 out << "   --all, -a          run all tests (by default only small)." << std::endl;
                 out << "   --benchmarks, -b   run also benchmarks." << std::endl;
+                out << "   --iterations, -n N run each benchmark N times (fixture is set up once)." << std::endl;
                 out << "   --verbose, -v      be a little more verbose." << std::endl;
-                out << "test1, test2, ... list of tests to run" << std::endl;
+                out << "   --fork, -f         run each test in a child process (default in sanitizer builds)." << std::endl;
+                out << "   --no-fork          run all tests in this process." << std::endl;
+                out << "   --report-dir DIR   save output of failed forked tests to DIR/<name>.log." << std::endl;
+                out << "   --profile, -p DIR  sample benchmarks and write DIR/<name>.folded stacks." << std::endl;
+                out << "   --profile-hz HZ    sampling frequency for --profile (default 997)." << std::endl;
+                out << "   --regex, -r RE     run tests whose names match regular expression RE." << std::endl;
+                out << "   --tag, -t TAG      run tests tagged with TAG." << std::endl;
+                out << "   --skip-tag TAG     do not run tests tagged with TAG." << std::endl;
+                out << "   --shard I/N        run only the I-th of N deterministic shards (0 <= I < N)." << std::endl;
+                out << "   --repeat N         run selected tests N times." << std::endl;
+                out << "   --shuffle          shuffle tests on every run (implied by --repeat)." << std::endl;
+                out << "   --seed S           seed for --shuffle and randomized tests." << std::endl;
+                out << "test1, test2, ... list of tests to run, glob patterns (*, ?, [...]) are allowed" << std::endl;
             }
 
             class hwtimer {
@@ -143,83 +553,368 @@ namespace atto {
                 }
             };
 
+#if ATTO_HAVE_PROFILER
+            void write_profile(const std::string& name, const sampling_profiler& profiler) {
+                std::string path = profile_dir_ + "/" + name + ".folded";
+                std::ofstream out(path);
+                if (!out) {
+                    std::cerr << "Error: can't write profile to " << path << std::endl;
+                    return;
+                }
+
+                profiler.write_folded(out);
+                if (verbose_ || profiler.dropped()) {
+                    std::cout << "[PROFILE " << name << ": " << profiler.samples() << " samples";
+                    if (profiler.dropped()) {
+                        std::cout << ", " << profiler.dropped() << " dropped";
+                    }
+                    std::cout << " in " << path << "]" << std::endl;
+                }
+            }
+#endif
+
+            static unsigned positive(const std::string& value) {
+                int n = std::stoi(value);
+                if (n <= 0) {
+                    throw std::invalid_argument("expected positive number, got " + value);
+                }
+                return n;
+            }
+
+            static bool is_pattern(const std::string& s) {
+                return s.find_first_of("*?[") != std::string::npos;
+            }
+
+            template <typename F>
+            bool guarded(const std::string& name, const char* stage, F&& f) {
+                try {
+                    f();
+                    return true;
+                } catch (const error& err) {
+                    std::cerr << "[FAILED " << name << stage << ": " << err.what() << " at line " << err.line() << "]" << std::endl;
+                } catch (const std::exception& err) {
+                    std::cerr << "[FAILED " << name << stage << ": unexpected exception: " << err.what() << "]" << std::endl;
+                }
+                return false;
+            }
+
+            bool run_test(const std::string& name, unsigned flags, unit_test_base& test) {
+                // fixture setup and teardown are not timed and are shared by all iterations
+                if (!guarded(name, " setup", [&]() { test.setup(); })) {
+                    return false;
+                }
+
+                unsigned iterations = (flags & BENCHMARK) ? iterations_ : 1;
+
+#if ATTO_HAVE_PROFILER
+                std::unique_ptr<sampling_profiler> profiler;
+                if (!profile_dir_.empty() && (flags & BENCHMARK)) {
+                    profiler = std::make_unique<sampling_profiler>(profile_hz_);
+                    profiler->start();
+                }
+#endif
+
+                unsigned expected_before = expect_failures().load();
+                bool ok_expectations = true;
+                hwtimer timer;
+                bool ok = guarded(name, "", [&]() {
+                    for (unsigned i = 0; i < iterations; ++i) {
+                        test.run();
+                    }
+                    double delta = timer.delta();
+                    unsigned failures = expect_failures().load() - expected_before;
+                    if (failures) {
+                        std::cerr << "[FAILED " << name << ": " << failures << " expectations failed]" << std::endl;
+                        ok_expectations = false;
+                        return;
+                    }
+                    std::cout << "[OK " << name << " in " << delta << " seconds";
+                    if (iterations > 1) {
+                        std::cout << ", " << delta / iterations << " per iteration";
+                    }
+                    std::cout << "]" << std::endl;
+                });
+
+#if ATTO_HAVE_PROFILER
+                if (profiler) {
+                    profiler->stop();
+                    write_profile(name, *profiler);
+                }
+#endif
+
+                return guarded(name, " teardown", [&]() { test.teardown(); }) && ok && ok_expectations;
+            }
+
+#if ATTO_HAVE_FORK
+            enum { exit_test_failed = 97 };
+
+            //! Run test in a child process. Its stderr (where sanitizers write their reports) is collected
+            //! and printed after the test, so a crash or a sanitizer abort only fails this test.
+            bool run_forked(const std::string& name, unsigned flags, unit_test_base& test) {
+                char path[] = "/tmp/atto-report-XXXXXX";
+                int fd = mkstemp(path);
+                if (fd < 0) {
+                    std::cerr << "Warning: can't create report file, running " << name << " in process" << std::endl;
+                    return run_test(name, flags, test);
+                }
+                unlink(path);
+
+                std::cout.flush();
+                std::cerr.flush();
+
+                pid_t pid = fork();
+                if (pid < 0) {
+                    close(fd);
+                    std::cerr << "Warning: fork failed, running " << name << " in process" << std::endl;
+                    return run_test(name, flags, test);
+                }
+
+                if (pid == 0) {
+                    dup2(fd, 2);
+                    close(fd);
+                    bool ok = run_test(name, flags, test);
+                    std::cout.flush();
+                    std::cerr.flush();
+                    // exit() and not _exit(): leak and race reports are produced by atexit handlers
+                    std::exit(ok ? 0 : exit_test_failed);
+                }
+
+                int status = 0;
+                while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+                }
+
+                std::string report;
+                char buf[4096];
+                ssize_t n;
+                lseek(fd, 0, SEEK_SET);
+                while ((n = read(fd, buf, sizeof(buf))) > 0) {
+                    report.append(buf, n);
+                }
+                close(fd);
+
+                bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+                if (!report.empty()) {
+                    std::cerr << report;
+                    if (!ok && !report_dir_.empty()) {
+                        std::ofstream(report_dir_ + "/" + name + ".log") << report;
+                    }
+                }
+
+                if (WIFSIGNALED(status)) {
+                    std::cerr << "[FAILED " << name << ": killed by signal " << WTERMSIG(status) << "]" << std::endl;
+                } else if (!ok && WEXITSTATUS(status) != exit_test_failed) {
+                    std::cerr << "[FAILED " << name << ": exit code " << WEXITSTATUS(status)
+                              << (ATTO_SANITIZER ? " (sanitizer report above)" : "") << "]" << std::endl;
+                }
+
+                return ok;
+            }
+#endif
+
         public:
             int run(int argc, const char* argv[]) {
-                std::vector<std::string> tests_to_run;
+                std::vector<std::string> patterns;
+                std::vector<std::regex> regexes;
+                std::vector<std::string> tags;
+                std::vector<std::string> skip_tags;
                 bool all = false;
                 bool benchmarks = false;
+                bool list = false;
+                bool shuffle = false;
+                bool seeded = false;
+                unsigned shard = 0;
+                unsigned shards = 1;
+                unsigned repeat = 1;
+                std::string value;
 
                 Args args(argc, argv);
 
-                while (args) {
-                    if (args.arg("-h", "--help")) {
-                        usage(std::cout, argv[0]);
-                        return 0;
-                    } else if (args.arg("-a", "--all")) {
-                        all = true;
-                    } else if (args.arg("-b", "--benchmarks")) {
-                        benchmarks = true;
-                    } else if (args.arg("-l", "--list")) {
-                        std::cout << "Available tests {" << std::endl;
-                        for (const auto& t : tests_) {
-                            std::cout << "    " << t.first << std::endl;
+                try {
+                    while (args) {
+                        if (args.arg("-h", "--help")) {
+                            usage(std::cout, argv[0]);
+                            return 0;
+                        } else if (args.arg("-a", "--all")) {
+                            all = true;
+                        } else if (args.arg("-b", "--benchmarks")) {
+                            benchmarks = true;
+                        } else if (args.arg("-l", "--list")) {
+                            list = true;
+                        } else if (args.arg("-n", "--iterations", value)) {
+                            iterations_ = positive(value);
+                        } else if (args.arg("-v", "--verbose")) {
+                            verbose_ = true;
+                        } else if (args.arg("-f", "--fork")) {
+#if ATTO_HAVE_FORK
+                            fork_ = true;
+#else
+                            std::cerr << "Warning: fork mode is not supported on this platform" << std::endl;
+#endif
+                        } else if (args.arg("--no-fork", "--no-fork")) {
+                            fork_ = false;
+                        } else if (args.arg("--report-dir", "--report-dir", report_dir_)) {
+                        } else if (args.arg("-p", "--profile", profile_dir_)) {
+#if !ATTO_HAVE_PROFILER
+                            std::cerr << "Warning: profiling is not supported on this platform" << std::endl;
+#endif
+                        } else if (args.arg("--profile-hz", "--profile-hz", value)) {
+                            profile_hz_ = positive(value);
+                            if (profile_hz_ > 1000000) {
+                                throw std::invalid_argument("invalid profiling frequency " + value);
+                            }
+                        } else if (args.arg("-r", "--regex", value)) {
+                            regexes.emplace_back(value);
+                        } else if (args.arg("-t", "--tag", value)) {
+                            tags.push_back(value);
+                        } else if (args.arg("--skip-tag", "--skip-tag", value)) {
+                            skip_tags.push_back(value);
+                        } else if (args.arg("--shard", "--shard", value)) {
+                            size_t slash = value.find('/');
+                            if (slash == std::string::npos) {
+                                throw std::invalid_argument("shard must be I/N, got " + value);
+                            }
+                            shard = std::stoul(value.substr(0, slash));
+                            shards = positive(value.substr(slash + 1));
+                            if (shard >= shards) {
+                                throw std::invalid_argument("shard index out of range in " + value);
+                            }
+                        } else if (args.arg("--repeat", "--repeat", value)) {
+                            repeat = positive(value);
+                            shuffle = shuffle || repeat > 1;
+                        } else if (args.arg("--shuffle", "--shuffle")) {
+                            shuffle = true;
+                        } else if (args.arg("--seed", "--seed", value)) {
+                            seed_ = std::stoull(value);
+                            seeded = true;
+                        } else {
+                            std::string t;
+                            args.arg(t);
+                            if (!is_pattern(t) && !tests_.count(t)) {
+                                std::cerr << "Error: unknown test name `" << t << "'" << std::endl;
+                                return 1;
+                            }
+                            patterns.push_back(t);
                         }
-                        std::cout << "}" << std::endl;
-                    } else if (args.arg("-v", "--verbose")) {
-                        verbose_ = true;
+                    }
+                } catch (const std::exception& e) {
+                    // std::stoi and friends, std::regex_error
+                    std::cerr << "Error: invalid argument: " << e.what() << std::endl;
+                    return 1;
+                }
+
+                if (!seeded) {
+                    seed_ = std::random_device{}();
+                }
+
+                if (list) {
+                    // list every kind of test unless filtered explicitly
+                    all = benchmarks = true;
+                }
+
+                // Tests named explicitly (by name, pattern, regex or tag) are selected regardless of their kind,
+                // otherwise -a and -b decide whether large tests and benchmarks are included.
+                bool explicit_selection = !patterns.empty() || !regexes.empty() || !tags.empty();
+                std::vector<std::string> tests_to_run;
+                for (const auto& t : tests_) {
+                    bool selected;
+                    if (explicit_selection) {
+                        selected = std::any_of(patterns.begin(), patterns.end(), [&](const std::string& p) { return glob_match(p.c_str(), t.first.c_str()); })
+                            || std::any_of(regexes.begin(), regexes.end(), [&](const std::regex& re) { return std::regex_search(t.first, re); })
+                            || std::any_of(tags.begin(), tags.end(), [&](const std::string& tag) { return t.second.has_tag(tag); });
+                    } else if (t.second.flags & LARGE_TEST) {
+                        selected = all;
+                    } else if (t.second.flags & BENCHMARK) {
+                        selected = benchmarks;
                     } else {
-                        std::string t;
-                        args.arg(t);
-                        if (!tests_.count(t)) {
-                            std::cerr << "Error: unknown test name `" << t << "'" << std::endl;
-                            return 1;
-                        }
-                        tests_to_run.push_back(t);
+                        selected = true;
+                    }
+
+                    if (selected && std::none_of(skip_tags.begin(), skip_tags.end(), [&](const std::string& tag) { return t.second.has_tag(tag); })) {
+                        tests_to_run.push_back(t.first);
                     }
                 }
 
-                if (tests_to_run.empty()) {
-                    for (const auto& t : tests_) {
-                        if (t.second.first & LARGE_TEST) {
-                            if (all)
-                                tests_to_run.push_back(t.first);
-                        } else if (t.second.first & BENCHMARK) {
-                            if (benchmarks)
-                                tests_to_run.push_back(t.first);
-                        } else {
-                            tests_to_run.push_back(t.first);
+                // tests_ is ordered by name, so every process computes the same shards
+                if (shards > 1) {
+                    std::vector<std::string> own;
+                    for (size_t i = shard; i < tests_to_run.size(); i += shards) {
+                        own.push_back(tests_to_run[i]);
+                    }
+                    tests_to_run.swap(own);
+                }
+
+                if (list) {
+                    std::cout << "Available tests {" << std::endl;
+                    for (const auto& name : tests_to_run) {
+                        std::cout << "    " << name;
+                        for (const auto& tag : tests_[name].tags) {
+                            std::cout << " #" << tag;
                         }
+                        std::cout << std::endl;
                     }
+                    std::cout << "}" << std::endl;
+                    return 0;
                 }
 
-                for (const auto& name : tests_to_run) {
-                    auto& test = tests_[name];
+                if (shuffle) {
+                    std::cout << "[SEED " << seed_ << "]" << std::endl;
+                }
 
-                    if (test.first & LARGE_TEST) {
-                        std::cout << "[LARGE TEST ";
-                    } else if (test.first & BENCHMARK) {
-                        std::cout << "[BENCHMARK ";
-                    } else {
-                        std::cout << "[SMALL TEST ";
+                unsigned failed = 0;
+                std::mt19937_64 rng(seed_);
+                for (unsigned round = 0; round < repeat; ++round) {
+                    if (shuffle) {
+                        std::shuffle(tests_to_run.begin(), tests_to_run.end(), rng);
+                    }
+                    if (repeat > 1) {
+                        std::cout << "[ROUND " << round + 1 << " of " << repeat << "]" << std::endl;
+                    }
+
+                    for (const auto& name : tests_to_run) {
+                        auto& test = tests_[name];
+
+                        if (test.flags & LARGE_TEST) {
+                            std::cout << "[LARGE TEST ";
+                        } else if (test.flags & BENCHMARK) {
+                            std::cout << "[BENCHMARK ";
+                        } else {
+                            std::cout << "[SMALL TEST ";
+                        }
+                        std::cout << name << "]" << std::endl;
+
+#if ATTO_HAVE_FORK
+                        bool ok = fork_ ? run_forked(name, test.flags, *test.test) : run_test(name, test.flags, *test.test);
+#else
+                        bool ok = run_test(name, test.flags, *test.test);
+#endif
+                        if (!ok) {
+                            ++failed;
+                        }
                     }
-                    std::cout << name << "]" << std::endl;
-
-                    hwtimer timer;
-                    try {
-                        test.second->run();
-                        std::cout << "[OK " << name << " in " << timer.delta() <<" seconds]" << std::endl;
-                    } catch (const error& err) {
-                        std::cerr << "[FAILED " << name << ": " << err.what() << " at line " << err.line() << "]" << std::endl;
+                }
+
+                if (failed) {
+                    std::cerr << "[FAILED " << failed << " of " << tests_to_run.size() * repeat << " tests";
+                    if (shuffle) {
+                        std::cerr << ", rerun with --seed " << seed_;
                     }
+                    std::cerr << "]" << std::endl;
+                    return 1;
                 }
 
                 return 0;
             }
 
-            void add(const std::string& name, unsigned flags, std::unique_ptr<unit_test_base> test) {
+            //! seed of this run, randomized tests should derive their random state from it
+            uint64_t seed() const {
+                return seed_;
+            }
+
+            void add(const std::string& name, unsigned flags, std::vector<std::string> tags, std::unique_ptr<unit_test_base> test) {
                 auto& t = tests_[name];
-                t.first = flags;
-                t.second.reset(test.release());
+                t.flags = flags;
+                t.tags = std::move(tags);
+                t.test = std::move(test);
             }
         };
 
@@ -235,8 +930,8 @@ namespace atto {
         template <typename Test>
         class test_register_helper {
         public:
-            test_register_helper(const char* name, unsigned flags) {
-                global_tests().add(name, flags, std::make_unique<Test>());
+            test_register_helper(const char* name, unsigned flags, std::initializer_list<const char*> tags = {}) {
+                global_tests().add(name, flags, std::vector<std::string>(tags.begin(), tags.end()), std::make_unique<Test>());
             }
         };
 
@@ -312,35 +1007,82 @@ namespace atto {
     }} \
     int main(int argc, const char* argv[]) { return ::atto::unittest::global_tests().run(argc, argv); }
 
-#define SMALL_TEST(Name) \
+#define SMALL_TEST(Name, ...) \
     class Name##__impl : public ::atto::unittest::unit_test_base { \
     public: \
         ~Name##__impl() override = default; \
         void run() override; \
     }; \
-    static ::atto::unittest::test_register_helper<Name##__impl> Name##__registrator{#Name, 0}; \
+    static ::atto::unittest::test_register_helper<Name##__impl> Name##__registrator{#Name, 0, {__VA_ARGS__}}; \
     void Name##__impl::run()
 
-#define TEST(Name) SMALL_TEST(Name)
+#define TEST(Name, ...) SMALL_TEST(Name, __VA_ARGS__)
 
-#define LARGE_TEST(Name) \
+#define LARGE_TEST(Name, ...) \
     class Name##__impl : public ::atto::unittest::unit_test_base { \
     public: \
         ~Name##__impl() override = default; \
         void run() override; \
     }; \
-    static ::atto::unittest::test_register_helper<Name##__impl> Name##__registrator{#Name, ::atto::unittest::LARGE_TEST}; \
+    static ::atto::unittest::test_register_helper<Name##__impl> Name##__registrator{#Name, ::atto::unittest::LARGE_TEST, {__VA_ARGS__}}; \
     void Name##__impl::run()
 
-#define BENCH(Name) \
+#define BENCH(Name, ...) \
     class Name##__impl : public ::atto::unittest::unit_test_base { \
     public: \
         ~Name##__impl() override = default; \
         void run() override; \
     }; \
-    static ::atto::unittest::test_register_helper<Name##__impl> Name##__registrator{#Name, ::atto::unittest::BENCHMARK}; \
+    static ::atto::unittest::test_register_helper<Name##__impl> Name##__registrator{#Name, ::atto::unittest::BENCHMARK, {__VA_ARGS__}}; \
     void Name##__impl::run()
 
+#define ATTO_FIXTURE_TEST(Fixture, Name, Flags, ...) \
+    class Name##__impl : public ::atto::unittest::unit_test_base, public Fixture { \
+    public: \
+        ~Name##__impl() override = default; \
+        void setup() override { Fixture::setup(); } \
+        void run() override; \
+        void teardown() override { Fixture::teardown(); } \
+    }; \
+    static ::atto::unittest::test_register_helper<Name##__impl> Name##__registrator{#Name, Flags, {__VA_ARGS__}}; \
+    void Name##__impl::run()
+
+#define SMALL_TEST_F(Fixture, Name, ...) ATTO_FIXTURE_TEST(Fixture, Name, 0, __VA_ARGS__)
+
+#define TEST_F(Fixture, Name, ...) SMALL_TEST_F(Fixture, Name, __VA_ARGS__)
+
+#define LARGE_TEST_F(Fixture, Name, ...) ATTO_FIXTURE_TEST(Fixture, Name, ::atto::unittest::LARGE_TEST, __VA_ARGS__)
+
+#define BENCH_F(Fixture, Name, ...) ATTO_FIXTURE_TEST(Fixture, Name, ::atto::unittest::BENCHMARK, __VA_ARGS__)
+
+#define ATTO_CONCAT_IMPL(a, b) a##b
+#define ATTO_CONCAT(a, b) ATTO_CONCAT_IMPL(a, b)
+
+//! run statement at the end of the enclosing scope
+#define DEFER(stmt) \
+    auto ATTO_CONCAT(atto_defer__, __LINE__) = ::atto::unittest::make_deferred([&]() { stmt; })
+
 #define CHECK(pred) \
     do { (::atto::unittest::check_helper(__LINE__, #pred) - pred)(); } while (0)
 
+// Lightweight checks for benchmark and stress loops. CHECK_* and ASSERT throw on failure,
+// EXPECT* only count the failure (thread-safe), the test is reported as failed at the end.
+#define ASSERT(pred) \
+    do { if (ATTO_UNLIKELY(!(pred))) ::atto::unittest::check_failed(true, __LINE__, #pred); } while (0)
+#define EXPECT(pred) \
+    do { if (ATTO_UNLIKELY(!(pred))) ::atto::unittest::check_failed(false, __LINE__, #pred); } while (0)
+
+#define CHECK_EQ(a, b) ::atto::unittest::check_eq(true, __LINE__, #a " == " #b, a, b)
+#define CHECK_NE(a, b) ::atto::unittest::check_ne(true, __LINE__, #a " != " #b, a, b)
+#define CHECK_LT(a, b) ::atto::unittest::check_lt(true, __LINE__, #a " < " #b, a, b)
+#define CHECK_LE(a, b) ::atto::unittest::check_le(true, __LINE__, #a " <= " #b, a, b)
+#define CHECK_GT(a, b) ::atto::unittest::check_gt(true, __LINE__, #a " > " #b, a, b)
+#define CHECK_GE(a, b) ::atto::unittest::check_ge(true, __LINE__, #a " >= " #b, a, b)
+
+#define EXPECT_EQ(a, b) ::atto::unittest::check_eq(false, __LINE__, #a " == " #b, a, b)
+#define EXPECT_NE(a, b) ::atto::unittest::check_ne(false, __LINE__, #a " != " #b, a, b)
+#define EXPECT_LT(a, b) ::atto::unittest::check_lt(false, __LINE__, #a " < " #b, a, b)
+#define EXPECT_LE(a, b) ::atto::unittest::check_le(false, __LINE__, #a " <= " #b, a, b)
+#define EXPECT_GT(a, b) ::atto::unittest::check_gt(false, __LINE__, #a " > " #b, a, b)
+#define EXPECT_GE(a, b) ::atto::unittest::check_ge(false, __LINE__, #a " >= " #b, a, b)
+